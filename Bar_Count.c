@@ -9,6 +9,7 @@ See LICENSE for code reuse permissions.
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <zlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -18,45 +19,149 @@ See LICENSE for code reuse permissions.
 #include "barcodes.h"
 #include "tags.h"
 #include "umis.h"
+#include "chemistry.h"
+#include "fastq.h"
+#include "pipeline.h"
+#include "spill.h"
+#include "collapse.h"
+#include "checkpoint.h"
+#include "state.h"
+#include "batch.h"
+#include "counts.h"
+#include "output.h"
+#include "metrics.h"
 
 #define MAX_FASTQ 100
 
+// option codes of the long only read geometry, state file, shard and lookup batch options
+#define OPT_BC_FIRST 256
+#define OPT_UMI_FIRST 257
+#define OPT_UMI_LEN 258
+#define OPT_TAG_FIRST 259
+#define OPT_TAG_WINDOW 260
+#define OPT_STATE 261
+#define OPT_SHARD 262
+#define OPT_LOOKUP_BATCH 263
+
+// marks a read geometry option that was not given
+#define GEOMETRY_UNSET -1000000
+
 // return string f_time with formatted current GMT (UTC)
 char* get_datetime(char* f_time);
 
+// "barcounter index": build the whitelist index and neighbor index of a whitelist once and write them to a whitelist index file for -w
+int index_command(int argc, char *argv[]);
+
+// "barcounter merge": merge the state files of several runs of a sample into tag counts without reading their fastq files again
+int merge_command(int argc, char *argv[]);
+
+// "barcounter batch": count every sample of a sample sheet in one process that loads the whitelist and taglist once
+int batch_command(int argc, char *argv[]);
+
 int main(int argc, char *argv[])
 {
+    // run subcommands
+    if (argc > 1 && strcmp(argv[1], "index") == 0)
+    {
+        return index_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "merge") == 0)
+    {
+        return merge_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "batch") == 0)
+    {
+        return batch_command(argc - 1, argv + 1);
+    }
+    // stage timings of the run outside the fastq processing threads
+    METRIC_ONLY(double run_start = metric_now();)
+    METRIC_ONLY(stage_metrics run_metrics = {0};)
+    METRIC_TIMER(stage_start);
+
     // format usage string
-    char *command = "./barcounter -w {barcode whitelist} -t {taglist} -1 {read1 fastqs} -2 {read2 fastqs} -o {output directory}";
-    char *summary = "BarCounter counts the number of valid read2 antibody derived tags (ADTs) that match tags in the user provided taglist.\nTag counts are generated for each read1 cell barcode that is present in the user provided whitelist.\nTags will be counted once per read1 Unique Molecular Identifier (UMI).";
-    char *description = "-w whitelist: list of valid cell barcodes (one per line) in .txt or .gz format\n-t taglist: list of valid ADTs and their names in .csv format (sequence,name)\n-1 read1: gzipped files in fastq format, comma separated file list with no spaces\n-2 read2: gzipped files in fastq format, comma separated file list with no spaces\n-o output directory: if the directory does not yet exist BarCounter will create it. All outputs will be created in this location.";
-    char usage[1000];
-    snprintf(usage, 1000, "%s\n\n%s\n\n%s\n", command, summary, description);
+    char command[] = "./barcounter index -w {barcode whitelist} [-o {whitelist index file}]\n./barcounter merge -o {output directory} -n {sample name} [-w {barcode whitelist}] [-f {csv|mtx|both}] [-u {exact|directional}] {state files}\n./barcounter batch -w {barcode whitelist} -t {taglist} -b {sample sheet} -o {output directory} [-p {threads}] [-j {concurrent samples}] [-f {csv|mtx|both}] [-c {chemistry}] [-u {exact|directional}] [--state]\n./barcounter -w {barcode whitelist} -t {taglist} -1 {read1 fastqs} -2 {read2 fastqs} -o {output directory} [-n {sample name}] [-p {threads}] [-s [-m {memory MB}]] [-f {csv|mtx|both}] [-c {chemistry}] [--tag-window {bases}] [-u {exact|directional}] [-k [-r]] [--state] [--shard {k/N}] [--lookup-batch {reads}]\n./barcounter -w {barcode whitelist} -t {taglist} -i {interleaved fastqs} -o {output directory} [-n {sample name}] [-p {threads}] [-s [-m {memory MB}]] [-f {csv|mtx|both}] [-c {chemistry}] [--tag-window {bases}] [-u {exact|directional}] [-k [-r]] [--state] [--shard {k/N}] [--lookup-batch {reads}]";
+    char summary[] = "BarCounter counts the number of valid read2 antibody derived tags (ADTs) that match tags in the user provided taglist.\nTag counts are generated for each read1 cell barcode that is present in the user provided whitelist.\nTags will be counted once per read1 Unique Molecular Identifier (UMI).";
+    char description[] = "-w whitelist: list of valid cell barcodes (one per line), plaintext or gzip, bgzip or zstd compressed, or a whitelist index file (.bcidx) built with barcounter index\n-t taglist: list of valid ADTs and their names in .csv format (sequence,name)\n-1 read1: fastq files, plaintext or gzip, bgzip or zstd compressed, comma separated file list with no spaces\n-2 read2: fastq files, plaintext or gzip, bgzip or zstd compressed, comma separated file list with no spaces\n-i interleaved: instead of -1 and -2, interleaved fastq files (each read1 record followed by its read2 record), comma separated file list with no spaces. Use - to read from standard input\n-n sample name: (optional) name used for the output files. Fastq file names are then not required to follow Illumina naming, so named pipes can be used with -1 and -2. Required with -i -\n-o output directory: if the directory does not yet exist BarCounter will create it. All outputs will be created in this location.\n-p threads: (optional) number of worker threads used to process read pairs, default 1. One additional thread reads the fastq files.\n-s sort dedup: (optional) deduplicate UMIs by sorting keys in memory bounded runs that are spilled to a temporary directory in the output directory and merged at the end\n-m memory: (optional) memory budget in MB for sort based deduplication, default 1024\n-f format: (optional) output format, csv (dense tag counts CSV, default), mtx (sparse Matrix Market directory with matrix.mtx.gz, barcodes.tsv.gz and features.tsv.gz) or both\n-c chemistry: (optional) read geometry preset, 10xv3 (default: barcode at base 1 and 12 base UMI at base 17 of read1, tag at base 1 of read2), 10xv2 (10 base UMI), totalseq-b (tag at base 11 of read2) or totalseq-c (10 base UMI, tag at base 11 of read2)\n--bc-first, --umi-first, --umi-len, --tag-first: (optional) override the 0 based barcode, UMI and tag offsets and the UMI length (at most 14) of the chemistry\n--tag-window window: (optional) search read2 for the tag up to this many bases before or after the tag offset when it is not found at the offset, default 0 (no search)\n-u UMI collapsing: (optional) exact (default, every distinct UMI is counted) or directional (UMIs one substitution away from a UMI with at least twice as many reads, minus one, are counted as the same molecule)\n-k checkpoint: (optional) write a checkpoint of each fastq pair to <output directory><sample>_BarCounter_checkpoint/ once it has been processed. Cannot be combined with -s\n-r resume: (optional) load the fastq pairs checkpointed by an interrupted run with the same inputs and settings instead of processing them again, and checkpoint the rest. Implies -k\n--state: (optional) also write the deduplicated UMIs and read counts of the run to <output directory><sample>_BarCounter" STATE_EXT ". State files of runs of the same sample, such as a top up sequencing run, are combined with barcounter merge. Cannot be combined with -s\n--shard k/N: (optional) count only the barcodes of shard k (0 to N - 1) of N, chosen by a hash of the packed barcode. Outputs are named <sample>_shard<k>of<N> and include a state file; merge the state files of all N shards with barcounter merge -w to get the tag counts of the whole sample\n--lookup-batch reads: (optional) number of reads whose whitelist and UMI lookups are prefetched together by each worker thread, 1 to 64, default 32. 1 looks up one read at a time";
+    // size the usage string from its parts so added options are never cut off, plus the 5 separating newlines
+    char usage[sizeof(command) + sizeof(summary) + sizeof(description) + 5];
+    snprintf(usage, sizeof(usage), "%s\n\n%s\n\n%s\n", command, summary, description);
 
     // initialize two dimensional array for tag sequences
     char tags[MAX_TAGS][TAG_LEN + 1];
     // initialize two dimensional array for tag names
     char names[MAX_TAGS][NAME_LEN + 1];
 
-    // track global variable for report
-    unsigned long long int total_reads = 0;
-    unsigned long long int valid_barcodes = 0;
-    unsigned long long int corrected_barcodes = 0;
-    unsigned long long int valid_tags = 0;
-
     // Verify command line arguments. If usage is incorrect print Usage and exit with code 1. Help option -h prints usage and exits the program.
     int a;
-    char *read1 = NULL, *read2 = NULL, *whitelist = NULL, *taglist = NULL, *outdir = NULL;
+    char *read1 = NULL, *read2 = NULL, *interleaved = NULL, *sample_name = NULL, *whitelist = NULL, *taglist = NULL, *outdir = NULL;
+    int threads = 1;
+    bool sort_dedup = false;
+    bool checkpoint = false;
+    bool resume = false;
+    bool save_state = false;
+    char *shard = NULL;
+    int lookup_batch = LOOKUP_BATCH_DEFAULT;
+    long memory_mb = SPILL_DEFAULT_MB;
+    char *format = "csv";
+    char *chemistry = DEFAULT_CHEMISTRY;
+    char *umi_collapse = "exact";
+    int bc_first = GEOMETRY_UNSET, umi_first = GEOMETRY_UNSET, umi_len = GEOMETRY_UNSET, tag_first = GEOMETRY_UNSET;
+    int tag_window = 0;
     bool help = false;
-    while ((a = getopt(argc, argv, "1:2:w:t:o:h")) != -1)
+    static struct option long_options[] = {
+        {"read1", required_argument, NULL, '1'},
+        {"read2", required_argument, NULL, '2'},
+        {"interleaved", required_argument, NULL, 'i'},
+        {"sample", required_argument, NULL, 'n'},
+        {"whitelist", required_argument, NULL, 'w'},
+        {"taglist", required_argument, NULL, 't'},
+        {"outdir", required_argument, NULL, 'o'},
+        {"threads", required_argument, NULL, 'p'},
+        {"sort-dedup", no_argument, NULL, 's'},
+        {"memory", required_argument, NULL, 'm'},
+        {"format", required_argument, NULL, 'f'},
+        {"chemistry", required_argument, NULL, 'c'},
+        {"bc-first", required_argument, NULL, OPT_BC_FIRST},
+        {"umi-first", required_argument, NULL, OPT_UMI_FIRST},
+        {"umi-len", required_argument, NULL, OPT_UMI_LEN},
+        {"tag-first", required_argument, NULL, OPT_TAG_FIRST},
+        {"tag-window", required_argument, NULL, OPT_TAG_WINDOW},
+        {"umi-collapse", required_argument, NULL, 'u'},
+        {"checkpoint", no_argument, NULL, 'k'},
+        {"resume", no_argument, NULL, 'r'},
+        {"state", no_argument, NULL, OPT_STATE},
+        {"shard", required_argument, NULL, OPT_SHARD},
+        {"lookup-batch", required_argument, NULL, OPT_LOOKUP_BATCH},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    while ((a = getopt_long(argc, argv, "1:2:i:n:w:t:o:p:sm:f:c:u:krh", long_options, NULL)) != -1)
     {
         switch(a)
         {
             case '1': read1 = optarg; break;
             case '2': read2 = optarg; break;
+            case 'i': interleaved = optarg; break;
+            case 'n': sample_name = optarg; break;
             case 't': taglist = optarg; break;
             case 'w': whitelist = optarg; break;
             case 'o': outdir = optarg; break;
+            case 'p': threads = atoi(optarg); break;
+            case 's': sort_dedup = true; break;
+            case 'm': memory_mb = atol(optarg); break;
+            case 'f': format = optarg; break;
+            case 'c': chemistry = optarg; break;
+            case 'u': umi_collapse = optarg; break;
+            case 'k': checkpoint = true; break;
+            case 'r': resume = true; checkpoint = true; break;
+            case OPT_BC_FIRST: bc_first = atoi(optarg); break;
+            case OPT_UMI_FIRST: umi_first = atoi(optarg); break;
+            case OPT_UMI_LEN: umi_len = atoi(optarg); break;
+            case OPT_TAG_FIRST: tag_first = atoi(optarg); break;
+            case OPT_TAG_WINDOW: tag_window = atoi(optarg); break;
+            case OPT_STATE: save_state = true; break;
+            case OPT_SHARD: shard = optarg; save_state = true; break;
+            case OPT_LOOKUP_BATCH: lookup_batch = atoi(optarg); break;
             case 'h': help = true; break;
         }
     }
@@ -80,20 +185,110 @@ int main(int argc, char *argv[])
         outdir[out_len+1] = '\0';
     }
 
-    // ensure all required args are provided
-    if (read1 == NULL || read2 == NULL || taglist == NULL || whitelist == NULL)
+    // ensure all required args are provided. Read pairs come from either -1 and -2 or -i
+    if (((read1 == NULL || read2 == NULL) && interleaved == NULL) || taglist == NULL || whitelist == NULL)
     {
         printf("Required argument is missing. Refer to Usage below:\n\n%s\n",usage);
         exit(1);
     }
+    if (interleaved != NULL && (read1 != NULL || read2 != NULL))
+    {
+        printf("-i cannot be combined with -1 or -2. Refer to Usage below:\n\n%s\n",usage);
+        exit(1);
+    }
+    // standard input has no file name to take the sample name from
+    if (interleaved != NULL && sample_name == NULL && strcmp(interleaved, FQ_STDIN) == 0)
+    {
+        printf("A sample name must be provided with -n when reading from standard input. Refer to Usage below:\n\n%s\n",usage);
+        exit(1);
+    }
+    // sorted runs hold the UMI keys of every fastq pair together, so they cannot be checkpointed per pair
+    if (checkpoint && sort_dedup)
+    {
+        printf("-k and -r cannot be combined with -s. Refer to Usage below:\n\n%s\n",usage);
+        exit(1);
+    }
+    // state files are written from the merged UMI set, which sorted runs never build
+    if (save_state && sort_dedup)
+    {
+        printf("--state and --shard cannot be combined with -s. Refer to Usage below:\n\n%s\n",usage);
+        exit(1);
+    }
+
+    // ensure the shard is k/N with k between 0 and N - 1
+    int shard_index = 0, shard_count = 1;
+    char shard_end;
+    if (shard != NULL && (sscanf(shard, "%i/%i%c", &shard_index, &shard_count, &shard_end) != 2 || shard_count < 1 || shard_count > MAX_SHARDS
+        || shard_index < 0 || shard_index >= shard_count))
+    {
+        printf("Invalid shard %s. Must be k/N with N between 1 and %i and k between 0 and N - 1. Exiting...\n", shard, MAX_SHARDS);
+        exit(44);
+    }
+
+    // ensure the number of worker threads is within range
+    if (threads < 1 || threads > MAX_THREADS)
+    {
+        printf("Number of threads must be between 1 and %i. Exiting...\n", MAX_THREADS);
+        exit(27);
+    }
+
+    // ensure the lookup batch is within range
+    if (lookup_batch < 1 || lookup_batch > LOOKUP_BATCH_MAX)
+    {
+        printf("Lookup batch must be between 1 and %i. Exiting...\n", LOOKUP_BATCH_MAX);
+        exit(45);
+    }
+
+    // ensure the memory budget for sort based deduplication is large enough
+    if (memory_mb < SPILL_MIN_MB)
+    {
+        printf("Memory budget must be at least %i MB. Exiting...\n", SPILL_MIN_MB);
+        exit(31);
+    }
+
+    // ensure the output format is known
+    bool write_csv = strcmp(format, "csv") == 0 || strcmp(format, "both") == 0;
+    bool write_mtx = strcmp(format, "mtx") == 0 || strcmp(format, "both") == 0;
+    if (!write_csv && !write_mtx)
+    {
+        printf("Unknown output format %s. Must be csv, mtx or both. Exiting...\n", format);
+        exit(33);
+    }
+
+    // ensure the UMI collapsing method is known
+    bool directional = strcmp(umi_collapse, "directional") == 0;
+    if (!directional && strcmp(umi_collapse, "exact") != 0)
+    {
+        printf("Unknown UMI collapsing method %s. Must be exact or directional. Exiting...\n", umi_collapse);
+        exit(37);
+    }
+
+    // look up the read geometry of the chemistry and apply any explicit offsets
+    read_geometry geometry;
+    if (!find_chemistry(chemistry, &geometry))
+    {
+        printf("Unknown chemistry %s. Must be 10xv3, 10xv2, totalseq-b or totalseq-c. Exiting...\n", chemistry);
+        exit(36);
+    }
+    bool custom_geometry = bc_first != GEOMETRY_UNSET || umi_first != GEOMETRY_UNSET || umi_len != GEOMETRY_UNSET || tag_first != GEOMETRY_UNSET;
+    geometry.bc_first = (bc_first != GEOMETRY_UNSET) ? bc_first : geometry.bc_first;
+    geometry.umi_first = (umi_first != GEOMETRY_UNSET) ? umi_first : geometry.umi_first;
+    geometry.umi_len = (umi_len != GEOMETRY_UNSET) ? umi_len : geometry.umi_len;
+    geometry.tag_first = (tag_first != GEOMETRY_UNSET) ? tag_first : geometry.tag_first;
+    geometry.tag_window = tag_window;
+    if (!check_geometry(&geometry))
+    {
+        printf("Invalid read geometry. Offsets and the tag window must be 0 or greater and the UMI length between 1 and %i. Exiting...\n", UMI_MAX_LEN);
+        exit(36);
+    }
 
-    // process all read1 fastq paths
+    // process all read1 fastq paths, or all interleaved fastq paths
     // read each comma delimited path into a variable
     char** paths1 = malloc(sizeof(char *) * MAX_FASTQ);
     char* name_token = NULL;
     int read1_count = 0;
 
-    name_token = strtok(read1, ",");
+    name_token = strtok(interleaved != NULL ? interleaved : read1, ",");
     // assign each path to pointer in char ** array "paths1"
     for (int v = 0; v < MAX_FASTQ; v++)
     {
@@ -112,12 +307,12 @@ int main(int argc, char *argv[])
         exit(2);
     }
 
-    // process all read2 fastq paths
+    // process all read2 fastq paths. Interleaved fastqs have no read2 paths
      // read each comma delimited path into a variable
-    char** paths2 = malloc(sizeof(char *) * MAX_FASTQ);
+    char** paths2 = calloc(MAX_FASTQ, sizeof(char *));
     name_token = NULL;
     int read2_count = 0;
-    name_token = strtok(read2, ",");
+    name_token = (interleaved != NULL) ? NULL : strtok(read2, ",");
     // assign each path to pointer in char ** array "paths2"
     for (int o = 0; o < MAX_FASTQ; o++)
     {
@@ -137,7 +332,7 @@ int main(int argc, char *argv[])
     }
 
     // verify that the same number of read1 and read2 fastq files were provided
-    if (read1_count != read2_count)
+    if (interleaved == NULL && read1_count != read2_count)
     {
         printf("The number of read1 and read2 fastq files are not equal. %i read1 files and %i read2 files were provided. Exiting...\n", read1_count, read2_count);
         exit(3);
@@ -145,6 +340,7 @@ int main(int argc, char *argv[])
 
     // verify that all fastq read pairs have the same sample name.
     // It is assumed that standard Illumina fastq naming convention (SampleName_S1_L001_R2_001.fastq.gz) is being adhered to and the first underscore delimited field is the sample_name.
+    // A sample name given with -n replaces these checks, so fastq files can be named pipes or have any other name.
     char r1_path[200];
     char r2_path[200];
     char *first_name = NULL;
@@ -157,12 +353,22 @@ int main(int argc, char *argv[])
     strcpy(check, basename(paths1[0]));
     check_name = strtok(check, "_");
 
-    for (int t = 0; t < read1_count; t++)
+    for (int t = 0; t < read1_count && sample_name == NULL; t++)
     {
         strcpy(r1_path, basename(paths1[t]));
+        first_name = strtok(r1_path, "_");
+        // interleaved fastqs hold both reads of each pair, so only the sample name is checked
+        if (interleaved != NULL)
+        {
+            if (strcmp(first_name, check_name) != 0)
+            {
+                printf("Input fastqs must have the same sample name. Exiting...\n");
+                exit(4);
+            }
+            continue;
+        }
         strcpy(r2_path, basename(paths2[t]));
 
-        first_name = strtok(r1_path, "_");
         for (int q = 0; q < 3; q++)
         {
             read1_num = strtok(NULL, "_");
@@ -192,6 +398,17 @@ int main(int argc, char *argv[])
         }
 
     }
+    if (sample_name != NULL)
+    {
+        first_name = sample_name;
+    }
+    // every output of a shard is named after its shard, so the shards of a sample can share an output directory
+    char shard_name[300];
+    if (shard != NULL)
+    {
+        snprintf(shard_name, 300, "%s_shard%iof%i", first_name, shard_index, shard_count);
+        first_name = shard_name;
+    }
 
     // prepare log file
     // declare string to store formatted time
@@ -204,25 +421,53 @@ int main(int argc, char *argv[])
     printf("\nBarCounter is being run by %s with the following arguments:\n", user);
     printf("\t-w %s (whitelist)\n", whitelist);
     printf("\t-t %s (taglist)\n", taglist);
-    printf("\t-1 (read1 fastq)\n");
+    printf(interleaved != NULL ? "\t-i (interleaved fastq)\n" : "\t-1 (read1 fastq)\n");
     for (int a = 0; a < read1_count; a++)
     {
         printf("\t\t%s\n", paths1[a]);
     }
-    printf("\n\t-2 (read2 fastq)\n");
+    if (interleaved == NULL)
+    {
+        printf("\n\t-2 (read2 fastq)\n");
+    }
     for (int b = 0; b < read2_count; b++)
     {
         printf("\t\t%s\n", paths2[b]);
     }
     printf("\n\t-o %s (output directory)\n", outdir);
+    if (sample_name != NULL)
+    {
+        printf("\t-n %s (sample name)\n", sample_name);
+    }
+    printf("\t-p %i (threads)\n", threads);
+    if (sort_dedup)
+    {
+        printf("\t-s -m %li (sort based deduplication, memory budget in MB)\n", memory_mb);
+    }
+    printf("\t-f %s (output format)\n", format);
+    printf("\t-c %s%s (chemistry: barcode at %i, UMI of length %i at %i in read1, tag at %i in read2)\n", geometry.name, custom_geometry ? " with custom offsets" : "", geometry.bc_first, geometry.umi_len, geometry.umi_first, geometry.tag_first);
+    if (geometry.tag_window > 0)
+    {
+        printf("\t--tag-window %i (tag search window)\n", geometry.tag_window);
+    }
+    printf("\t-u %s (UMI collapsing)\n", umi_collapse);
+    if (checkpoint)
+    {
+        printf(resume ? "\t-k -r (checkpoint and resume)\n" : "\t-k (checkpoint)\n");
+    }
     printf("\n");
 
-    // check fastq paths to ensure that each fastq file exists
+    // check fastq paths to ensure that each fastq file exists. Standard input can only be read once
     struct stat st;
     int is_file = -1;
+    int stdin_count = 0;
     // check read 1 fastqs
     for (int f = 0; f < read1_count; f++)
     {
+        if (strcmp(paths1[f], FQ_STDIN) == 0 && stdin_count++ == 0)
+        {
+            continue;
+        }
         is_file = stat(paths1[f], &st);
         // Check for file existence
         if (is_file != 0)
@@ -234,6 +479,10 @@ int main(int argc, char *argv[])
     // check read 2 fastqs
     for (int g = 0; g < read2_count; g++)
     {
+        if (strcmp(paths2[g], FQ_STDIN) == 0 && stdin_count++ == 0)
+        {
+            continue;
+        }
         is_file = stat(paths2[g], &st);
         // Check for file existence
         if (is_file != 0)
@@ -254,57 +503,92 @@ int main(int argc, char *argv[])
         dir_exists = true;
         }
 
-    // open log file for writing
-    FILE *p_logfile = fopen(log_file, "w");
+    // open log file for writing. A resumed run appends to the log of the interrupted run
+    FILE *p_logfile = fopen(log_file, resume ? "a" : "w");
 
     fprintf(p_logfile, "%s\tBarCounter is being run by %s\n", get_datetime(f_time), user);
     fprintf(p_logfile, "%s\t-w %s (whitelist)\n", get_datetime(f_time), whitelist);
     fprintf(p_logfile, "%s\t-t %s (taglist)\n", get_datetime(f_time), taglist);
-    fprintf(p_logfile, "%s\t-1 (read1 fastq)\n", get_datetime(f_time));
+    fprintf(p_logfile, interleaved != NULL ? "%s\t-i (interleaved fastq)\n" : "%s\t-1 (read1 fastq)\n", get_datetime(f_time));
     for (int c = 0; c < read1_count; c++)
     {
         fprintf(p_logfile, "\t\t\t\t%s\n", paths1[c]);
     }
-    fprintf(p_logfile, "%s\t-2 (read2 fastq)\n", get_datetime(f_time));
+    if (interleaved == NULL)
+    {
+        fprintf(p_logfile, "%s\t-2 (read2 fastq)\n", get_datetime(f_time));
+    }
     for (int d = 0; d < read2_count; d++)
     {
         fprintf(p_logfile, "\t\t\t\t%s\n", paths2[d]);
     }
     fprintf(p_logfile, "%s\t-o %s (output directory)\n", get_datetime(f_time), outdir);
+    if (sample_name != NULL)
+    {
+        fprintf(p_logfile, "%s\t-n %s (sample name)\n", get_datetime(f_time), sample_name);
+    }
+    fprintf(p_logfile, "%s\t-p %i (threads)\n", get_datetime(f_time), threads);
+    fprintf(p_logfile, "%s\t--lookup-batch %i (reads looked up together)\n", get_datetime(f_time), lookup_batch);
+    if (sort_dedup)
+    {
+        fprintf(p_logfile, "%s\t-s -m %li (sort based deduplication, memory budget in MB)\n", get_datetime(f_time), memory_mb);
+    }
+    fprintf(p_logfile, "%s\t-f %s (output format)\n", get_datetime(f_time), format);
+    fprintf(p_logfile, "%s\t-c %s%s (chemistry: barcode at %i, UMI of length %i at %i in read1, tag at %i in read2)\n", get_datetime(f_time), geometry.name, custom_geometry ? " with custom offsets" : "", geometry.bc_first, geometry.umi_len, geometry.umi_first, geometry.tag_first);
+    if (geometry.tag_window > 0)
+    {
+        fprintf(p_logfile, "%s\t--tag-window %i (tag search window)\n", get_datetime(f_time), geometry.tag_window);
+    }
+    fprintf(p_logfile, "%s\t-u %s (UMI collapsing)\n", get_datetime(f_time), umi_collapse);
+    if (checkpoint)
+    {
+        fprintf(p_logfile, resume ? "%s\t-k -r (checkpoint and resume)\n" : "%s\t-k (checkpoint)\n", get_datetime(f_time));
+    }
+    if (shard != NULL)
+    {
+        fprintf(p_logfile, "%s\t--shard %i/%i (count only the barcodes of shard %i of %i)\n", get_datetime(f_time), shard_index, shard_count, shard_index, shard_count);
+    }
+    else if (save_state)
+    {
+        fprintf(p_logfile, "%s\t--state (write state file)\n", get_datetime(f_time));
+    }
     if (dir_exists == false){
             fprintf(p_logfile, "%s\tOutput directory %s doesn't exist. Creating %s\n", get_datetime(f_time), outdir,outdir);
         } else {
             fprintf(p_logfile, "%s\tOutput will be written to existing directory %s\n", get_datetime(f_time), outdir);
         }
 
-    // format output CSV file
+    // format output CSV file and Matrix Market directory
     char counts_file[500];
     snprintf(counts_file, 500, "%s%s_Tag_Counts.csv", outdir, first_name);
+    char mtx_dir[500];
+    snprintf(mtx_dir, 500, "%s%s_Tag_Counts/", outdir, first_name);
+    char state_file[500];
+    snprintf(state_file, 500, "%s%s_BarCounter" STATE_EXT, outdir, first_name);
+#ifdef BARCOUNTER_METRICS
+    char metrics_file[500];
+    snprintf(metrics_file, 500, "%s%s_BarCounter_metrics.json", outdir, first_name);
+#endif
 
     printf("Log file will be %s\n", log_file);
-    printf("ADT counts will be written to %s\n\n", counts_file);
-    fprintf(p_logfile, "%s\tADT counts will be written to %s\n", get_datetime(f_time), counts_file);
-
-    // check if whitelist file is gzipped or plaintext format
-    char *ext = NULL;
-    ext = strrchr(whitelist, '.');
-    bool gzipped;
-    if (strcmp(ext, ".gz") == 0)
+    if (write_csv)
     {
-        gzipped = true;
+        printf("ADT counts will be written to %s\n", counts_file);
+        fprintf(p_logfile, "%s\tADT counts will be written to %s\n", get_datetime(f_time), counts_file);
     }
-    else if (strcmp(ext, ".txt") == 0)
+    if (write_mtx)
     {
-        gzipped = false;
-    }
-    else
-    {
-        printf("Unknown whitelist file extension %s. Exiting...\n", ext);
-        fprintf(p_logfile, "%s\tUnknown whitelist file extension %s\n", get_datetime(f_time), ext);
-        exit(8);
+        printf("Sparse ADT counts will be written to %s\n", mtx_dir);
+        fprintf(p_logfile, "%s\tSparse ADT counts will be written to %s\n", get_datetime(f_time), mtx_dir);
     }
+    printf("\n");
+
+    // a whitelist with the whitelist index extension is a precompiled whitelist index, the format of any other whitelist is detected from its contents
+    char *ext = strrchr(whitelist, '.');
+    bool whitelist_mapped = (ext != NULL && strcmp(ext, BC_INDEX_EXT) == 0);
 
     // load CSV taglist tags into array "tags" and names into array "names"
+    METRIC_START(stage_start, true);
     int t_count = load_taglist(taglist, tags, names);
     // ensure taglist is not empty
     if (t_count == 0)
@@ -316,296 +600,783 @@ int main(int argc, char *argv[])
     // ensure adequate hamming distance between tags
     check_tag_dist(tags, t_count);
 
-    // declare root nodes for each trie
-    bc_node* bc_root = NULL;
-    tag_node* tag_root = NULL;
-    umi_node* umi_root = NULL;
-
-    // create root node for each trie
-    bc_root = calloc(1, sizeof(bc_node));
-    tag_root = calloc(1, sizeof(tag_node));
-    umi_root = calloc(1, sizeof(umi_node));
+    // declare the tag index, the whitelist index, the tag count matrix and the merged UMI set. The UMI set of the first fastq pair becomes the merged UMI set.
+    bc_index whitelist_index;
+    count_matrix tag_counts;
+    tag_index tag_lookup;
+    umi_set umis;
 
-    // load taglist into tag trie
-    if (!load_tag_trie(tags, tag_root, t_count))
+    // load taglist into the tag index
+    if (!load_tag_index(tags, &tag_lookup, t_count))
     {
         printf("Failed to load all tags for processing. Exiting...\n");
         fprintf(p_logfile, "%s\tFailed to load all tags for processing. Exiting...\n", get_datetime(f_time));
         exit(18);
     }
 
-    if (gzipped == true)
+    // map a precompiled whitelist index, or load plaintext or compressed whitelist barcodes into the whitelist index
+    bool whitelist_loaded = whitelist_mapped ? map_bc_index_file(whitelist, &whitelist_index) : load_bc_index(whitelist, &whitelist_index);
+    if (!whitelist_loaded)
     {
-        // load gzipped whitelist barcodes into barcode trie
-        if (!load_bc_trie_gzipped(whitelist, bc_root, t_count))
-        {
-            printf("Failed to load barcodes for processing. Exiting...\n");
-            fprintf(p_logfile, "%s\tFailed to load barcodes for processing. Exiting...\n", get_datetime(f_time));
-            exit(21);
-        }
-    } else {
-        // load plaintext whitelist barcodes into barcode trie
-        if (!load_bc_trie(whitelist, bc_root, t_count))
-        {
-            printf("Failed to load barcodes for processing. Exiting...\n");
-            fprintf(p_logfile, "%s\tFailed to load barcodes for processing. Exiting...\n", get_datetime(f_time));
-            exit(21);
-        }
+        printf("Failed to load barcodes for processing. Exiting...\n");
+        fprintf(p_logfile, "%s\tFailed to load barcodes for processing. Exiting...\n", get_datetime(f_time));
+        exit(21);
     }
+    METRIC_STOP(&run_metrics, STAGE_LOAD, stage_start, true);
 
-    // initilize variables for fastq parsing
-    char curr_bc[BC_LEN + 1];
-    char curr_umi[UMI_LEN + 1];
-    char curr_tag[TAG_LEN + 1];
-    int tag_index = -1;
-    bc_node* p_bc = NULL;
-
-    char R1_ID[200];
-    char R1_seq[200];
-    char R1_spacer[10];
-    char R1_quals[200];
+    // tag count rows are only allocated for barcodes that are counted
+    if (!init_count_matrix(&tag_counts, whitelist_index.n_barcodes, t_count))
+    {
+        printf("Failed to allocate memory for tag counts. Exiting...\n");
+        fprintf(p_logfile, "%s\tFailed to allocate memory for tag counts. Exiting...\n", get_datetime(f_time));
+        exit(30);
+    }
 
-    char R2_ID[200];
-    char R2_seq[200];
-    char R2_spacer[10];
-    char R2_quals[200];
+    // initialize the context shared by the fastq processing threads
+    count_ctx ctx;
+    ctx.bc_index = &whitelist_index;
+    ctx.tag_index = &tag_lookup;
+    ctx.t_count = t_count;
+    ctx.spill = NULL;
+    ctx.geometry = geometry;
+    ctx.shard_index = shard_index;
+    ctx.shard_count = shard_count;
+    ctx.lookup_batch = lookup_batch;
+    ctx.run_id = checkpoint ? checkpoint_run_id(&whitelist_index, tags, t_count, &geometry, directional || save_state) : 0;
+
+    // checkpoints of each fastq pair are written to their own directory, which is removed once the tag counts have been written
+    char ckpt_dir[500];
+    snprintf(ckpt_dir, 500, "%s%s_BarCounter_checkpoint/", outdir, first_name);
+    if (checkpoint && stat(ckpt_dir, &st) == -1 && mkdir(ckpt_dir, 0777) != 0)
+    {
+        printf("Failed to create checkpoint directory %s. Exiting...\n", ckpt_dir);
+        fprintf(p_logfile, "%s\tFailed to create checkpoint directory %s. Exiting...\n", get_datetime(f_time), ckpt_dir);
+        exit(38);
+    }
 
-    // set variable for mismatch testing: "tstart" is first base to test (index of bases), "test_n" is number of bases to test (4 only if base is N).
-    char bases[4] = "ACGT";
-    char temp[BC_LEN + 1];
-    int tstart;
-    int test_n;
+    // in sort mode the UMI keys of every fastq pair go to sorted runs in a temporary directory instead of the in-memory UMI sets
+    key_spill spill;
+    if (sort_dedup)
+    {
+        char spill_dir[SPILL_PATH_LEN];
+        snprintf(spill_dir, SPILL_PATH_LEN, "%s%s_BarCounter_tmp/", outdir, first_name);
+        if (!init_key_spill(&spill, spill_dir, memory_mb, directional ? geometry.umi_len : 0))
+        {
+            printf("Failed to prepare sort based deduplication in %s. Exiting...\n", spill_dir);
+            fprintf(p_logfile, "%s\tFailed to prepare sort based deduplication in %s. Exiting...\n", get_datetime(f_time), spill_dir);
+            exit(32);
+        }
+        ctx.spill = &spill;
+    }
+    count_stats stats = {0};
 
     printf("\nBeginning fastq processing\n");
     fprintf(p_logfile, "%s\tBeginning fastq processing\n", get_datetime(f_time));
 
-    // loop through each fastq read pair and process
+    // process all fastq read pairs concurrently, each pair is deduplicated into its own UMI set. Reads are counted per UMI for collapsing and state files.
+    // Pairs read from standard input cannot be read again, so they are never checkpointed.
+    lane_job* jobs = malloc(sizeof(lane_job) * read1_count);
+    char (*ckpt_files)[600] = malloc(sizeof(*ckpt_files) * read1_count);
     for (int x = 0; x < read1_count; x++)
     {
-
-        // open input gzipped fastq files for reading
-        gzFile pinR1 = gzopen(paths1[x], "r");
-        gzFile pinR2 = gzopen(paths2[x], "r");
-
-        // ensure all file pointers are valid
-        if (pinR1 == NULL)
+        init_lane_job(&jobs[x], paths1[x], paths2[x], directional || save_state);
+        if (!checkpoint || strcmp(paths1[x], FQ_STDIN) == 0 || (paths2[x] != NULL && strcmp(paths2[x], FQ_STDIN) == 0))
         {
-            printf("Cannot open read1 fastq file %s\n", paths1[x]);
-            fprintf(p_logfile, "%s\tCannot open read1 fastq file %s\n", get_datetime(f_time), paths1[x]);
-            exit(22);
+            continue;
         }
-        if (pinR2 == NULL)
+        snprintf(ckpt_files[x], 600, "%spair_%03i%s", ckpt_dir, x + 1, CKPT_EXT);
+        jobs[x].checkpoint = ckpt_files[x];
+        if (resume && read_checkpoint(ckpt_files[x], &jobs[x], ctx.run_id))
         {
-            printf("Cannot open read2 fastq file %s\n", paths2[x]);
-            fprintf(p_logfile, "%s\tCannot open read2 fastq file %s\n", get_datetime(f_time), paths2[x]);
-            exit(23);
+            printf("Resumed fastq pair %i (%s) from checkpoint %s\n", x + 1, paths1[x], ckpt_files[x]);
+            fprintf(p_logfile, "%s\tResumed fastq pair %i (%s) from checkpoint %s\n", get_datetime(f_time), x + 1, paths1[x], ckpt_files[x]);
         }
-        printf("\nOpened input fastq files:\n%s\n%s\n\n",paths1[x],paths2[x]);
-        fprintf(p_logfile, "%s\tOpened read1 fastq file %s\n", get_datetime(f_time), paths1[x]);
-        fprintf(p_logfile, "%s\tOpened read2 fastq file %s\n", get_datetime(f_time), paths2[x]);
-
+    }
+    count_fastq_lanes(jobs, read1_count, &ctx, threads);
 
-        // read input fastq files read by read and check if value is in trie
-        while (true)
+    // merge the UMI sets of each fastq pair in order and credit the tag counts of every unique barcode/UMI/tag combination.
+    // When collapsing, the read counts of the UMIs are merged and tag counts are credited once every pair has been merged.
+    unsigned long long int collapsed_umis = 0;
+    METRIC_START(stage_start, true);
+    for (int x = 0; x < read1_count; x++)
+    {
+        switch (jobs[x].status)
         {
-            // assign each line of reach for each fastq file to variables
-            // if any fastq files return NULL from gzgets the EOF has been reached, break the loop
-            if (!gzgets(pinR1, R1_ID, 200))
-            {
-                break;
-            }
-            gzgets(pinR1, R1_seq, 200);
-            gzgets(pinR1, R1_spacer, 10);
-            gzgets(pinR1, R1_quals, 200);
-            if (!gzgets(pinR2, R2_ID, 200))
-            {
-                break;
-            }
-            gzgets(pinR2, R2_seq, 200);
-            gzgets(pinR2, R2_spacer, 10);
-            gzgets(pinR2, R2_quals, 200);
-
-            // update read count
-            total_reads++;
-
-            // parse read1 seq to assign cell barcode and UMI
-            for (int b = 0; b < BC_LEN; b++)
-            {
-                curr_bc[b] = R1_seq[BC_FIRST + b];
-                curr_bc[BC_LEN] = '\0';
-            }
-            for (int u = 0; u < UMI_LEN; u++)
-            {
-                curr_umi[u] = R1_seq[UMI_FIRST + u];
-                curr_umi[UMI_LEN] = '\0';
-            }
-            // parse read2 seq to assign tag
-            for (int t = 0; t < TAG_LEN; t++)
-            {
-                curr_tag[t] = R2_seq[TAG_FIRST + t];
-                curr_tag[TAG_LEN] = '\0';
-            }
-
-            // ensure barcode is valid and in whitelist
-            p_bc = get_bc_leaf(curr_bc, bc_root, BC_LEN);
+            case 22:
+                printf("Cannot open read1 fastq file %s\n", paths1[x]);
+                fprintf(p_logfile, "%s\tCannot open read1 fastq file %s\n", get_datetime(f_time), paths1[x]);
+                exit(22);
+            case 23:
+                printf("Cannot open read2 fastq file %s\n", paths2[x]);
+                fprintf(p_logfile, "%s\tCannot open read2 fastq file %s\n", get_datetime(f_time), paths2[x]);
+                exit(23);
+            case 28:
+                printf("Failed to create fastq processing threads. Exiting...\n");
+                fprintf(p_logfile, "%s\tFailed to create fastq processing threads. Exiting...\n", get_datetime(f_time));
+                exit(28);
+            case 29:
+                printf("Failed to decompress fastq files %s and %s. Exiting...\n", paths1[x], interleaved != NULL ? "(interleaved)" : paths2[x]);
+                fprintf(p_logfile, "%s\tFailed to decompress fastq files %s and %s. Exiting...\n", get_datetime(f_time), paths1[x], interleaved != NULL ? "(interleaved)" : paths2[x]);
+                exit(29);
+            case 46:
+                printf("Read1 fastq file %s and read2 fastq file %s contain different numbers of reads. Exiting...\n", paths1[x], paths2[x]);
+                fprintf(p_logfile, "%s\tRead1 fastq file %s and read2 fastq file %s contain different numbers of reads. Exiting...\n", get_datetime(f_time), paths1[x], paths2[x]);
+                exit(46);
+        }
+        if (interleaved != NULL)
+        {
+            printf("\nProcessed input fastq file:\n%s\n\n",paths1[x]);
+            fprintf(p_logfile, "%s\tProcessed interleaved fastq file %s\n", get_datetime(f_time), paths1[x]);
+        } else {
+            printf("\nProcessed input fastq files:\n%s\n%s\n\n",paths1[x],paths2[x]);
+            fprintf(p_logfile, "%s\tProcessed read1 fastq file %s\n", get_datetime(f_time), paths1[x]);
+            fprintf(p_logfile, "%s\tProcessed read2 fastq file %s\n", get_datetime(f_time), paths2[x]);
+        }
 
-            // allow for single mismatch at low quality basecall in barcode. Track correct barcode in bc_node pointer. */
-            if (p_bc == NULL)
-            {
-                // copy barcode seq to temp and check mismatches at low quality bases
-                strncpy(temp, curr_bc, BC_LEN + 1);
-                test_n = 3;
-
-                for (int m = 0; m < BC_LEN; m++)
-                {
-                    // check if basecall is below quality score of 20
-                    if (R1_quals[m] < LOW_Q)
-                    {
-                        // check barcode string with each of the three remaining bases substituted at postion m
-                        switch(temp[m])
-                        {
-                            case 'A': tstart = 1; break;
-                            case 'C': tstart = 2; break;
-                            case 'G': tstart = 3; break;
-                            case 'T': tstart = 4; break;
-                            // test all four bases in case of N
-                            case 'N': test_n = 4; tstart = 0; break;
-                        }
-                        for (int r = 0; r < test_n; r++)
-                        {
-                            temp[m] = bases[(tstart+r)%4];
-
-                            // if temp barcode with one mismatch corresponds to a sample, update out_s and break
-                            p_bc = get_bc_leaf(temp, bc_root, BC_LEN);
-                            if (p_bc != NULL)
-                            {
-                                break;
-                            }
-                        }
-                    }
-                    temp[m] = curr_bc[m];
-                    // if match has been found break main loop
-                    if (p_bc != NULL)
-                    {
-                        corrected_barcodes++;
-                        break;
-                    }
-                }
-            }
-            if (p_bc != NULL)
+        if (x == 0)
+        {
+            umis = jobs[x].umis;
+            if (!sort_dedup && !directional)
             {
-                // update valid barcode count
-                valid_barcodes++;
-
-                // ensure read2 seq is in the taglist
-                tag_index = get_tag_index(curr_tag, tag_root);
-                if (tag_index != -1)
-                {
-                    valid_tags++;
-
-                    // if UMI added for barcode: update cell barcode tag counts
-                    if (add_umi(curr_umi, umi_root, t_count, tag_index, curr_bc))
-                    {
-                        // update cell barcode tag count
-                        p_bc->counts[tag_index]++;
-                        p_bc->total++;
-                    }
-                }
+                count_umi_set(&umis, &tag_counts);
             }
+        } else {
+            merge_umi_set(&umis, &jobs[x].umis, directional ? NULL : &tag_counts);
+            unload_umi_set(&jobs[x].umis);
         }
-        gzclose(pinR1);
-        gzclose(pinR2);
+        stats.total_reads += jobs[x].stats.total_reads;
+        stats.valid_barcodes += jobs[x].stats.valid_barcodes;
+        stats.corrected_barcodes += jobs[x].stats.corrected_barcodes;
+        stats.valid_tags += jobs[x].stats.valid_tags;
+        stats.ambiguous_barcodes += jobs[x].stats.ambiguous_barcodes;
+        stats.shifted_tags += jobs[x].stats.shifted_tags;
+        METRIC_ONLY(merge_stage_metrics(&stats.metrics, &jobs[x].stats.metrics);)
+        free_lane_job(&jobs[x]);
     }
 
-    // write tag counts to output CSV file
-    FILE *out_counts = fopen(counts_file, "w");
-    // write counts by re-reading whitelist file
-    gzFile p_white = gzopen(whitelist, "r");
-    int i;
-    char barcode[20];
-    p_bc = NULL;
-
-    // write header
-    fprintf(out_counts, "cell_barcode,total");
-    for (int n = 0; n < t_count; n++)
+    // merge the sorted runs and count every unique barcode/UMI/tag combination once
+    if (sort_dedup)
+    {
+        int n_runs = spill.n_runs + (spill.n_keys > 0 ? 1 : 0);
+        printf("Merging %i sorted UMI runs\n", n_runs);
+        if (!merge_key_spill(&spill, &tag_counts))
+        {
+            printf("Failed to merge sorted UMI runs in %s. Exiting...\n", spill.dir);
+            fprintf(p_logfile, "%s\tFailed to merge sorted UMI runs in %s. Exiting...\n", get_datetime(f_time), spill.dir);
+            exit(32);
+        }
+        fprintf(p_logfile, "%s\tMerged %i sorted UMI runs\n", get_datetime(f_time), n_runs);
+        collapsed_umis = spill.collapsed;
+        free_key_spill(&spill);
+    }
+    // collapse the UMIs of each barcode/tag combination, dividing the barcodes between the worker threads
+    else if (directional)
     {
-        fprintf(out_counts,",%s", names[n]);
+        printf("Collapsing UMIs\n");
+        if (!collapse_umi_set(&umis, geometry.umi_len, &tag_counts, threads, &collapsed_umis))
+        {
+            printf("Failed to allocate memory for UMI collapsing. Exiting...\n");
+            fprintf(p_logfile, "%s\tFailed to allocate memory for UMI collapsing. Exiting...\n", get_datetime(f_time));
+            exit(30);
+        }
     }
-    fprintf(out_counts, "\n");
+    METRIC_STOP(&run_metrics, STAGE_MERGE, stage_start, true);
 
-    while (true)
+    // save the merged UMI set so later runs of the sample can be merged with this one
+    if (save_state)
     {
-        // read line of whitelist into 'barcode'
-        gzgets(p_white, barcode, 20);
-        barcode[16] = '\0';
+        if (!write_state_file(state_file, &umis, &whitelist_index, tags, names, t_count, geometry.umi_len, &stats, shard_index, shard_count))
+        {
+            printf("Failed to write state file %s. Exiting...\n", state_file);
+            fprintf(p_logfile, "%s\tFailed to write state file %s. Exiting...\n", get_datetime(f_time), state_file);
+            exit(39);
+        }
+        printf("State written to %s\n", state_file);
+        fprintf(p_logfile, "%s\tState written to %s\n", get_datetime(f_time), state_file);
+    }
 
-        // break when the end of the whitelist is reached
-        if (gzeof(p_white))
+    // write tag counts as a dense CSV and/or a sparse Matrix Market directory
+    METRIC_START(stage_start, true);
+    if (write_csv)
+    {
+        if (!write_counts_csv(counts_file, &whitelist_index, &tag_counts, names, t_count))
         {
-            break;
+            printf("Failed to write tag counts to %s. Exiting...\n", counts_file);
+            fprintf(p_logfile, "%s\tFailed to write tag counts to %s. Exiting...\n", get_datetime(f_time), counts_file);
+            exit(34);
+        }
+    }
+    if (write_mtx)
+    {
+        if (!write_counts_mtx(mtx_dir, &whitelist_index, &tag_counts, tags, names, t_count))
+        {
+            printf("Failed to write tag counts to %s. Exiting...\n", mtx_dir);
+            fprintf(p_logfile, "%s\tFailed to write tag counts to %s. Exiting...\n", get_datetime(f_time), mtx_dir);
+            exit(34);
         }
+    }
+    METRIC_STOP(&run_metrics, STAGE_OUTPUT, stage_start, true);
 
-        p_bc = get_bc_leaf(barcode, bc_root, BC_LEN);
-        if (p_bc != NULL)
+    // the checkpoints are no longer needed once the tag counts are written
+    if (checkpoint)
+    {
+        for (int x = 0; x < read1_count; x++)
         {
-            // only write cell barcodes with counts
-            if (p_bc->total != 0)
+            if (jobs[x].checkpoint != NULL)
             {
-                fprintf(out_counts, "%s,%li", barcode, p_bc->total);
-                for (int fg = 0; fg < t_count; fg++)
-                {
-                    fprintf(out_counts, ",%i", p_bc->counts[fg]);
-                }
-                fprintf(out_counts, "\n");
+                remove(jobs[x].checkpoint);
             }
         }
+        rmdir(ckpt_dir);
     }
-    gzclose(p_white);
-    fclose(out_counts);
+    free(ckpt_files);
 
-    // unload UMI trie
-    if (!unload_umi_trie(umi_root, t_count))
+    // unload UMI set
+    if (!unload_umi_set(&umis))
     {
         printf("UMIs failed to unload\n");
         fprintf(p_logfile, "%s\tUMIs failed to unload\n", get_datetime(f_time));
     }
-    // unload barcode trie
-    if (!unload_bc_trie(bc_root))
+    // unload tag counts and whitelist index
+    free_count_matrix(&tag_counts);
+    if (!unload_bc_index(&whitelist_index))
     {
         printf("Barcodes failed to unload\n");
         fprintf(p_logfile, "%s\tBarcodes failed to unload\n", get_datetime(f_time));
     }
-    // unload tag trie
-    if (!unload_tag_trie(tag_root))
+    // unload tag index
+    if (!unload_tag_index(&tag_lookup))
     {
         printf("Tags failed to unload\n");
         fprintf(p_logfile, "%s\tTags failed to unload\n", get_datetime(f_time));
     }
 
     printf("Processing complete\n");
-    printf("Total reads processed: %lli\n", total_reads);
-    printf("Uncorrected barcodes: %lli\n", valid_barcodes - corrected_barcodes);
-    printf("Corrected barcodes: %lli\n", corrected_barcodes);
-    printf("Total Valid barcodes: %lli\n", valid_barcodes);
-    printf("Valid tags: %lli\n", valid_tags);
+    if (shard != NULL)
+    {
+        printf("Statistics of shard %i of %i (reads without a whitelist barcode are counted by shard 0):\n", shard_index, shard_count);
+    }
+    printf("Total reads processed: %lli\n", stats.total_reads);
+    printf("Uncorrected barcodes: %lli\n", stats.valid_barcodes - stats.corrected_barcodes);
+    printf("Corrected barcodes: %lli\n", stats.corrected_barcodes);
+    printf("Ambiguous barcodes: %lli\n", stats.ambiguous_barcodes);
+    printf("Total Valid barcodes: %lli\n", stats.valid_barcodes);
+    printf("Valid tags: %lli\n", stats.valid_tags);
+    if (directional)
+    {
+        printf("UMIs collapsed into another UMI: %lli\n", collapsed_umis);
+    }
+    if (geometry.tag_window > 0)
+    {
+        printf("Tags found away from the tag offset: %lli\n", stats.shifted_tags);
+    }
     printf("\nFINISHED\n");
 
     fprintf(p_logfile, "%s\tProcessing complete\n", get_datetime(f_time));
-    fprintf(p_logfile, "%s\tTotal reads processed: %lli\n", get_datetime(f_time), total_reads);
-    fprintf(p_logfile, "%s\tUncorrected barcodes: %lli\n", get_datetime(f_time), valid_barcodes - corrected_barcodes);
-    fprintf(p_logfile, "%s\tCorrected barcodes: %lli\n", get_datetime(f_time), corrected_barcodes);
-    fprintf(p_logfile, "%s\tTotal Valid barcodes: %lli\n", get_datetime(f_time), valid_barcodes);
-    fprintf(p_logfile, "%s\tValid tags: %lli\n", get_datetime(f_time), valid_tags);
+    if (shard != NULL)
+    {
+        fprintf(p_logfile, "%s\tStatistics of shard %i of %i (reads without a whitelist barcode are counted by shard 0):\n", get_datetime(f_time), shard_index, shard_count);
+    }
+    fprintf(p_logfile, "%s\tTotal reads processed: %lli\n", get_datetime(f_time), stats.total_reads);
+    fprintf(p_logfile, "%s\tUncorrected barcodes: %lli\n", get_datetime(f_time), stats.valid_barcodes - stats.corrected_barcodes);
+    fprintf(p_logfile, "%s\tCorrected barcodes: %lli\n", get_datetime(f_time), stats.corrected_barcodes);
+    fprintf(p_logfile, "%s\tAmbiguous barcodes: %lli\n", get_datetime(f_time), stats.ambiguous_barcodes);
+    fprintf(p_logfile, "%s\tTotal Valid barcodes: %lli\n", get_datetime(f_time), stats.valid_barcodes);
+    fprintf(p_logfile, "%s\tValid tags: %lli\n", get_datetime(f_time), stats.valid_tags);
+    if (directional)
+    {
+        fprintf(p_logfile, "%s\tUMIs collapsed into another UMI: %lli\n", get_datetime(f_time), collapsed_umis);
+    }
+    if (geometry.tag_window > 0)
+    {
+        fprintf(p_logfile, "%s\tTags found away from the tag offset: %lli\n", get_datetime(f_time), stats.shifted_tags);
+    }
+#ifdef BARCOUNTER_METRICS
+    // write the stage timings and per file throughput of the run next to the log file
+    merge_stage_metrics(&stats.metrics, &run_metrics);
+    if (write_metrics_json(metrics_file, &stats, jobs, read1_count, threads, metric_now() - run_start))
+    {
+        printf("Run metrics written to %s\n", metrics_file);
+        fprintf(p_logfile, "%s\tRun metrics written to %s\n", get_datetime(f_time), metrics_file);
+    } else {
+        printf("Failed to write run metrics to %s\n", metrics_file);
+        fprintf(p_logfile, "%s\tFailed to write run metrics to %s\n", get_datetime(f_time), metrics_file);
+    }
+#endif
     fprintf(p_logfile, "%s\tFINISHED\n", get_datetime(f_time));
 
     fclose(p_logfile);
 
+    free(jobs);
+
     free(paths1);
     free(paths2);
 
     return 0;
 }
 
+// "barcounter index": build the whitelist index and neighbor index of a whitelist once and write them to a whitelist index file for -w
+int index_command(int argc, char *argv[])
+{
+    char *usage = "./barcounter index -w {barcode whitelist} [-o {whitelist index file}]\n\nBuilds the whitelist index and the one mismatch neighbor index used for barcode correction and writes them to a whitelist index file.\nPass the index file to -w to map it read only instead of reading the whitelist on every run.\n\n-w whitelist: list of valid cell barcodes (one per line), plaintext or gzip, bgzip or zstd compressed\n-o index file: (optional) path of the whitelist index file, default is the whitelist path with its .gz, .zst and .txt extensions replaced by " BC_INDEX_EXT "\n";
+    char *whitelist = NULL;
+    char *index_file = NULL;
+    int a;
+    static struct option long_options[] = {
+        {"whitelist", required_argument, NULL, 'w'},
+        {"output", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    while ((a = getopt_long(argc, argv, "w:o:h", long_options, NULL)) != -1)
+    {
+        switch(a)
+        {
+            case 'w': whitelist = optarg; break;
+            case 'o': index_file = optarg; break;
+            case 'h': printf("%s", usage); exit(0);
+        }
+    }
+    if (whitelist == NULL)
+    {
+        printf("Required argument is missing. Refer to Usage below:\n\n%s\n", usage);
+        exit(1);
+    }
+
+    // default to the whitelist path with the .gz, .zst and .txt extensions replaced
+    char default_file[500];
+    if (index_file == NULL)
+    {
+        snprintf(default_file, 500, "%s", whitelist);
+        char *ext = strrchr(default_file, '.');
+        if (ext != NULL && (strcmp(ext, ".gz") == 0 || strcmp(ext, ".zst") == 0))
+        {
+            *ext = '\0';
+            ext = strrchr(default_file, '.');
+        }
+        if (ext != NULL && strcmp(ext, ".txt") == 0)
+        {
+            *ext = '\0';
+        }
+        strncat(default_file, BC_INDEX_EXT, 500 - strlen(default_file) - 1);
+        index_file = default_file;
+    }
+
+    bc_index whitelist_index;
+    if (!load_bc_index(whitelist, &whitelist_index))
+    {
+        printf("Failed to load barcodes for processing. Exiting...\n");
+        exit(21);
+    }
+    if (!write_bc_index_file(&whitelist_index, index_file))
+    {
+        printf("Failed to write whitelist index %s. Exiting...\n", index_file);
+        exit(35);
+    }
+    printf("Whitelist index with %u barcodes written to %s\n", whitelist_index.n_barcodes, index_file);
+    unload_bc_index(&whitelist_index);
+    return 0;
+}
+
+// "barcounter merge": merge the state files of several runs of a sample into tag counts without reading their fastq files again
+int merge_command(int argc, char *argv[])
+{
+    char *usage = "./barcounter merge -o {output directory} -n {sample name} [-w {barcode whitelist}] [-f {csv|mtx|both}] [-u {exact|directional}] {state files}\n\nMerges the state files written with --state by runs of the same sample, such as a top up sequencing run, into tag counts.\nA barcode/tag/UMI combination seen by several runs is counted once. The runs must share a taglist and UMI length.\n\n-o output directory: if the directory does not yet exist BarCounter will create it\n-n sample name: name used for the output files\n-w whitelist: (optional) list of valid cell barcodes or whitelist index file. Rows follow the whitelist order and barcodes not in the whitelist are dropped. Without it rows are every counted barcode in sequence order\n-f format: (optional) output format, csv (default), mtx or both\n-u UMI collapsing: (optional) exact (default) or directional. Directional collapsing uses the read counts of each UMI summed over all runs\n";
+    char *outdir = NULL, *sample_name = NULL, *whitelist = NULL;
+    char *format = "csv";
+    char *umi_collapse = "exact";
+    int a;
+    static struct option long_options[] = {
+        {"outdir", required_argument, NULL, 'o'},
+        {"sample", required_argument, NULL, 'n'},
+        {"whitelist", required_argument, NULL, 'w'},
+        {"format", required_argument, NULL, 'f'},
+        {"umi-collapse", required_argument, NULL, 'u'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    while ((a = getopt_long(argc, argv, "o:n:w:f:u:h", long_options, NULL)) != -1)
+    {
+        switch(a)
+        {
+            case 'o': outdir = optarg; break;
+            case 'n': sample_name = optarg; break;
+            case 'w': whitelist = optarg; break;
+            case 'f': format = optarg; break;
+            case 'u': umi_collapse = optarg; break;
+            case 'h': printf("%s", usage); exit(0);
+        }
+    }
+    // every argument after the options is a state file
+    char **state_files = argv + optind;
+    int n_files = argc - optind;
+    if (outdir == NULL || strlen(outdir) == 0 || sample_name == NULL || n_files < 1)
+    {
+        printf("Required argument is missing. Refer to Usage below:\n\n%s\n", usage);
+        exit(1);
+    }
+    bool write_csv = strcmp(format, "csv") == 0 || strcmp(format, "both") == 0;
+    bool write_mtx = strcmp(format, "mtx") == 0 || strcmp(format, "both") == 0;
+    if (!write_csv && !write_mtx)
+    {
+        printf("Unknown output format %s. Must be csv, mtx or both. Exiting...\n", format);
+        exit(33);
+    }
+    bool directional = strcmp(umi_collapse, "directional") == 0;
+    if (!directional && strcmp(umi_collapse, "exact") != 0)
+    {
+        printf("Unknown UMI collapsing method %s. Must be exact or directional. Exiting...\n", umi_collapse);
+        exit(37);
+    }
+
+    // every state file must have been counted with the taglist and UMI length of the first
+    char tags[MAX_TAGS][TAG_LEN + 1];
+    char names[MAX_TAGS][NAME_LEN + 1];
+    char file_tags[MAX_TAGS][TAG_LEN + 1];
+    char file_names[MAX_TAGS][NAME_LEN + 1];
+    state_header first, header;
+    count_stats stats = {0};
+    int *shard_indexes = malloc(sizeof(int) * n_files);
+    int *shard_counts = malloc(sizeof(int) * n_files);
+    for (int f = 0; f < n_files; f++)
+    {
+        if (!read_state_header(state_files[f], &header, f == 0 ? tags : file_tags, f == 0 ? names : file_names))
+        {
+            printf("State file %s is missing or invalid. Exiting...\n", state_files[f]);
+            exit(40);
+        }
+        if (f == 0)
+        {
+            first = header;
+        }
+        bool compatible = header.bc_len == BC_LEN && header.umi_len == first.umi_len && header.t_count == first.t_count;
+        for (uint32_t t = 0; f > 0 && compatible && t < header.t_count; t++)
+        {
+            compatible = strcmp(tags[t], file_tags[t]) == 0 && strcmp(names[t], file_names[t]) == 0;
+        }
+        if (!compatible)
+        {
+            printf("State file %s was not counted with the barcode length, taglist and UMI length of %s. Exiting...\n", state_files[f], state_files[0]);
+            exit(41);
+        }
+        stats.total_reads += header.stats[0];
+        stats.valid_barcodes += header.stats[1];
+        stats.corrected_barcodes += header.stats[2];
+        stats.valid_tags += header.stats[3];
+        stats.ambiguous_barcodes += header.stats[4];
+        stats.shifted_tags += header.stats[5];
+        shard_indexes[f] = header.shard_index;
+        shard_counts[f] = header.shard_count;
+    }
+    int t_count = (int) first.t_count;
+
+    // the barcodes of a shard that isn't merged have no counts, so warn once for every missing shard of each shard count
+    for (int f = 0; f < n_files; f++)
+    {
+        bool first_of_count = true;
+        for (int g = 0; g < f; g++)
+        {
+            first_of_count = first_of_count && shard_counts[g] != shard_counts[f];
+        }
+        for (int k = 0; first_of_count && shard_counts[f] > 1 && k < shard_counts[f]; k++)
+        {
+            bool found = false;
+            for (int g = 0; g < n_files && !found; g++)
+            {
+                found = shard_counts[g] == shard_counts[f] && shard_indexes[g] == k;
+            }
+            if (!found)
+            {
+                printf("Warning: shard %i of %i is not among the state files, its barcodes will have no counts\n", k, shard_counts[f]);
+            }
+        }
+    }
+    free(shard_indexes);
+    free(shard_counts);
+
+    // format the output directory with a trailing '/' and create it if it doesn't exist
+    struct stat st;
+    char out_dir[500];
+    snprintf(out_dir, 500, "%s%s", outdir, outdir[strlen(outdir) - 1] == '/' ? "" : "/");
+    if (stat(out_dir, &st) == -1 && mkdir(out_dir, 0777) != 0)
+    {
+        printf("Failed to create output directory %s. Exiting...\n", out_dir);
+        exit(1);
+    }
+    char counts_file[600];
+    snprintf(counts_file, 600, "%s%s_Tag_Counts.csv", out_dir, sample_name);
+    char mtx_dir[600];
+    snprintf(mtx_dir, 600, "%s%s_Tag_Counts/", out_dir, sample_name);
+
+    // map a precompiled whitelist index, or load plaintext or compressed whitelist barcodes into the whitelist index
+    bc_index whitelist_index;
+    if (whitelist != NULL)
+    {
+        char *ext = strrchr(whitelist, '.');
+        bool whitelist_loaded = (ext != NULL && strcmp(ext, BC_INDEX_EXT) == 0) ? map_bc_index_file(whitelist, &whitelist_index) : load_bc_index(whitelist, &whitelist_index);
+        if (!whitelist_loaded)
+        {
+            printf("Failed to load barcodes for processing. Exiting...\n");
+            exit(21);
+        }
+    }
+
+    // merge the sorted keys of every state file in one pass
+    printf("Merging %i state files\n", n_files);
+    bc_index merged;
+    count_matrix tag_counts;
+    unsigned long long int collapsed_umis = 0;
+    unsigned long long int skipped_barcodes = 0;
+    if (!merge_state_files(state_files, n_files, t_count, (int) first.umi_len, directional, whitelist != NULL ? &whitelist_index : NULL, &merged,
+        &tag_counts, &collapsed_umis, &skipped_barcodes))
+    {
+        printf("Failed to merge state files. Exiting...\n");
+        exit(40);
+    }
+    const bc_index* rows = whitelist != NULL ? &whitelist_index : &merged;
+    if (write_csv && !write_counts_csv(counts_file, rows, &tag_counts, names, t_count))
+    {
+        printf("Failed to write tag counts to %s. Exiting...\n", counts_file);
+        exit(34);
+    }
+    if (write_mtx && !write_counts_mtx(mtx_dir, rows, &tag_counts, tags, names, t_count))
+    {
+        printf("Failed to write tag counts to %s. Exiting...\n", mtx_dir);
+        exit(34);
+    }
+    if (write_csv)
+    {
+        printf("ADT counts written to %s\n", counts_file);
+    }
+    if (write_mtx)
+    {
+        printf("Sparse ADT counts written to %s\n", mtx_dir);
+    }
+
+    free_count_matrix(&tag_counts);
+    free(merged.codes);
+    if (whitelist != NULL)
+    {
+        unload_bc_index(&whitelist_index);
+    }
+
+    printf("Merge complete\n");
+    printf("Total reads processed: %lli\n", stats.total_reads);
+    printf("Uncorrected barcodes: %lli\n", stats.valid_barcodes - stats.corrected_barcodes);
+    printf("Corrected barcodes: %lli\n", stats.corrected_barcodes);
+    printf("Ambiguous barcodes: %lli\n", stats.ambiguous_barcodes);
+    printf("Total Valid barcodes: %lli\n", stats.valid_barcodes);
+    printf("Valid tags: %lli\n", stats.valid_tags);
+    if (directional)
+    {
+        printf("UMIs collapsed into another UMI: %lli\n", collapsed_umis);
+    }
+    if (whitelist != NULL)
+    {
+        printf("Barcodes not in the whitelist: %lli\n", skipped_barcodes);
+    }
+    printf("\nFINISHED\n");
+    return 0;
+}
+
+// "barcounter batch": count every sample of a sample sheet in one process that loads the whitelist and taglist once
+int batch_command(int argc, char *argv[])
+{
+    char *usage = "./barcounter batch -w {barcode whitelist} -t {taglist} -b {sample sheet} -o {output directory} [-p {threads}] [-j {concurrent samples}] [-f {csv|mtx|both}] [-c {chemistry}] [--tag-window {bases}] [-u {exact|directional}] [--state] [--lookup-batch {reads}]\n\nCounts every sample of a sample sheet with the whitelist index and tag index loaded once and shared by all samples.\nEach sample writes <output directory><sample>_Tag_Counts.csv (or its -f outputs) and <output directory><sample>_BarCounter.log.\n\n-b sample sheet: one line per fastq pair, sample,read1 fastq,read2 fastq, or sample,interleaved fastq. Lines of the same sample are counted together. Blank lines, lines starting with # and a first line starting with sample, are skipped\n-p threads: (optional) number of worker threads shared by the samples, default 1\n-j concurrent samples: (optional) maximum number of samples counted at once, default the number of threads. The threads are divided between them\n-w, -t, -o, -f, -c, --bc-first, --umi-first, --umi-len, --tag-first, --tag-window, -u, --state, --lookup-batch: as for a single sample run\n";
+    char *whitelist = NULL, *taglist = NULL, *sheet = NULL, *outdir = NULL;
+    int threads = 1;
+    int concurrent = 0;
+    char *format = "csv";
+    char *chemistry = DEFAULT_CHEMISTRY;
+    char *umi_collapse = "exact";
+    int bc_first = GEOMETRY_UNSET, umi_first = GEOMETRY_UNSET, umi_len = GEOMETRY_UNSET, tag_first = GEOMETRY_UNSET;
+    int tag_window = 0;
+    bool save_state = false;
+    int lookup_batch = LOOKUP_BATCH_DEFAULT;
+    int a;
+    static struct option long_options[] = {
+        {"whitelist", required_argument, NULL, 'w'},
+        {"taglist", required_argument, NULL, 't'},
+        {"sample-sheet", required_argument, NULL, 'b'},
+        {"outdir", required_argument, NULL, 'o'},
+        {"threads", required_argument, NULL, 'p'},
+        {"samples", required_argument, NULL, 'j'},
+        {"format", required_argument, NULL, 'f'},
+        {"chemistry", required_argument, NULL, 'c'},
+        {"bc-first", required_argument, NULL, OPT_BC_FIRST},
+        {"umi-first", required_argument, NULL, OPT_UMI_FIRST},
+        {"umi-len", required_argument, NULL, OPT_UMI_LEN},
+        {"tag-first", required_argument, NULL, OPT_TAG_FIRST},
+        {"tag-window", required_argument, NULL, OPT_TAG_WINDOW},
+        {"umi-collapse", required_argument, NULL, 'u'},
+        {"state", no_argument, NULL, OPT_STATE},
+        {"lookup-batch", required_argument, NULL, OPT_LOOKUP_BATCH},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    while ((a = getopt_long(argc, argv, "w:t:b:o:p:j:f:c:u:h", long_options, NULL)) != -1)
+    {
+        switch(a)
+        {
+            case 'w': whitelist = optarg; break;
+            case 't': taglist = optarg; break;
+            case 'b': sheet = optarg; break;
+            case 'o': outdir = optarg; break;
+            case 'p': threads = atoi(optarg); break;
+            case 'j': concurrent = atoi(optarg); break;
+            case 'f': format = optarg; break;
+            case 'c': chemistry = optarg; break;
+            case 'u': umi_collapse = optarg; break;
+            case OPT_BC_FIRST: bc_first = atoi(optarg); break;
+            case OPT_UMI_FIRST: umi_first = atoi(optarg); break;
+            case OPT_UMI_LEN: umi_len = atoi(optarg); break;
+            case OPT_TAG_FIRST: tag_first = atoi(optarg); break;
+            case OPT_TAG_WINDOW: tag_window = atoi(optarg); break;
+            case OPT_STATE: save_state = true; break;
+            case OPT_LOOKUP_BATCH: lookup_batch = atoi(optarg); break;
+            case 'h': printf("%s", usage); exit(0);
+        }
+    }
+    if (whitelist == NULL || taglist == NULL || sheet == NULL || outdir == NULL || strlen(outdir) == 0)
+    {
+        printf("Required argument is missing. Refer to Usage below:\n\n%s\n", usage);
+        exit(1);
+    }
+    if (threads < 1 || threads > MAX_THREADS)
+    {
+        printf("Number of threads must be between 1 and %i. Exiting...\n", MAX_THREADS);
+        exit(27);
+    }
+    concurrent = (concurrent > 0) ? concurrent : threads;
+    if (lookup_batch < 1 || lookup_batch > LOOKUP_BATCH_MAX)
+    {
+        printf("Lookup batch must be between 1 and %i. Exiting...\n", LOOKUP_BATCH_MAX);
+        exit(45);
+    }
+    bool write_csv = strcmp(format, "csv") == 0 || strcmp(format, "both") == 0;
+    bool write_mtx = strcmp(format, "mtx") == 0 || strcmp(format, "both") == 0;
+    if (!write_csv && !write_mtx)
+    {
+        printf("Unknown output format %s. Must be csv, mtx or both. Exiting...\n", format);
+        exit(33);
+    }
+    bool directional = strcmp(umi_collapse, "directional") == 0;
+    if (!directional && strcmp(umi_collapse, "exact") != 0)
+    {
+        printf("Unknown UMI collapsing method %s. Must be exact or directional. Exiting...\n", umi_collapse);
+        exit(37);
+    }
+    read_geometry geometry;
+    if (!find_chemistry(chemistry, &geometry))
+    {
+        printf("Unknown chemistry %s. Must be 10xv3, 10xv2, totalseq-b or totalseq-c. Exiting...\n", chemistry);
+        exit(36);
+    }
+    geometry.bc_first = (bc_first != GEOMETRY_UNSET) ? bc_first : geometry.bc_first;
+    geometry.umi_first = (umi_first != GEOMETRY_UNSET) ? umi_first : geometry.umi_first;
+    geometry.umi_len = (umi_len != GEOMETRY_UNSET) ? umi_len : geometry.umi_len;
+    geometry.tag_first = (tag_first != GEOMETRY_UNSET) ? tag_first : geometry.tag_first;
+    geometry.tag_window = tag_window;
+    if (!check_geometry(&geometry))
+    {
+        printf("Invalid read geometry. Offsets and the tag window must be 0 or greater and the UMI length between 1 and %i. Exiting...\n", UMI_MAX_LEN);
+        exit(36);
+    }
+
+    batch_sample* samples;
+    int n_samples = load_sample_sheet(sheet, &samples);
+    if (n_samples < 1)
+    {
+        printf("Sample sheet %s is invalid. Exiting...\n", sheet);
+        exit(42);
+    }
+
+    // format the output directory with a trailing '/' and create it if it doesn't exist
+    struct stat st;
+    char out_dir[500];
+    snprintf(out_dir, 500, "%s%s", outdir, outdir[strlen(outdir) - 1] == '/' ? "" : "/");
+    if (stat(out_dir, &st) == -1 && mkdir(out_dir, 0777) != 0)
+    {
+        printf("Failed to create output directory %s. Exiting...\n", out_dir);
+        exit(1);
+    }
+
+    // load the taglist, tag index and whitelist index once for every sample
+    char tags[MAX_TAGS][TAG_LEN + 1];
+    char names[MAX_TAGS][NAME_LEN + 1];
+    int t_count = load_taglist(taglist, tags, names);
+    if (t_count == 0)
+    {
+        printf("Taglist is empty. Exiting...\n");
+        exit(15);
+    }
+    check_tag_dist(tags, t_count);
+    tag_index tag_lookup;
+    if (!load_tag_index(tags, &tag_lookup, t_count))
+    {
+        printf("Failed to load all tags for processing. Exiting...\n");
+        exit(18);
+    }
+    bc_index whitelist_index;
+    char *ext = strrchr(whitelist, '.');
+    bool whitelist_loaded = (ext != NULL && strcmp(ext, BC_INDEX_EXT) == 0) ? map_bc_index_file(whitelist, &whitelist_index) : load_bc_index(whitelist, &whitelist_index);
+    if (!whitelist_loaded)
+    {
+        printf("Failed to load barcodes for processing. Exiting...\n");
+        exit(21);
+    }
+
+    count_ctx ctx;
+    ctx.bc_index = &whitelist_index;
+    ctx.tag_index = &tag_lookup;
+    ctx.t_count = t_count;
+    ctx.spill = NULL;
+    ctx.geometry = geometry;
+    ctx.run_id = 0;
+    ctx.shard_index = 0;
+    ctx.shard_count = 1;
+    ctx.lookup_batch = lookup_batch;
+    batch_settings settings;
+    settings.ctx = &ctx;
+    settings.tags = tags;
+    settings.names = names;
+    settings.whitelist = whitelist;
+    settings.taglist = taglist;
+    settings.outdir = out_dir;
+    settings.umi_collapse = umi_collapse;
+    settings.write_csv = write_csv;
+    settings.write_mtx = write_mtx;
+    settings.directional = directional;
+    settings.save_state = save_state;
+
+    int at_once = concurrent < n_samples ? concurrent : n_samples;
+    printf("Counting %i samples, up to %i at once\n", n_samples, at_once < threads ? at_once : threads);
+    count_batch(samples, n_samples, &settings, threads, concurrent);
+
+    // report every sample and exit with the exit code of the first sample that failed
+    int status = 0;
+    printf("\n");
+    for (int s = 0; s < n_samples; s++)
+    {
+        if (samples[s].status == 0)
+        {
+            printf("%s: %lli reads, %lli valid barcodes, %lli valid tags\n", samples[s].name, samples[s].stats.total_reads, samples[s].stats.valid_barcodes, samples[s].stats.valid_tags);
+        } else {
+            printf("%s: failed with exit code %i, see %s%s_BarCounter.log\n", samples[s].name, samples[s].status, out_dir, samples[s].name);
+            status = (status == 0) ? samples[s].status : status;
+        }
+    }
+    free_sample_sheet(samples, n_samples);
+    unload_bc_index(&whitelist_index);
+    unload_tag_index(&tag_lookup);
+    if (status != 0)
+    {
+        exit(status);
+    }
+    printf("\nFINISHED\n");
+    return 0;
+}
+
 // return string f_time with formatted current GMT (UTC)
 char* get_datetime(char* f_time)
 {
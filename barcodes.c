@@ -6,202 +6,463 @@ See LICENSE for code reuse permissions.
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
-#include <zlib.h>
-
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "barcodes.h"
+#include "input.h"
 
-// Loads a trie of barocdes of length BC_LEN into memory from plaintext whitelist file "input" using provided node* "root". Returns true if successful, else returns false.
-// Allocates array of "t_count" unsigned ints for cell tag counts.
-bool load_bc_trie(const char *input, bc_node* root, int t_count)
+// Pack "len" bases of "seq" into "code" at 2 bits per base. Returns 1 if successful, 0 if "seq" contains an 'N' and -1 for any other non DNA base.
+static int encode_bc(const char *seq, int len, uint32_t *code)
 {
-    FILE *fp = fopen(input, "r");
-    if (fp == NULL)
+    uint32_t c = 0;
+    int n_base = 0;
+
+    for (int b = 0; b < len; b++)
     {
-        printf("%s could not be opened. Exiting...\n", input);
-        exit(14);
+        switch(seq[b])
+        {
+            case 'A': c = c << 2; break;
+            case 'C': c = (c << 2) | 1; break;
+            case 'G': c = (c << 2) | 2; break;
+            case 'T': c = (c << 2) | 3; break;
+            case 'N': c = c << 2; n_base = 1; break;
+            default: return -1;
+        }
     }
+    *code = c;
+    return n_base ? 0 : 1;
+}
+
+// Returns the 64 bit hash of packed barcode "code" with the bases at position "pos" masked out. Used to key the neighbor index.
+static inline uint64_t nb_hash(uint32_t masked, int pos)
+{
+    return ((((uint64_t) masked) << 4) | pos) * 0x9E3779B97F4A7C15ULL;
+}
 
-    // declare and initialize travelling node pointer to NULL
-    bc_node* trav = NULL;
+// Returns the neighbor index slot for hash "h" in a table of "n" slots (the top 32 bits of "h" scaled to the table size)
+static inline uint32_t nb_slot(uint64_t h, uint32_t n)
+{
+    return (uint32_t) (((h >> 32) * n) >> 32);
+}
 
-    int i;
-    char barcode[20];
+// Returns "code" with the bases at position "pos" set to 0
+static inline uint32_t mask_bc(uint32_t code, int pos)
+{
+    return code & ~(3u << (2 * (BC_LEN - 1 - pos)));
+}
 
-    while (fscanf(fp, "%s", barcode) != EOF){
-        // reset trav pointer to root
-        trav = root;
-        // ensure barcodes in whitelist are the length of BC_LEN
-        if (strlen(barcode) != BC_LEN)
+// Build the one mismatch neighbor index of "index". Every whitelist barcode adds one entry per position, keyed by the barcode with that position masked out.
+// Barcodes that only differ at that position share an entry, which is marked ambiguous. Returns true if successful, else returns false.
+static bool build_neighbor_index(bc_index* index)
+{
+    // size the table for a load factor of 0.8
+    uint64_t entries = (uint64_t) index->n_barcodes * BC_LEN;
+    uint64_t n_slots = entries + entries / 4 + 1;
+    if (n_slots > UINT32_MAX)
+    {
+        printf("Whitelist is too large for the barcode neighbor index\n");
+        return false;
+    }
+    index->n_neighbors = (uint32_t) n_slots;
+    index->neighbors = calloc(n_slots, sizeof(uint32_t));
+    if (index->neighbors == NULL)
+    {
+        return false;
+    }
+
+    for (uint32_t id = 0; id < index->n_barcodes; id++)
+    {
+        for (int p = 0; p < BC_LEN; p++)
         {
-            printf("Barcode length of %li for %s is invalid. Length must be %i bases long.\n",strlen(barcode), barcode, BC_LEN);
-            return false;
-        }
-        for (int c = 0; c < BC_LEN; c++){
-            // convert current character to int i for selectng the correct child node
-            switch(barcode[c])
+            uint32_t masked = mask_bc(index->codes[id], p);
+            uint64_t h = nb_hash(masked, p);
+            uint32_t fp = (uint32_t) (h >> 27) & 31;
+            uint32_t s = nb_slot(h, index->n_neighbors);
+            uint32_t entry;
+
+            while ((entry = index->neighbors[s]) != 0)
             {
-                case 'A': i = 0; break;
-                case 'C': i = 1; break;
-                case 'G': i = 2; break;
-                case 'T': i = 3; break;
-                default: printf("Non DNA base included in whitelist barcode %s. Exiting...\n", barcode);
-                         exit(15);
+                // another whitelist barcode only differs from this one at position p, so their shared neighbors are ambiguous
+                if ((entry >> NB_FP_SHIFT) == fp && mask_bc(index->codes[(entry & NB_ID_MASK) - 1], p) == masked)
+                {
+                    index->neighbors[s] = entry | NB_AMBIGUOUS;
+                    break;
+                }
+                s = (s + 1 == index->n_neighbors) ? 0 : s + 1;
             }
-            //check the value at children[i]. If child doesn't exist, create child node move trav
-            if (trav->children[i] == NULL)
+            if (entry == 0)
             {
-                trav->children[i] = calloc(1, sizeof(bc_node));
+                index->neighbors[s] = (fp << NB_FP_SHIFT) | (id + 1);
             }
-            trav = trav->children[i];
         }
-        trav->exists = true;
+    }
+    return true;
+}
 
-        // allocate counts array and initialize all values to 0.
-        if (trav->counts == NULL) // ensure array is only allocated once for each barcode
+// Look up packed barcode "code" with position "pos" masked out in the neighbor index.
+// Returns the ID of the whitelist barcode that only differs at "pos", -1 if there is none or BC_AMBIGUOUS if there are several.
+static int find_neighbor(uint32_t code, int pos, const bc_index* index)
+{
+    uint32_t masked = mask_bc(code, pos);
+    uint64_t h = nb_hash(masked, pos);
+    uint32_t fp = (uint32_t) (h >> 27) & 31;
+    uint32_t s = nb_slot(h, index->n_neighbors);
+    uint32_t entry;
+
+    while ((entry = index->neighbors[s]) != 0)
+    {
+        if ((entry >> NB_FP_SHIFT) == fp)
         {
-            trav->counts = malloc(sizeof(unsigned int) * t_count);
-            for (int t = 0; t < t_count; t++)
+            uint32_t id = (entry & NB_ID_MASK) - 1;
+            if (mask_bc(index->codes[id], pos) == masked)
             {
-                trav->counts[t] = 0;
+                return (entry & NB_AMBIGUOUS) ? BC_AMBIGUOUS : (int) id;
             }
-            trav->total = 0;
         }
+        s = (s + 1 == index->n_neighbors) ? 0 : s + 1;
     }
-    fclose(fp);
-    printf("Barcode whitelist %s loaded successfully\n",input);
-    return true;
+    return -1;
 }
 
-// Loads a trie of barocdes of length BC_LEN into memory from a gzipped whitelist file "input" using provided node* "root". Returns true if successful, else returns false.
-// Allocates array of "t_count" unsigned ints for cell tag counts.
-bool load_bc_trie_gzipped(const char *input, bc_node* root, int t_count)
+// Pack barcode "seq" of length BC_LEN into "code" at 2 bits per base (A=0, C=1, G=2, T=3). Returns false if "seq" contains an 'N'.
+// Exits the program if "seq" contains any other non DNA base.
+bool pack_bc(const char *seq, uint32_t *code)
 {
-    gzFile fp = gzopen(input, "r");
-    if (fp == NULL)
+    int valid = encode_bc(seq, BC_LEN, code);
+    if (valid == -1)
     {
-        printf("%s could not be opened. Exiting...\n", input);
-        exit(14);
+        printf("Non DNA base included in barcode %.*s from input FastQ. Exiting...\n", BC_LEN, seq);
+        exit(24);
     }
+    return valid == 1;
+}
 
-    // declare and initialize travelling node pointer to NULL
-    bc_node* trav = NULL;
-
-    int i;
-    char barcode[20];
+// Unpack barcode "code" into the NUL terminated string "seq" of length BC_LEN.
+void unpack_bc(uint32_t code, char *seq)
+{
+    char bases[4] = "ACGT";
+    for (int b = BC_LEN - 1; b >= 0; b--)
+    {
+        seq[b] = bases[code & 3];
+        code >>= 2;
+    }
+    seq[BC_LEN] = '\0';
+}
 
-    while (true){
+// Loads the barcodes of length BC_LEN from the whitelist file "input" (plaintext, gzip, bgzip or zstd, detected from its contents) into "index". Returns true if successful, else returns false.
+bool load_bc_index(const char *input, bc_index* index)
+{
+    in_stream* fp = in_open(input);
+    if (fp == NULL)
+    {
+        printf("%s could not be opened. Exiting...\n", input);
+        exit(19);
+    }
 
-        // read line of whitelist into 'barcode'
-        gzgets(fp, barcode, 20);
+    char barcode[64];
+    size_t len;
+    uint32_t code;
+    uint32_t n_codes = 0;
+    uint32_t codes_size = 1 << 20;
+    uint32_t *codes = malloc(sizeof(uint32_t) * codes_size);
+    if (codes == NULL)
+    {
+        in_close(fp);
+        return false;
+    }
 
-        // reset trav pointer to root
-        trav = root;
+    // read every whitelist line into the codes array
+    while (in_gets(fp, barcode, sizeof(barcode)) != NULL)
+    {
+        len = strcspn(barcode, "\r\n");
+        barcode[len] = '\0';
+        // skip blank lines
+        if (len == 0)
+        {
+            continue;
+        }
         // ensure barcodes in whitelist are the length of BC_LEN
-        if ((strlen(barcode) != BC_LEN) && (barcode[16] != '\n'))
+        if (len != BC_LEN)
         {
-            printf("Barcode length of %li for %s is invalid. Length must be %i bases long.\n",strlen(barcode) - 1, barcode, BC_LEN);
+            printf("Barcode length of %li for %s is invalid. Length must be %i bases long.\n", len, barcode, BC_LEN);
+            free(codes);
+            in_close(fp);
             return false;
         }
-        for (int c = 0; c < BC_LEN; c++){
-            // convert current character to int i for selectng the correct child node
-            switch(barcode[c])
-            {
-                case 'A': i = 0; break;
-                case 'C': i = 1; break;
-                case 'G': i = 2; break;
-                case 'T': i = 3; break;
-                default: printf("Non DNA base included in whitelist barcode %s. Exiting...\n", barcode);
-                         exit(15);
-            }
-            //check the value at children[i]. If child doesn't exist, create child node move trav
-            if (trav->children[i] == NULL)
-            {
-                trav->children[i] = calloc(1, sizeof(bc_node));
-            }
-            trav = trav->children[i];
+        if (encode_bc(barcode, BC_LEN, &code) != 1)
+        {
+            printf("Non DNA base included in whitelist barcode %s. Exiting...\n", barcode);
+            exit(20);
         }
-        trav->exists = true;
-
-        // allocate counts array and initialize all values to 0.
-        if (trav->counts == NULL) // ensure array is only allocated once for each barcode
+        if (n_codes == codes_size)
         {
-            trav->counts = malloc(sizeof(unsigned int) * t_count);
-            for (int t = 0; t < t_count; t++)
+            codes_size *= 2;
+            uint32_t *temp = realloc(codes, sizeof(uint32_t) * codes_size);
+            if (temp == NULL)
             {
-                trav->counts[t] = 0;
+                free(codes);
+                in_close(fp);
+                return false;
             }
-            trav->total = 0;
+            codes = temp;
         }
+        codes[n_codes++] = code;
+    }
+    // a whitelist that could not be read or decompressed to the end is incomplete
+    if (in_failed(fp))
+    {
+        printf("%s could not be read or decompressed\n", input);
+        free(codes);
+        in_close(fp);
+        return false;
+    }
+    in_close(fp);
+
+    // size the hash table to a power of two with a load factor of at most 0.5
+    int bits = 4;
+    while (((uint64_t) 1 << bits) < (uint64_t) n_codes * 2)
+    {
+        bits++;
+    }
+    index->mask = (uint32_t) (((uint64_t) 1 << bits) - 1);
+    index->shift = 64 - bits;
+    index->map = NULL;
+    index->map_len = 0;
+    index->slots = malloc(sizeof(bc_slot) * ((uint64_t) index->mask + 1));
+    if (index->slots == NULL)
+    {
+        free(codes);
+        return false;
+    }
+    memset(index->slots, 0xff, sizeof(bc_slot) * ((uint64_t) index->mask + 1));
 
-        // break when the end of the whitelist is reached
-        if (gzeof(fp))
+    // insert each barcode and number them in whitelist order. Repeated barcodes keep the ID of their first occurrence.
+    index->n_barcodes = 0;
+    for (uint32_t c = 0; c < n_codes; c++)
+    {
+        uint32_t s = bc_hash(codes[c], index->shift);
+        while (index->slots[s].id != BC_EMPTY && index->slots[s].code != codes[c])
         {
-            break;
+            s = (s + 1) & index->mask;
+        }
+        if (index->slots[s].id == BC_EMPTY)
+        {
+            index->slots[s].code = codes[c];
+            index->slots[s].id = index->n_barcodes;
+            codes[index->n_barcodes++] = codes[c];
         }
     }
-    gzclose(fp);
-    printf("Barcode whitelist %s loaded successfully\n",input);
+    index->codes = codes;
+
+    // ensure barcode IDs fit in the neighbor index entries
+    if (index->n_barcodes >= NB_ID_MASK)
+    {
+        printf("Whitelist contains %u barcodes. The maximum is %u.\n", index->n_barcodes, NB_ID_MASK - 1);
+        return false;
+    }
+    if (!build_neighbor_index(index))
+    {
+        return false;
+    }
 
+    printf("Barcode whitelist %s loaded successfully\n",input);
     return true;
 }
 
-// Returns a pointer to the bc_trie leaf bc_node corresponding to the input barcode. If the barocde doesn't exist in the trie, return NULL.
-bc_node* get_bc_leaf(const char *seq, bc_node* root, int length)
+// write "len" bytes of "data" to "fp" followed by zero padding to the next multiple of BC_INDEX_ALIGN. Returns true if successful, else returns false.
+static bool write_section(FILE *fp, const void *data, uint64_t len)
 {
-    bc_node* m_trav = root;
-    int i;
+    char pad[BC_INDEX_ALIGN] = {0};
+    uint64_t padding = (BC_INDEX_ALIGN - len % BC_INDEX_ALIGN) % BC_INDEX_ALIGN;
+    return fwrite(data, 1, len, fp) == len && fwrite(pad, 1, padding, fp) == padding;
+}
 
-    for (int c = 0; c < length; c++)
+// Returns "len" rounded up to a multiple of BC_INDEX_ALIGN
+static inline uint64_t align_section(uint64_t len)
+{
+    return (len + BC_INDEX_ALIGN - 1) / BC_INDEX_ALIGN * BC_INDEX_ALIGN;
+}
+
+// Write whitelist index "index", including its neighbor index, to the whitelist index file "path". Returns true if successful, else returns false.
+bool write_bc_index_file(const bc_index* index, const char *path)
+{
+    bc_index_header header;
+    uint64_t slots_len = sizeof(bc_slot) * ((uint64_t) index->mask + 1);
+    uint64_t codes_len = sizeof(uint32_t) * (uint64_t) index->n_barcodes;
+    uint64_t neighbors_len = sizeof(uint32_t) * (uint64_t) index->n_neighbors;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BC_INDEX_MAGIC, sizeof(header.magic));
+    header.version = BC_INDEX_VERSION;
+    header.endian = 0x01020304;
+    header.bc_len = BC_LEN;
+    header.n_barcodes = index->n_barcodes;
+    header.mask = index->mask;
+    header.shift = index->shift;
+    header.n_neighbors = index->n_neighbors;
+    header.slots_offset = align_section(sizeof(header));
+    header.codes_offset = header.slots_offset + align_section(slots_len);
+    header.neighbors_offset = header.codes_offset + align_section(codes_len);
+    header.file_size = header.neighbors_offset + align_section(neighbors_len);
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
     {
-        // convert current character to int i for selectng the correct child node
-        switch(seq[c])
-        {
-            case 'A': i = 0; break;
-            case 'C': i = 1; break;
-            case 'G': i = 2; break;
-            case 'T': i = 3; break;
-            case 'N': return NULL;
-            default: printf("Non DNA base included in barcode %s from input FastQ. Exiting...\n", seq);
-                     exit(19);
-        }
-        //check the value at children[i]
-        if (m_trav->children[i] == NULL)
-        {
-            return NULL;
-        }
-        m_trav = m_trav->children[i];
+        printf("%s could not be opened for writing\n", path);
+        return false;
     }
-    if (m_trav->exists == true)
+    bool success = write_section(fp, &header, sizeof(header))
+        && write_section(fp, index->slots, slots_len)
+        && write_section(fp, index->codes, codes_len)
+        && write_section(fp, index->neighbors, neighbors_len);
+    if (fclose(fp) != 0 || !success)
     {
-        return m_trav;
+        printf("Failed to write whitelist index %s\n", path);
+        return false;
     }
-    return NULL;
+    return true;
 }
 
-// Unloads barcode trie from memory. Returns true if successful, else returns false.
-bool unload_bc_trie(bc_node *root)
+// Map the whitelist index file "path" written by write_bc_index_file read only into "index". Pages are shared by every process mapping the same file.
+// Returns true if successful, else returns false.
+bool map_bc_index_file(const char *path, bc_index* index)
 {
-    bc_node *unload_trav = root;
-    unload_bc_helper(unload_trav);
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("%s could not be opened. Exiting...\n", path);
+        exit(19);
+    }
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(bc_index_header))
+    {
+        printf("%s is not a whitelist index file\n", path);
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        printf("%s could not be mapped\n", path);
+        return false;
+    }
+
+    // ensure the file was written by a compatible version on a machine with the same byte order and barcode length
+    const bc_index_header* header = map;
+    if (memcmp(header->magic, BC_INDEX_MAGIC, sizeof(header->magic)) != 0 || header->version != BC_INDEX_VERSION
+        || header->endian != 0x01020304 || header->bc_len != BC_LEN || header->file_size != (uint64_t) st.st_size
+        || header->slots_offset + sizeof(bc_slot) * ((uint64_t) header->mask + 1) > header->codes_offset
+        || header->codes_offset + sizeof(uint32_t) * (uint64_t) header->n_barcodes > header->neighbors_offset
+        || header->neighbors_offset + sizeof(uint32_t) * (uint64_t) header->n_neighbors > header->file_size)
+    {
+        printf("%s is not a compatible whitelist index file. Rebuild it with barcounter index.\n", path);
+        munmap(map, st.st_size);
+        return false;
+    }
+    // ensure every hashed slot is inside the tables and each table keeps an empty slot to end its probes, so a corrupt file can't be read out of bounds
+    uint64_t n_slots = (uint64_t) header->mask + 1;
+    if (n_slots < 2 || (n_slots & (n_slots - 1)) != 0 || header->shift != 64 - __builtin_ctzll(n_slots) || header->n_barcodes > header->mask
+        || header->n_neighbors <= (uint64_t) header->n_barcodes * BC_LEN)
+    {
+        printf("%s is a corrupt whitelist index file. Rebuild it with barcounter index.\n", path);
+        munmap(map, st.st_size);
+        return false;
+    }
+    // the tables are read from disk on first use; ask the kernel to start reading them now
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    index->map = map;
+    index->map_len = st.st_size;
+    index->mask = header->mask;
+    index->shift = header->shift;
+    index->n_barcodes = header->n_barcodes;
+    index->n_neighbors = header->n_neighbors;
+    index->slots = (bc_slot *) ((char *) map + header->slots_offset);
+    index->codes = (uint32_t *) ((char *) map + header->codes_offset);
+    index->neighbors = (uint32_t *) ((char *) map + header->neighbors_offset);
+
+    printf("Barcode whitelist index %s mapped successfully\n", path);
     return true;
 }
 
-// helper function for unload_bc_trie
-void unload_bc_helper(bc_node* unload_trav)
+// Returns the barcode ID of packed barcode "code". If the barcode isn't in the whitelist, returns -1.
+int find_bc_code(uint32_t code, const bc_index* index)
 {
-    for (int i=0; i<4; i++)
+    uint32_t s = bc_hash(code, index->shift);
+    while (index->slots[s].id != BC_EMPTY)
     {
-        if (unload_trav->children[i] != NULL)
+        if (index->slots[s].code == code)
         {
-            unload_bc_helper(unload_trav->children[i]);
+            return index->slots[s].id;
         }
+        s = (s + 1) & index->mask;
     }
-    // if in leaf node: free counts array that was allocated in load barcode trie
-    if (unload_trav->counts != NULL)
+    return -1;
+}
+
+// Returns the barcode ID of barcode "seq". If the barcode doesn't exist in the whitelist or contains an 'N', returns -1.
+int get_bc_id(const char *seq, const bc_index* index)
+{
+    uint32_t code;
+    if (!pack_bc(seq, &code))
     {
-        free(unload_trav->counts);
+        return -1;
     }
+    return find_bc_code(code, index);
+}
 
-    free(unload_trav);
-}
\ No newline at end of file
+// Correct packed barcode "code", which is not in the whitelist, to the whitelist barcode one substitution away at a low quality position.
+// "quals" are the BC_LEN quality scores of the barcode. If "n_pos" is not -1 the barcode has a single 'N' at that position, which is the only position tested.
+// Returns the corrected barcode ID, -1 if no whitelist barcode is one low quality substitution away, or BC_AMBIGUOUS if more than one is.
+int correct_bc(uint32_t code, const char *quals, int n_pos, const bc_index* index)
+{
+    int match = -1;
+    int found;
+
+    if (n_pos != -1)
+    {
+        return (quals[n_pos] < LOW_Q) ? find_neighbor(code, n_pos, index) : -1;
+    }
+    // test every low quality position so barcodes close to two whitelist barcodes are rejected instead of taking the first match
+    for (int m = 0; m < BC_LEN; m++)
+    {
+        // check if basecall is below quality score of 20
+        if (quals[m] >= LOW_Q)
+        {
+            continue;
+        }
+        found = find_neighbor(code, m, index);
+        if (found == BC_AMBIGUOUS || (found != -1 && match != -1 && found != match))
+        {
+            return BC_AMBIGUOUS;
+        }
+        if (found != -1)
+        {
+            match = found;
+        }
+    }
+    return match;
+}
+
+// Unloads the whitelist index from memory. Returns true if successful, else returns false.
+bool unload_bc_index(bc_index* index)
+{
+    if (index->map != NULL)
+    {
+        munmap(index->map, index->map_len);
+        index->map = NULL;
+    } else {
+        free(index->slots);
+        free(index->codes);
+        free(index->neighbors);
+    }
+    index->slots = NULL;
+    index->neighbors = NULL;
+    index->codes = NULL;
+    return true;
+}
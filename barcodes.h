@@ -7,8 +7,10 @@ See LICENSE for code reuse permissions.
 #define BARCODES_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
-// set the length of 10X cell barcode
+// set the length of 10X cell barcode. Barcodes are packed 2 bits per base into a uint32_t, so the length can be at most 16.
 #define BC_LEN 16
 
 // set the Q-score cutoff for low quality bases (PHRED - 33, ex. 53 == Q score of 20)
@@ -17,32 +19,119 @@ See LICENSE for code reuse permissions.
 // set the first position of barcodes in read1 sequences
 #define BC_FIRST 0
 
-// define bc_node struct for barcode trie. "counts" is a pointer to an array of int tag counts
-typedef struct bc_node {
-    bool exists;
-    unsigned long int total;
-    unsigned int *counts;
-    struct bc_node* children[4];
+// marks an empty slot in the whitelist hash table
+#define BC_EMPTY UINT32_MAX
+
+// returned by correct_bc when a barcode is one substitution away from more than one whitelist barcode
+#define BC_AMBIGUOUS -2
+
+// bit layout of a neighbor index entry: bits 0-25 hold the barcode ID + 1 (0 marks an empty slot), bit 26 marks an ambiguous neighbor
+// and bits 27-31 hold a fingerprint of the masked barcode used to skip most non matching entries
+#define NB_ID_BITS 26
+#define NB_ID_MASK ((1u << NB_ID_BITS) - 1)
+#define NB_AMBIGUOUS (1u << NB_ID_BITS)
+#define NB_FP_SHIFT 27
+
+// set the file extension of precompiled whitelist index files written by "barcounter index"
+#define BC_INDEX_EXT ".bcidx"
+
+// set the magic bytes and format version at the start of a whitelist index file
+#define BC_INDEX_MAGIC "BCIDX\0\0\0"
+#define BC_INDEX_VERSION 1
+
+// set the alignment of each table in a whitelist index file
+#define BC_INDEX_ALIGN 64
+
+// define bc_index_header struct for the start of a whitelist index file. Tables are stored at byte offsets from the start of the file,
+// so the file can be mapped at any address. "endian" holds 0x01020304 as written by the machine that built the file.
+typedef struct bc_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t bc_len;
+    uint32_t n_barcodes;
+    uint32_t mask;
+    int32_t shift;
+    uint32_t n_neighbors;
+    uint32_t reserved;
+    uint64_t slots_offset;
+    uint64_t codes_offset;
+    uint64_t neighbors_offset;
+    uint64_t file_size;
+} bc_index_header;
+
+// define bc_slot struct for one slot of the whitelist hash table: the packed barcode and its dense barcode ID
+typedef struct bc_slot {
+    uint32_t code;
+    uint32_t id;
+} bc_slot;
+
+// define bc_index struct for the whitelist. Barcodes are stored in an open addressing hash table with linear probing
+// and numbered 0 to n_barcodes - 1 in whitelist order. "codes" holds the packed barcode of each ID.
+// "neighbors" is the one mismatch neighbor index: for every whitelist barcode and position it holds an entry keyed by the barcode
+// with that position masked out, so every sequence one substitution away from a whitelist barcode finds it with one lookup per position.
+// The tables are freed when the index is unloaded, unless the index was mapped read only from a whitelist index file,
+// in which case they point into the "map_len" bytes at "map".
+typedef struct bc_index {
+    bc_slot* slots;
+    uint32_t mask;
+    int shift;
+    uint32_t n_barcodes;
+    uint32_t *codes;
+    uint32_t *neighbors;
+    uint32_t n_neighbors;
+    void *map;
+    size_t map_len;
+} bc_index;
+
+// Returns the home slot of packed barcode "code" (multiplicative hashing of the code into the top bits)
+static inline uint32_t bc_hash(uint32_t code, int shift)
+{
+    return (uint32_t) ((code * 0x9E3779B97F4A7C15ULL) >> shift);
+}
+
+// Prefetch the home slot of packed barcode "code" so a later find_bc_code of the code doesn't wait on memory
+static inline void prefetch_bc_code(uint32_t code, const bc_index* index)
+{
+    __builtin_prefetch(&index->slots[bc_hash(code, index->shift)], 0, 1);
 }
-bc_node;
 
-// Loads a trie of barocdes of length BC_LEN into memory from plaintext whitelist file "input" using provided node* "root". Returns true if successful, else returns false.
-// Allocates array of "t_count" unsigned short ints for cell tag counts.
-bool load_bc_trie(const char *input, bc_node* root, int t_count);
+// Pack barcode "seq" of length BC_LEN into "code" at 2 bits per base (A=0, C=1, G=2, T=3). Returns false if "seq" contains an 'N'.
+// Exits the program if "seq" contains any other non DNA base.
+bool pack_bc(const char *seq, uint32_t *code);
+
+// Unpack barcode "code" into the NUL terminated string "seq" of length BC_LEN.
+void unpack_bc(uint32_t code, char *seq);
 
-// Loads a trie of barocdes of length BC_LEN into memory from a gzipped whitelist file "input" using provided node* "root". Returns true if successful, else returns false.
-// Allocates array of "t_count" unsigned short ints for cell tag counts.
-bool load_bc_trie_gzipped(const char *input, bc_node* root, int t_count);
+// Loads the barcodes of length BC_LEN from the whitelist file "input" (plaintext, gzip, bgzip or zstd, detected from its contents) into "index". Returns true if successful, else returns false.
+bool load_bc_index(const char *input, bc_index* index);
 
-// Returns a pointer to the bc_trie leaf bc_node corresponding to the input barcode. If the barocde doesn't exist in the trie, return NULL.
-bc_node* get_bc_leaf(const char *seq, bc_node* root, int length);
+// Write whitelist index "index", including its neighbor index, to the whitelist index file "path". Returns true if successful, else returns false.
+bool write_bc_index_file(const bc_index* index, const char *path);
 
-// Unloads barcode trie from memory. Returns true if successful, else returns false.
-bool unload_bc_trie(bc_node* root);
+// Map the whitelist index file "path" written by write_bc_index_file read only into "index". Pages are shared by every process mapping the same file.
+// Returns true if successful, else returns false.
+bool map_bc_index_file(const char *path, bc_index* index);
 
-// helper function for unload_bc_trie
-void unload_bc_helper(bc_node* unload_trav);
+// Returns the barcode ID of packed barcode "code". If the barcode isn't in the whitelist, returns -1.
+int find_bc_code(uint32_t code, const bc_index* index);
 
+// Returns the barcode ID of barcode "seq". If the barcode doesn't exist in the whitelist or contains an 'N', returns -1.
+int get_bc_id(const char *seq, const bc_index* index);
+
+// Correct packed barcode "code", which is not in the whitelist, to the whitelist barcode one substitution away at a low quality position.
+// "quals" are the BC_LEN quality scores of the barcode. If "n_pos" is not -1 the barcode has a single 'N' at that position, which is the only position tested.
+// Returns the corrected barcode ID, -1 if no whitelist barcode is one low quality substitution away, or BC_AMBIGUOUS if more than one is.
+int correct_bc(uint32_t code, const char *quals, int n_pos, const bc_index* index);
+
+// Unloads the whitelist index from memory. Returns true if successful, else returns false.
+bool unload_bc_index(bc_index* index);
+
+// Returns the shard of packed barcode "code" in a run split into "n_shards" shards (multiplicative hashing of the code, then the top 32 bits modulo "n_shards")
+static inline int bc_shard(uint32_t code, int n_shards)
+{
+    return (int) (((code * 0x9E3779B97F4A7C15ULL) >> 32) % (uint64_t) n_shards);
+}
 
 
-#endif // BARCODES_H
\ No newline at end of file
+#endif // BARCODES_H
@@ -0,0 +1,379 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "batch.h"
+#include "umis.h"
+#include "collapse.h"
+#include "state.h"
+#include "counts.h"
+#include "output.h"
+
+// define batch_pool struct for the samples shared by the sample threads. "lock" guards "next_sample".
+// Each sample runs with "workers" worker threads.
+typedef struct batch_pool {
+    batch_sample* samples;
+    int n_samples;
+    int next_sample;
+    int workers;
+    const batch_settings* settings;
+    pthread_mutex_t lock;
+} batch_pool;
+
+// return string f_time with formatted current GMT (UTC). Unlike get_datetime this may be called from several sample threads at once.
+static char* batch_datetime(char* f_time)
+{
+    time_t current_time;
+    struct tm gmt;
+    time(&current_time);
+    gmtime_r(&current_time, &gmt);
+    strftime(f_time, 100, "%d-%b-%Y %X", &gmt);
+    return f_time;
+}
+
+// remove the trailing newline and carriage return of line "line"
+static void trim_line(char *line)
+{
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+    {
+        line[--len] = '\0';
+    }
+}
+
+// Load sample sheet "path" into "samples". Each line is sample,read1 fastq,read2 fastq for one fastq pair, or sample,interleaved fastq with no read2 fastq.
+// Lines of the same sample are combined in order and samples keep the order of their first line. Blank lines, lines starting with '#' and a header line
+// starting with "sample," are skipped. Returns the number of samples, or -1 if the sheet can't be read or a line is invalid, which is printed.
+int load_sample_sheet(const char *path, batch_sample** samples)
+{
+    char line[BATCH_LINE_LEN];
+    int n_samples = 0;
+    int max_samples = 16;
+    int line_number = 0;
+
+    FILE *fp = fopen(path, "r");
+    *samples = calloc(max_samples, sizeof(batch_sample));
+    if (fp == NULL || *samples == NULL)
+    {
+        printf("Cannot open sample sheet %s\n", path);
+        if (fp != NULL)
+        {
+            fclose(fp);
+        }
+        free(*samples);
+        *samples = NULL;
+        return -1;
+    }
+    while (fgets(line, BATCH_LINE_LEN, fp) != NULL)
+    {
+        line_number++;
+        trim_line(line);
+        if (line[0] == '\0' || line[0] == '#' || (line_number == 1 && strncmp(line, "sample,", 7) == 0))
+        {
+            continue;
+        }
+        char *name = strtok(line, ",");
+        char *read1 = strtok(NULL, ",");
+        char *read2 = strtok(NULL, ",");
+        // sample names become output file names
+        if (name == NULL || read1 == NULL || strtok(NULL, ",") != NULL || strchr(name, '/') != NULL)
+        {
+            printf("Sample sheet line %i is not sample,read1 fastq,read2 fastq or sample,interleaved fastq\n", line_number);
+            free_sample_sheet(*samples, n_samples);
+            fclose(fp);
+            return -1;
+        }
+
+        // find the sample of the line, or add it
+        int s = 0;
+        while (s < n_samples && strcmp((*samples)[s].name, name) != 0)
+        {
+            s++;
+        }
+        if (s == n_samples)
+        {
+            if (n_samples == max_samples)
+            {
+                batch_sample* grown = realloc(*samples, sizeof(batch_sample) * max_samples * 2);
+                if (grown == NULL)
+                {
+                    printf("Failed to allocate memory for the sample sheet\n");
+                    free_sample_sheet(*samples, n_samples);
+                    fclose(fp);
+                    return -1;
+                }
+                memset(grown + max_samples, 0, sizeof(batch_sample) * max_samples);
+                *samples = grown;
+                max_samples *= 2;
+            }
+            (*samples)[s].name = strdup(name);
+            n_samples++;
+        }
+        batch_sample* sample = &(*samples)[s];
+        if (sample->n_pairs == BATCH_MAX_PAIRS)
+        {
+            printf("Maximum number of fastq pairs %i exceeded for sample %s\n", BATCH_MAX_PAIRS, name);
+            free_sample_sheet(*samples, n_samples);
+            fclose(fp);
+            return -1;
+        }
+        // a sample reads either fastq pairs or interleaved fastqs
+        if (sample->n_pairs > 0 && (sample->paths2[0] == NULL) != (read2 == NULL))
+        {
+            printf("Sample %s mixes interleaved fastqs and fastq pairs on sample sheet line %i\n", name, line_number);
+            free_sample_sheet(*samples, n_samples);
+            fclose(fp);
+            return -1;
+        }
+        sample->paths1[sample->n_pairs] = strdup(read1);
+        sample->paths2[sample->n_pairs] = (read2 != NULL) ? strdup(read2) : NULL;
+        sample->n_pairs++;
+    }
+    fclose(fp);
+    if (n_samples == 0)
+    {
+        printf("Sample sheet %s lists no samples\n", path);
+        free(*samples);
+        *samples = NULL;
+        return -1;
+    }
+    return n_samples;
+}
+
+// Free the samples loaded by load_sample_sheet.
+void free_sample_sheet(batch_sample* samples, int n_samples)
+{
+    for (int s = 0; s < n_samples; s++)
+    {
+        free(samples[s].name);
+        for (int p = 0; p < samples[s].n_pairs; p++)
+        {
+            free(samples[s].paths1[p]);
+            free(samples[s].paths2[p]);
+        }
+    }
+    free(samples);
+}
+
+// log message "message" of sample "sample" to its log file "p_logfile" and to standard output
+static void log_sample(FILE *p_logfile, const batch_sample* sample, const char *message)
+{
+    char f_time[100];
+    printf("%s: %s\n", sample->name, message);
+    fprintf(p_logfile, "%s\t%s\n", batch_datetime(f_time), message);
+}
+
+// count sample "sample" with "workers" worker threads: process its fastq pairs, merge their UMI sets, write its tag counts and log, and set its status
+static void count_batch_sample(batch_sample* sample, const batch_settings* settings, int workers)
+{
+    char f_time[100];
+    char message[BATCH_PATH_LEN + 100];
+    char log_file[BATCH_PATH_LEN];
+    char counts_file[BATCH_PATH_LEN];
+    char mtx_dir[BATCH_PATH_LEN];
+    char state_file[BATCH_PATH_LEN];
+    count_ctx* ctx = settings->ctx;
+    bool count_reads = settings->directional || settings->save_state;
+    count_matrix tag_counts;
+    umi_set umis;
+
+    snprintf(log_file, BATCH_PATH_LEN, "%s%s_BarCounter.log", settings->outdir, sample->name);
+    snprintf(counts_file, BATCH_PATH_LEN, "%s%s_Tag_Counts.csv", settings->outdir, sample->name);
+    snprintf(mtx_dir, BATCH_PATH_LEN, "%s%s_Tag_Counts/", settings->outdir, sample->name);
+    snprintf(state_file, BATCH_PATH_LEN, "%s%s_BarCounter" STATE_EXT, settings->outdir, sample->name);
+
+    FILE *p_logfile = fopen(log_file, "w");
+    if (p_logfile == NULL)
+    {
+        printf("%s: Cannot create log file %s\n", sample->name, log_file);
+        sample->status = 43;
+        return;
+    }
+    fprintf(p_logfile, "%s\tBarCounter batch sample %s\n", batch_datetime(f_time), sample->name);
+    fprintf(p_logfile, "%s\t-w %s (whitelist)\n", batch_datetime(f_time), settings->whitelist);
+    fprintf(p_logfile, "%s\t-t %s (taglist)\n", batch_datetime(f_time), settings->taglist);
+    fprintf(p_logfile, sample->paths2[0] == NULL ? "%s\tinterleaved fastq\n" : "%s\tread1 fastq, read2 fastq\n", batch_datetime(f_time));
+    for (int p = 0; p < sample->n_pairs; p++)
+    {
+        fprintf(p_logfile, "\t\t\t\t%s%s%s\n", sample->paths1[p], sample->paths2[p] != NULL ? ", " : "", sample->paths2[p] != NULL ? sample->paths2[p] : "");
+    }
+    fprintf(p_logfile, "%s\t-p %i (threads)\n", batch_datetime(f_time), workers);
+    fprintf(p_logfile, "%s\t-c %s (chemistry: barcode at %i, UMI of length %i at %i in read1, tag at %i in read2)\n", batch_datetime(f_time), ctx->geometry.name,
+        ctx->geometry.bc_first, ctx->geometry.umi_len, ctx->geometry.umi_first, ctx->geometry.tag_first);
+    if (ctx->geometry.tag_window > 0)
+    {
+        fprintf(p_logfile, "%s\t--tag-window %i (tag search window)\n", batch_datetime(f_time), ctx->geometry.tag_window);
+    }
+    fprintf(p_logfile, "%s\t-u %s (UMI collapsing)\n", batch_datetime(f_time), settings->umi_collapse);
+    log_sample(p_logfile, sample, "Beginning fastq processing");
+
+    if (!init_count_matrix(&tag_counts, ctx->bc_index->n_barcodes, ctx->t_count))
+    {
+        log_sample(p_logfile, sample, "Failed to allocate memory for tag counts");
+        sample->status = 30;
+        fclose(p_logfile);
+        return;
+    }
+
+    // process the fastq pairs of the sample concurrently, then merge their UMI sets in order as a single sample run does
+    lane_job* jobs = malloc(sizeof(lane_job) * sample->n_pairs);
+    for (int p = 0; p < sample->n_pairs; p++)
+    {
+        init_lane_job(&jobs[p], sample->paths1[p], sample->paths2[p], count_reads);
+    }
+    count_fastq_lanes(jobs, sample->n_pairs, ctx, workers);
+    for (int p = 0; p < sample->n_pairs; p++)
+    {
+        if (jobs[p].status != 0 && sample->status == 0)
+        {
+            sample->status = jobs[p].status;
+            snprintf(message, sizeof(message), "Failed to process fastq %s (exit code %i)", jobs[p].status == 23 ? sample->paths2[p] : sample->paths1[p], jobs[p].status);
+            log_sample(p_logfile, sample, message);
+        }
+        if (sample->status == 0)
+        {
+            snprintf(message, sizeof(message), "Processed fastq %s%s%s", sample->paths1[p], sample->paths2[p] != NULL ? " and " : "", sample->paths2[p] != NULL ? sample->paths2[p] : "");
+            fprintf(p_logfile, "%s\t%s\n", batch_datetime(f_time), message);
+        }
+        if (p == 0)
+        {
+            umis = jobs[p].umis;
+            if (!settings->directional)
+            {
+                count_umi_set(&umis, &tag_counts);
+            }
+        } else {
+            merge_umi_set(&umis, &jobs[p].umis, settings->directional ? NULL : &tag_counts);
+            unload_umi_set(&jobs[p].umis);
+        }
+        sample->stats.total_reads += jobs[p].stats.total_reads;
+        sample->stats.valid_barcodes += jobs[p].stats.valid_barcodes;
+        sample->stats.corrected_barcodes += jobs[p].stats.corrected_barcodes;
+        sample->stats.valid_tags += jobs[p].stats.valid_tags;
+        sample->stats.ambiguous_barcodes += jobs[p].stats.ambiguous_barcodes;
+        sample->stats.shifted_tags += jobs[p].stats.shifted_tags;
+        free_lane_job(&jobs[p]);
+    }
+    free(jobs);
+
+    // collapse UMIs, save the state and write the tag counts of the sample
+    if (sample->status == 0 && settings->directional && !collapse_umi_set(&umis, ctx->geometry.umi_len, &tag_counts, workers, &sample->collapsed))
+    {
+        log_sample(p_logfile, sample, "Failed to allocate memory for UMI collapsing");
+        sample->status = 30;
+    }
+    if (sample->status == 0 && settings->save_state)
+    {
+        if (write_state_file(state_file, &umis, ctx->bc_index, settings->tags, settings->names, ctx->t_count, ctx->geometry.umi_len, &sample->stats,
+            ctx->shard_index, ctx->shard_count))
+        {
+            snprintf(message, sizeof(message), "State written to %s", state_file);
+            log_sample(p_logfile, sample, message);
+        } else {
+            snprintf(message, sizeof(message), "Failed to write state file %s", state_file);
+            log_sample(p_logfile, sample, message);
+            sample->status = 39;
+        }
+    }
+    if (sample->status == 0 && ((settings->write_csv && !write_counts_csv(counts_file, ctx->bc_index, &tag_counts, settings->names, ctx->t_count))
+        || (settings->write_mtx && !write_counts_mtx(mtx_dir, ctx->bc_index, &tag_counts, settings->tags, settings->names, ctx->t_count))))
+    {
+        snprintf(message, sizeof(message), "Failed to write tag counts to %s", settings->write_csv ? counts_file : mtx_dir);
+        log_sample(p_logfile, sample, message);
+        sample->status = 34;
+    }
+    unload_umi_set(&umis);
+    free_count_matrix(&tag_counts);
+
+    if (sample->status == 0)
+    {
+        if (settings->write_csv)
+        {
+            fprintf(p_logfile, "%s\tADT counts written to %s\n", batch_datetime(f_time), counts_file);
+        }
+        if (settings->write_mtx)
+        {
+            fprintf(p_logfile, "%s\tSparse ADT counts written to %s\n", batch_datetime(f_time), mtx_dir);
+        }
+        fprintf(p_logfile, "%s\tProcessing complete\n", batch_datetime(f_time));
+        fprintf(p_logfile, "%s\tTotal reads processed: %lli\n", batch_datetime(f_time), sample->stats.total_reads);
+        fprintf(p_logfile, "%s\tUncorrected barcodes: %lli\n", batch_datetime(f_time), sample->stats.valid_barcodes - sample->stats.corrected_barcodes);
+        fprintf(p_logfile, "%s\tCorrected barcodes: %lli\n", batch_datetime(f_time), sample->stats.corrected_barcodes);
+        fprintf(p_logfile, "%s\tAmbiguous barcodes: %lli\n", batch_datetime(f_time), sample->stats.ambiguous_barcodes);
+        fprintf(p_logfile, "%s\tTotal Valid barcodes: %lli\n", batch_datetime(f_time), sample->stats.valid_barcodes);
+        fprintf(p_logfile, "%s\tValid tags: %lli\n", batch_datetime(f_time), sample->stats.valid_tags);
+        if (settings->directional)
+        {
+            fprintf(p_logfile, "%s\tUMIs collapsed into another UMI: %lli\n", batch_datetime(f_time), sample->collapsed);
+        }
+        if (ctx->geometry.tag_window > 0)
+        {
+            fprintf(p_logfile, "%s\tTags found away from the tag offset: %lli\n", batch_datetime(f_time), sample->stats.shifted_tags);
+        }
+        snprintf(message, sizeof(message), "FINISHED (%lli reads, %lli valid tags)", sample->stats.total_reads, sample->stats.valid_tags);
+        log_sample(p_logfile, sample, message);
+    }
+    fclose(p_logfile);
+}
+
+// sample thread: count samples of the batch until none are left
+static void* batch_thread(void* arg)
+{
+    batch_pool* pool = arg;
+    while (true)
+    {
+        pthread_mutex_lock(&pool->lock);
+        int s = pool->next_sample++;
+        pthread_mutex_unlock(&pool->lock);
+        if (s >= pool->n_samples)
+        {
+            return NULL;
+        }
+        count_batch_sample(&pool->samples[s], pool->settings, pool->workers);
+    }
+}
+
+// Count the "n_samples" samples in "samples" with the shared "settings". Up to "concurrent" samples run at once and the "threads" worker threads are divided
+// between them. Each sample writes its own tag counts and log file and records its own status and statistics.
+void count_batch(batch_sample* samples, int n_samples, const batch_settings* settings, int threads, int concurrent)
+{
+    batch_pool pool;
+    pthread_t* sample_threads;
+    int started = 0;
+
+    concurrent = concurrent < n_samples ? concurrent : n_samples;
+    concurrent = concurrent < threads ? concurrent : threads;
+    pool.samples = samples;
+    pool.n_samples = n_samples;
+    pool.next_sample = 0;
+    pool.workers = threads / concurrent;
+    pool.settings = settings;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    // a single concurrent sample runs on this thread
+    sample_threads = malloc(sizeof(pthread_t) * concurrent);
+    for (int c = 1; c < concurrent && sample_threads != NULL; c++)
+    {
+        if (pthread_create(&sample_threads[started], NULL, batch_thread, &pool) != 0)
+        {
+            printf("Failed to create sample thread, continuing with %i concurrent samples\n", started + 1);
+            break;
+        }
+        started++;
+    }
+    batch_thread(&pool);
+    for (int c = 0; c < started; c++)
+    {
+        pthread_join(sample_threads[c], NULL);
+    }
+    free(sample_threads);
+    pthread_mutex_destroy(&pool.lock);
+}
@@ -0,0 +1,61 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+
+#include "tags.h"
+#include "pipeline.h"
+
+// set the maximum number of fastq pairs of one sample in a sample sheet
+#define BATCH_MAX_PAIRS 100
+
+// set the maximum length of a sample sheet line and of a batch output path
+#define BATCH_LINE_LEN 2000
+#define BATCH_PATH_LEN 600
+
+// define batch_sample struct for one sample of a sample sheet with its "n_pairs" read1/read2 fastq pairs, or interleaved fastqs if "paths2" entries are NULL.
+// "status" is 0 once the sample has been counted successfully, otherwise the program exit code describing the failure.
+typedef struct batch_sample {
+    char *name;
+    char *paths1[BATCH_MAX_PAIRS];
+    char *paths2[BATCH_MAX_PAIRS];
+    int n_pairs;
+    int status;
+    count_stats stats;
+    unsigned long long int collapsed;
+} batch_sample;
+
+// define batch_settings struct for the settings and read only lookup structures shared by every sample of a batch.
+// Outputs of each sample are written to "outdir" under the sample name.
+typedef struct batch_settings {
+    count_ctx* ctx;
+    char (*tags)[TAG_LEN + 1];
+    char (*names)[NAME_LEN + 1];
+    const char *whitelist;
+    const char *taglist;
+    const char *outdir;
+    const char *umi_collapse;
+    bool write_csv;
+    bool write_mtx;
+    bool directional;
+    bool save_state;
+} batch_settings;
+
+// Load sample sheet "path" into "samples". Each line is sample,read1 fastq,read2 fastq for one fastq pair, or sample,interleaved fastq with no read2 fastq.
+// Lines of the same sample are combined in order and samples keep the order of their first line. Blank lines, lines starting with '#' and a header line
+// starting with "sample," are skipped. Returns the number of samples, or -1 if the sheet can't be read or a line is invalid, which is printed.
+int load_sample_sheet(const char *path, batch_sample** samples);
+
+// Free the samples loaded by load_sample_sheet.
+void free_sample_sheet(batch_sample* samples, int n_samples);
+
+// Count the "n_samples" samples in "samples" with the shared "settings". Up to "concurrent" samples run at once and the "threads" worker threads are divided
+// between them. Each sample writes its own tag counts and log file and records its own status and statistics.
+void count_batch(batch_sample* samples, int n_samples, const batch_settings* settings, int threads, int concurrent);
+
+#endif // BATCH_H
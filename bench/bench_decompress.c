@@ -0,0 +1,145 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+/*
+Compares the original gzopen/gzgets fastq reading path with the block based fq_reader on the same fastq pair.
+Compile from the repository root:
+    gcc -O2 -I. bench/bench_decompress.c fastq.c input.c -lz -lpthread -o bench_decompress
+Usage:
+    ./bench_decompress {read1 fastq} {read2 fastq} [repeats]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "fastq.h"
+
+// return the current monotonic time in seconds
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// read a fastq pair with 8 gzgets calls per read pair into fixed 200 byte buffers, as the original main loop did.
+// Returns the number of read pairs and adds the first sequence base of every read to "checksum".
+static unsigned long long int read_gzgets(const char *path1, const char *path2, unsigned long long int *checksum)
+{
+    char R1_ID[200], R1_seq[200], R1_spacer[10], R1_quals[200];
+    char R2_ID[200], R2_seq[200], R2_spacer[10], R2_quals[200];
+    unsigned long long int reads = 0;
+
+    gzFile pinR1 = gzopen(path1, "r");
+    gzFile pinR2 = gzopen(path2, "r");
+    if (pinR1 == NULL || pinR2 == NULL)
+    {
+        printf("Cannot open fastq files %s and %s\n", path1, path2);
+        exit(1);
+    }
+    while (true)
+    {
+        if (!gzgets(pinR1, R1_ID, 200))
+        {
+            break;
+        }
+        gzgets(pinR1, R1_seq, 200);
+        gzgets(pinR1, R1_spacer, 10);
+        gzgets(pinR1, R1_quals, 200);
+        if (!gzgets(pinR2, R2_ID, 200))
+        {
+            break;
+        }
+        gzgets(pinR2, R2_seq, 200);
+        gzgets(pinR2, R2_spacer, 10);
+        gzgets(pinR2, R2_quals, 200);
+        *checksum += R1_seq[0] + R2_seq[0] + R1_quals[0];
+        reads++;
+    }
+    gzclose(pinR1);
+    gzclose(pinR2);
+    return reads;
+}
+
+// read a fastq pair with one fq_reader per file, each decompressing large blocks on its own thread.
+// Returns the number of read pairs and adds the first sequence base of every read to "checksum".
+static unsigned long long int read_blocks(const char *path1, const char *path2, unsigned long long int *checksum)
+{
+    fq_record rec1;
+    fq_record rec2;
+    unsigned long long int reads = 0;
+
+    fq_reader* pinR1 = fq_open(path1);
+    fq_reader* pinR2 = fq_open(path2);
+    if (pinR1 == NULL || pinR2 == NULL)
+    {
+        printf("Cannot open fastq files %s and %s\n", path1, path2);
+        exit(1);
+    }
+    while (fq_next_record(pinR1, &rec1) && fq_next_record(pinR2, &rec2))
+    {
+        *checksum += rec1.seq[0] + rec2.seq[0] + rec1.quals[0];
+        reads++;
+    }
+    fq_close(pinR1);
+    fq_close(pinR2);
+    return reads;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("Usage: %s {read1 fastq} {read2 fastq} [repeats]\n", argv[0]);
+        return 1;
+    }
+    int repeats = argc > 3 ? atoi(argv[3]) : 3;
+    if (repeats < 1)
+    {
+        repeats = 1;
+    }
+
+    double best_gz = 0;
+    double best_block = 0;
+    unsigned long long int reads_gz = 0, reads_block = 0;
+    unsigned long long int sum_gz = 0, sum_block = 0;
+
+    for (int r = 0; r < repeats; r++)
+    {
+        double start = now_seconds();
+        sum_gz = 0;
+        reads_gz = read_gzgets(argv[1], argv[2], &sum_gz);
+        double elapsed = now_seconds() - start;
+        if (r == 0 || elapsed < best_gz)
+        {
+            best_gz = elapsed;
+        }
+
+        start = now_seconds();
+        sum_block = 0;
+        reads_block = read_blocks(argv[1], argv[2], &sum_block);
+        elapsed = now_seconds() - start;
+        if (r == 0 || elapsed < best_block)
+        {
+            best_block = elapsed;
+        }
+    }
+
+    if (reads_gz != reads_block || sum_gz != sum_block)
+    {
+        printf("Readers disagree: gzgets read %llu pairs (checksum %llu), blocks read %llu pairs (checksum %llu)\n", reads_gz, sum_gz, reads_block, sum_block);
+        return 1;
+    }
+
+    printf("read pairs: %llu (best of %i runs)\n", reads_gz, repeats);
+    printf("gzopen/gzgets: %.3f s, %.0f read pairs/s\n", best_gz, reads_gz / best_gz);
+    printf("fq_reader blocks: %.3f s, %.0f read pairs/s\n", best_block, reads_block / best_block);
+    printf("speedup: %.2fx\n", best_gz / best_block);
+    return 0;
+}
@@ -0,0 +1,367 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+/*
+Benchmarks BarCounter on a data set written by bench/gen_citeseq.c.
+Part 1 times the per read lookups in isolation on the first read pairs of the data set: whitelist lookup (pack_bc + find_bc_code), barcode correction (correct_bc),
+tag lookup (get_tag_index) and UMI deduplication (add_umi). The whitelist lookup and UMI deduplication are also timed in groups of "lookup batch" reads whose
+slots are prefetched before they are looked up, as the worker threads do, and the speedup over one lookup at a time is reported.
+Part 2 runs the barcounter binary end to end on every lane, once with --lookup-batch 1 and once with the lookup batch, and reports wall time, reads/sec,
+peak RSS and the speedup.
+Compile from the repository root:
+    gcc -O2 -I. bench/bench_pipeline.c barcodes.c tags.c umis.c fastq.c input.c counts.c -lz -lpthread -o bench_pipeline
+Usage:
+    ./bench_pipeline {data directory} {barcounter binary} [threads] [reads for part 1] [lookup batch]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "barcodes.h"
+#include "tags.h"
+#include "umis.h"
+#include "fastq.h"
+#include "pipeline.h"
+
+// set the default number of read pairs used for the per function timings
+#define BENCH_READS 2000000
+
+// set the maximum number of lanes searched for in the data directory
+#define BENCH_LANES 9
+
+// define bench_read struct for the fields of one read pair used by the per function timings
+typedef struct bench_read {
+    char bc[BC_LEN];
+    char quals[BC_LEN];
+    char umi[UMI_LEN];
+    char tag[TAG_LEN];
+    uint32_t code;
+    int n_pos;
+    int bc_id;
+    int tag_index;
+} bench_read;
+
+// return the current monotonic time in seconds
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// print one timing line
+static void report(const char *name, long calls, double seconds)
+{
+    printf("%-28s %12li %10.3f %10.1f\n", name, calls, seconds, calls > 0 ? seconds * 1e9 / calls : 0.0);
+}
+
+// run "barcounter" on the fastq files "files1" and "files2" with "threads" threads and lookup batch "lookup_batch", and print its wall time,
+// reads/sec and peak RSS. Sets "wall" to the wall time in seconds. Returns true if barcounter ran successfully, else returns false.
+static bool run_barcounter(const char *barcounter, const char *whitelist, const char *taglist, const char *files1, const char *files2, const char *outdir,
+    int threads, int lookup_batch, long total_reads, double *wall)
+{
+    char threads_arg[16];
+    char batch_arg[16];
+    snprintf(threads_arg, sizeof(threads_arg), "%i", threads);
+    snprintf(batch_arg, sizeof(batch_arg), "%i", lookup_batch);
+
+    fflush(stdout);
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // silence the barcounter output so it does not mix with the report
+        if (freopen("/dev/null", "w", stdout) == NULL)
+        {
+            _exit(127);
+        }
+        execl(barcounter, barcounter, "-w", whitelist, "-t", taglist, "-1", files1, "-2", files2, "-o", outdir, "-p", threads_arg, "--lookup-batch", batch_arg, (char *) NULL);
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    if (pid < 0 || wait4(pid, &status, 0, &usage) < 0)
+    {
+        printf("Failed to run %s\n", barcounter);
+        return false;
+    }
+    *wall = now_seconds() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        printf("%s exited with status %i\n", barcounter, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        return false;
+    }
+    printf("threads %i, lookup batch %2i: %.3f s wall, %.3f s user, %.3f s system, %.0f reads/sec, peak RSS %.1f MB\n", threads, lookup_batch, *wall,
+           usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6, usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+           total_reads / *wall, usage.ru_maxrss / 1024.0);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("Usage: ./bench_pipeline {data directory} {barcounter binary} [threads] [reads for part 1] [lookup batch]\n");
+        return 1;
+    }
+    const char *dir = argv[1];
+    const char *barcounter = argv[2];
+    int threads = (argc > 3) ? atoi(argv[3]) : 1;
+    long max_reads = (argc > 4) ? atol(argv[4]) : BENCH_READS;
+    int lookup_batch = (argc > 5) ? atoi(argv[5]) : LOOKUP_BATCH_DEFAULT;
+    if (lookup_batch < 1 || lookup_batch > LOOKUP_BATCH_MAX)
+    {
+        printf("Lookup batch must be between 1 and %i\n", LOOKUP_BATCH_MAX);
+        return 1;
+    }
+    char whitelist[1000];
+    char taglist[1000];
+    char paths1[BENCH_LANES][1000];
+    char paths2[BENCH_LANES][1000];
+    int lanes = 0;
+    struct stat st;
+
+    snprintf(whitelist, sizeof(whitelist), "%s/whitelist.txt.gz", dir);
+    snprintf(taglist, sizeof(taglist), "%s/taglist.csv", dir);
+    for (int l = 0; l < BENCH_LANES; l++)
+    {
+        snprintf(paths1[lanes], sizeof(paths1[lanes]), "%s/bench_S1_L00%i_R1_001.fastq.gz", dir, l + 1);
+        snprintf(paths2[lanes], sizeof(paths2[lanes]), "%s/bench_S1_L00%i_R2_001.fastq.gz", dir, l + 1);
+        if (stat(paths1[lanes], &st) == 0 && stat(paths2[lanes], &st) == 0)
+        {
+            lanes++;
+        }
+    }
+    if (lanes == 0)
+    {
+        printf("No bench_S1_L00*_R1_001.fastq.gz files found in %s\n", dir);
+        return 1;
+    }
+
+    // load the taglist and whitelist
+    static char tags[MAX_TAGS][TAG_LEN + 1];
+    static char names[MAX_TAGS][NAME_LEN + 1];
+    tag_index tag_lookup;
+    bc_index whitelist_index;
+    double start = now_seconds();
+    int t_count = load_taglist(taglist, tags, names);
+    if (!load_tag_index(tags, &tag_lookup, t_count))
+    {
+        printf("Failed to load tags\n");
+        return 1;
+    }
+    double tag_load = now_seconds() - start;
+    start = now_seconds();
+    if (!load_bc_index(whitelist, &whitelist_index))
+    {
+        printf("Failed to load whitelist\n");
+        return 1;
+    }
+    double bc_load = now_seconds() - start;
+
+    // read the barcode, UMI and tag fields of the first read pairs of lane 1, and count the read pairs of every lane
+    bench_read *reads = malloc(sizeof(bench_read) * max_reads);
+    long n_reads = 0;
+    long total_reads = 0;
+    fq_record rec1;
+    fq_record rec2;
+    if (reads == NULL)
+    {
+        printf("Failed to allocate %li reads\n", max_reads);
+        return 1;
+    }
+    for (int l = 0; l < lanes; l++)
+    {
+        fq_reader* pinR1 = fq_open(paths1[l]);
+        fq_reader* pinR2 = fq_open(paths2[l]);
+        if (pinR1 == NULL || pinR2 == NULL)
+        {
+            printf("Failed to open lane %i\n", l + 1);
+            return 1;
+        }
+        while (fq_next_record(pinR1, &rec1) && fq_next_record(pinR2, &rec2))
+        {
+            if (n_reads < max_reads && rec1.seq_len >= UMI_FIRST + UMI_LEN && rec2.seq_len >= TAG_FIRST + TAG_LEN)
+            {
+                memcpy(reads[n_reads].bc, rec1.seq + BC_FIRST, BC_LEN);
+                memcpy(reads[n_reads].quals, rec1.quals + BC_FIRST, BC_LEN);
+                memcpy(reads[n_reads].umi, rec1.seq + UMI_FIRST, UMI_LEN);
+                memcpy(reads[n_reads].tag, rec2.seq + TAG_FIRST, TAG_LEN);
+                n_reads++;
+            }
+            total_reads++;
+        }
+        fq_close(pinR1);
+        fq_close(pinR2);
+    }
+
+    printf("Data set %s: %i lanes, %li read pairs, %u whitelist barcodes, %i tags\n\n", dir, lanes, total_reads, whitelist_index.n_barcodes, t_count);
+    printf("Part 1: per function timings on %li read pairs\n", n_reads);
+    printf("%-28s %12s %10s %10s\n", "function", "calls", "seconds", "ns/call");
+    report("load_tag_index", 1, tag_load);
+    report("load_bc_index", 1, bc_load);
+
+    // whitelist lookup of every barcode
+    long calls = 0;
+    long checksum = 0;
+    start = now_seconds();
+    for (long r = 0; r < n_reads; r++)
+    {
+        bench_read* br = &reads[r];
+        br->n_pos = -1;
+        br->bc_id = -1;
+        if (pack_bc(br->bc, &br->code))
+        {
+            br->bc_id = find_bc_code(br->code, &whitelist_index);
+        } else {
+            const char *n_base = memchr(br->bc, 'N', BC_LEN);
+            br->n_pos = (memchr(n_base + 1, 'N', BC_LEN - (n_base - br->bc) - 1) == NULL) ? (int) (n_base - br->bc) : -2;
+        }
+        calls++;
+    }
+    double single = now_seconds() - start;
+    report("pack_bc + find_bc_code", calls, single);
+
+    // the same lookups in groups: pack every barcode of the group and prefetch its slot, then look the group up
+    uint32_t codes[LOOKUP_BATCH_MAX];
+    bool packed[LOOKUP_BATCH_MAX];
+    long mismatches = 0;
+    start = now_seconds();
+    for (long g = 0; g < n_reads; g += lookup_batch)
+    {
+        int n = (n_reads - g < lookup_batch) ? (int) (n_reads - g) : lookup_batch;
+        for (int r = 0; r < n; r++)
+        {
+            packed[r] = pack_bc(reads[g + r].bc, &codes[r]);
+            if (packed[r])
+            {
+                prefetch_bc_code(codes[r], &whitelist_index);
+            }
+        }
+        for (int r = 0; r < n; r++)
+        {
+            int bc_id = packed[r] ? find_bc_code(codes[r], &whitelist_index) : -1;
+            mismatches += (bc_id != reads[g + r].bc_id);
+        }
+    }
+    double batched = now_seconds() - start;
+    report("batched find_bc_code", calls, batched);
+    printf("(lookup batch %i: %.2fx whitelist lookup speedup, %li mismatches)\n", lookup_batch, batched > 0 ? single / batched : 0.0, mismatches);
+
+    // correction of every barcode that is not in the whitelist
+    calls = 0;
+    start = now_seconds();
+    for (long r = 0; r < n_reads; r++)
+    {
+        bench_read* br = &reads[r];
+        if (br->bc_id == -1 && br->n_pos != -2)
+        {
+            br->bc_id = correct_bc(br->code, br->quals, br->n_pos, &whitelist_index);
+            calls++;
+        }
+    }
+    report("correct_bc", calls, now_seconds() - start);
+
+    // tag lookup of every read
+    calls = 0;
+    start = now_seconds();
+    for (long r = 0; r < n_reads; r++)
+    {
+        reads[r].tag_index = get_tag_index(reads[r].tag, &tag_lookup);
+        checksum += reads[r].tag_index;
+        calls++;
+    }
+    report("get_tag_index", calls, now_seconds() - start);
+
+    // UMI deduplication of every valid read
+    umi_set umis;
+    uint32_t umi;
+    long unique = 0;
+    calls = 0;
+    if (!init_umi_set(&umis, false))
+    {
+        printf("Failed to allocate UMI set\n");
+        return 1;
+    }
+    start = now_seconds();
+    for (long r = 0; r < n_reads; r++)
+    {
+        bench_read* br = &reads[r];
+        if (br->bc_id >= 0 && br->tag_index >= 0 && pack_umi(br->umi, UMI_LEN, &umi))
+        {
+            unique += add_umi(&umis, umi_key(br->bc_id, br->tag_index, umi));
+            calls++;
+        }
+    }
+    report("add_umi", calls, now_seconds() - start);
+    printf("(%li unique barcode/UMI/tag combinations, checksum %li)\n", unique, checksum);
+    unload_umi_set(&umis);
+
+    // UMI deduplication of the same keys one at a time and in prefetched groups, each into an empty set
+    uint64_t *keys = malloc(sizeof(uint64_t) * (calls + 1));
+    long n_keys = 0;
+    for (long r = 0; r < n_reads && keys != NULL; r++)
+    {
+        bench_read* br = &reads[r];
+        if (br->bc_id >= 0 && br->tag_index >= 0 && pack_umi(br->umi, UMI_LEN, &umi))
+        {
+            keys[n_keys++] = umi_key(br->bc_id, br->tag_index, umi);
+        }
+    }
+    double dedup[2] = {0, 0};
+    for (int b = 0; b < 2 && keys != NULL; b++)
+    {
+        if (!init_umi_set(&umis, false))
+        {
+            printf("Failed to allocate UMI set\n");
+            return 1;
+        }
+        start = now_seconds();
+        for (long k = 0; k < n_keys; k += BATCH_READS)
+        {
+            add_umis(&umis, keys + k, (n_keys - k < BATCH_READS) ? (int) (n_keys - k) : BATCH_READS, b == 0 ? 1 : lookup_batch);
+        }
+        dedup[b] = now_seconds() - start;
+        report(b == 0 ? "add_umis, batch 1" : "batched add_umis", n_keys, dedup[b]);
+        unload_umi_set(&umis);
+    }
+    printf("(lookup batch %i: %.2fx UMI deduplication speedup)\n\n", lookup_batch, dedup[1] > 0 ? dedup[0] / dedup[1] : 0.0);
+    free(keys);
+    unload_bc_index(&whitelist_index);
+    unload_tag_index(&tag_lookup);
+    free(reads);
+
+    // run barcounter end to end on every lane
+    char files1[BENCH_LANES * 1000] = "";
+    char files2[BENCH_LANES * 1000] = "";
+    char outdir[1100];
+    for (int l = 0; l < lanes; l++)
+    {
+        strcat(files1, l ? "," : "");
+        strcat(files1, paths1[l]);
+        strcat(files2, l ? "," : "");
+        strcat(files2, paths2[l]);
+    }
+    snprintf(outdir, sizeof(outdir), "%s/bench_out/", dir);
+
+    printf("Part 2: end to end\n");
+    double wall_single, wall_batched;
+    if (!run_barcounter(barcounter, whitelist, taglist, files1, files2, outdir, threads, 1, total_reads, &wall_single)
+        || !run_barcounter(barcounter, whitelist, taglist, files1, files2, outdir, threads, lookup_batch, total_reads, &wall_batched))
+    {
+        return 1;
+    }
+    printf("lookup batch %i: %.2fx end to end speedup over lookup batch 1\n", lookup_batch, wall_single / wall_batched);
+    return 0;
+}
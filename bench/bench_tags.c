@@ -0,0 +1,228 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+/*
+Compares the original 5-ary tag trie with the packed tag hash table on random tag panels of 10, 150 and 300 tags.
+Queries are a mix of exact tags, tags with one substitution or 'N', and random sequences that match no tag.
+Compile from the repository root:
+    gcc -O2 -I. bench/bench_tags.c tags.c -o bench_tags
+Usage:
+    ./bench_tags [queries per panel]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "tags.h"
+
+// set the default number of tag lookups per panel
+#define BENCH_QUERIES 10000000
+
+// define trie_node struct, the node of the original tag trie
+typedef struct trie_node {
+    bool exists;
+    int index;
+    struct trie_node* children[5];
+} trie_node;
+
+// return the current monotonic time in seconds
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// return the child index of base "c" in the original tag trie
+static int trie_child(char c)
+{
+    switch(c)
+    {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        default: return 4;
+    }
+}
+
+// add tag sequence "tag" with tag index "t" to the original tag trie
+static void trie_add(const char *tag, trie_node* root, int t)
+{
+    trie_node* trav = root;
+    for (int c = 0; c < TAG_LEN; c++)
+    {
+        int i = trie_child(tag[c]);
+        if (trav->children[i] == NULL)
+        {
+            trav->children[i] = calloc(1, sizeof(trie_node));
+        }
+        trav = trav->children[i];
+    }
+    trav->exists = true;
+    trav->index = t;
+}
+
+// load every tag and every seq 1 hamming distance from a tag into the original tag trie
+static void trie_load(char tags[MAX_TAGS][TAG_LEN + 1], trie_node* root, int t_count)
+{
+    char bases[6] = "ACGTN";
+    char temp[TAG_LEN + 1];
+    for (int t = 0; t < t_count; t++)
+    {
+        trie_add(tags[t], root, t);
+        for (int m = 0; m < TAG_LEN; m++)
+        {
+            strcpy(temp, tags[t]);
+            for (int b = 0; b < 5; b++)
+            {
+                if (bases[b] != tags[t][m])
+                {
+                    temp[m] = bases[b];
+                    trie_add(temp, root, t);
+                }
+            }
+        }
+    }
+}
+
+// look up "tag" in the original tag trie as get_tag_index did. Returns the tag index or -1.
+static int trie_find(const char *tag, const trie_node* root)
+{
+    const trie_node* trav = root;
+    for (int c = 0; c < TAG_LEN; c++)
+    {
+        trav = trav->children[trie_child(tag[c])];
+        if (trav == NULL)
+        {
+            return -1;
+        }
+    }
+    return trav->exists ? trav->index : -1;
+}
+
+// free the original tag trie
+static void trie_free(trie_node* node)
+{
+    for (int i = 0; i < 5; i++)
+    {
+        if (node->children[i] != NULL)
+        {
+            trie_free(node->children[i]);
+        }
+    }
+    free(node);
+}
+
+// fill "seq" with TAG_LEN random bases
+static void random_seq(char *seq)
+{
+    char bases[5] = "ACGT";
+    for (int i = 0; i < TAG_LEN; i++)
+    {
+        seq[i] = bases[rand() & 3];
+    }
+    seq[TAG_LEN] = '\0';
+}
+
+// create a random panel of "t_count" tags with a hamming distance of at least MIN_TAG_HDIST between every pair
+static void random_panel(char tags[MAX_TAGS][TAG_LEN + 1], int t_count)
+{
+    int n = 0;
+    while (n < t_count)
+    {
+        random_seq(tags[n]);
+        bool valid = true;
+        for (int t = 0; t < n && valid; t++)
+        {
+            valid = hamming_distance(tags[n], tags[t]) >= MIN_TAG_HDIST;
+        }
+        if (valid)
+        {
+            n++;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static char tags[MAX_TAGS][TAG_LEN + 1];
+    int panels[3] = {10, 150, 300};
+    long n_queries = (argc > 1) ? atol(argv[1]) : BENCH_QUERIES;
+    char *queries = malloc((size_t) n_queries * TAG_LEN);
+    if (queries == NULL || n_queries <= 0)
+    {
+        printf("Failed to allocate %li queries\n", n_queries);
+        return 1;
+    }
+
+    srand(1);
+    printf("tags\tqueries\ttrie_s\thash_s\ttrie_Mq/s\thash_Mq/s\tspeedup\n");
+    for (int p = 0; p < 3; p++)
+    {
+        int t_count = panels[p];
+        random_panel(tags, t_count);
+
+        // one third exact tags, one third single substitutions or 'N', one third random sequences
+        char seq[TAG_LEN + 1];
+        for (long q = 0; q < n_queries; q++)
+        {
+            switch (q % 3)
+            {
+                case 0: memcpy(seq, tags[rand() % t_count], TAG_LEN); break;
+                case 1: memcpy(seq, tags[rand() % t_count], TAG_LEN);
+                        seq[rand() % TAG_LEN] = "ACGTN"[rand() % 5]; break;
+                default: random_seq(seq); break;
+            }
+            memcpy(queries + q * TAG_LEN, seq, TAG_LEN);
+        }
+
+        trie_node* root = calloc(1, sizeof(trie_node));
+        tag_index index;
+        trie_load(tags, root, t_count);
+        if (!load_tag_index(tags, &index, t_count))
+        {
+            printf("Failed to load tag index\n");
+            return 1;
+        }
+
+        // ensure both lookups agree before timing them
+        for (long q = 0; q < n_queries; q++)
+        {
+            if (trie_find(queries + q * TAG_LEN, root) != get_tag_index(queries + q * TAG_LEN, &index))
+            {
+                printf("Lookup mismatch for %.*s\n", TAG_LEN, queries + q * TAG_LEN);
+                return 1;
+            }
+        }
+
+        long checksum = 0;
+        double start = now_seconds();
+        for (long q = 0; q < n_queries; q++)
+        {
+            checksum += trie_find(queries + q * TAG_LEN, root);
+        }
+        double trie_s = now_seconds() - start;
+
+        start = now_seconds();
+        for (long q = 0; q < n_queries; q++)
+        {
+            checksum -= get_tag_index(queries + q * TAG_LEN, &index);
+        }
+        double hash_s = now_seconds() - start;
+
+        printf("%i\t%li\t%.3f\t%.3f\t%.1f\t%.1f\t%.2fx%s\n", t_count, n_queries, trie_s, hash_s, n_queries / trie_s / 1e6,
+               n_queries / hash_s / 1e6, trie_s / hash_s, checksum == 0 ? "" : "\tchecksum mismatch");
+
+        trie_free(root);
+        unload_tag_index(&index);
+    }
+    free(queries);
+    return 0;
+}
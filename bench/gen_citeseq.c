@@ -0,0 +1,301 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+/*
+Generates a deterministic synthetic CITE-seq data set for benchmarking: a barcode whitelist, a taglist and gzipped R1/R2 fastq files.
+The same options and seed always produce the same files.
+Compile from the repository root:
+    gcc -O2 -I. bench/gen_citeseq.c tags.c -lz -o gen_citeseq
+Usage:
+    ./gen_citeseq -o {output directory} [options]
+Options:
+    -r reads: total read pairs, default 1000000
+    -c cells: cells drawn from the whitelist, default 5000
+    -w whitelist size: barcodes in the whitelist, default 100000
+    -t tags: tags in the taglist (at most MAX_TAGS), default 150
+    -e error rate: per base substitution rate in barcodes and tags, error bases get low quality scores, default 0.01
+    -n N rate: per base rate of 'N' calls in barcodes, tags and UMIs, default 0.001
+    -d duplication: mean read pairs per molecule (barcode/UMI/tag), default 5
+    -b background: fraction of read pairs with a random barcode that is not from a cell, default 0.1
+    -l lanes: number of fastq pairs the reads are split across, default 1
+    -L read2 length: at most 900, default 90
+    -s seed: default 1
+Outputs written to the output directory:
+    whitelist.txt.gz, taglist.csv, bench_S1_L00{lane}_R1_001.fastq.gz and bench_S1_L00{lane}_R2_001.fastq.gz
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "barcodes.h"
+#include "tags.h"
+#include "umis.h"
+
+// set the quality characters of normal and low quality (error) bases
+#define GEN_HIGH_Q 'F'
+#define GEN_LOW_Q ','
+
+// define molecule struct for one barcode/UMI/tag combination
+typedef struct molecule {
+    uint32_t bc;
+    uint32_t umi;
+    uint16_t tag;
+} molecule;
+
+// state of the splitmix64 pseudo random number generator
+static uint64_t rng_state;
+
+// return the next pseudo random 64 bit number
+static uint64_t next_rand(void)
+{
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// return a pseudo random number in [0, n)
+static uint64_t rand_below(uint64_t n)
+{
+    return next_rand() % n;
+}
+
+// return a pseudo random number in [0, 1)
+static double rand_unit(void)
+{
+    return (next_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// write "len" bases of packed sequence "code" (2 bits per base) to "seq"
+static void unpack_seq(uint64_t code, int len, char *seq)
+{
+    for (int b = len - 1; b >= 0; b--)
+    {
+        seq[b] = "ACGT"[code & 3];
+        code >>= 2;
+    }
+}
+
+// add sequencing errors to "len" bases of "seq" with qualities "quals": substitutions at rate "error_rate" get a low quality score and
+// 'N' calls at rate "n_rate". Only the "len" bases are changed.
+static void add_errors(char *seq, char *quals, int len, double error_rate, double n_rate)
+{
+    for (int b = 0; b < len; b++)
+    {
+        double x = rand_unit();
+        if (x < n_rate)
+        {
+            seq[b] = 'N';
+            quals[b] = '#';
+        }
+        else if (x < n_rate + error_rate)
+        {
+            char base;
+            do
+            {
+                base = "ACGT"[rand_below(4)];
+            } while (base == seq[b]);
+            seq[b] = base;
+            quals[b] = GEN_LOW_Q;
+        }
+    }
+}
+
+// add "code" to the open addressing set "table" of mask + 1 slots. Returns true if it was already in the set.
+static bool seen_code(uint32_t code, uint32_t *table, uint32_t mask)
+{
+    uint32_t s = (uint32_t) ((code * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+    while (table[s] != 0)
+    {
+        if (table[s] == code + 1)
+        {
+            return true;
+        }
+        s = (s + 1) & mask;
+    }
+    table[s] = code + 1;
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    char *outdir = NULL;
+    long reads = 1000000;
+    long cells = 5000;
+    long wl_size = 100000;
+    int t_count = 150;
+    double error_rate = 0.01;
+    double n_rate = 0.001;
+    double dup = 5.0;
+    double background = 0.1;
+    int lanes = 1;
+    int r2_len = 90;
+    uint64_t seed = 1;
+    int a;
+
+    while ((a = getopt(argc, argv, "o:r:c:w:t:e:n:d:b:l:L:s:")) != -1)
+    {
+        switch(a)
+        {
+            case 'o': outdir = optarg; break;
+            case 'r': reads = atol(optarg); break;
+            case 'c': cells = atol(optarg); break;
+            case 'w': wl_size = atol(optarg); break;
+            case 't': t_count = atoi(optarg); break;
+            case 'e': error_rate = atof(optarg); break;
+            case 'n': n_rate = atof(optarg); break;
+            case 'd': dup = atof(optarg); break;
+            case 'b': background = atof(optarg); break;
+            case 'l': lanes = atoi(optarg); break;
+            case 'L': r2_len = atoi(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            default: printf("Usage: ./gen_citeseq -o {output directory} [-r reads] [-c cells] [-w whitelist size] [-t tags] [-e error rate] [-n N rate] [-d duplication] [-b background] [-l lanes] [-L read2 length] [-s seed]\n");
+                     return 1;
+        }
+    }
+    if (outdir == NULL || reads < 1 || cells < 1 || wl_size < cells || t_count < 1 || t_count > MAX_TAGS || dup < 1.0 || lanes < 1 || lanes > 9 || r2_len < TAG_LEN || r2_len > 900)
+    {
+        printf("Invalid or missing options. Refer to the usage at the top of bench/gen_citeseq.c\n");
+        return 1;
+    }
+    rng_state = seed;
+    mkdir(outdir, 0777);
+
+    char path[1000];
+    char seq[BC_LEN + UMI_LEN + 1];
+    char r2[1000];
+    char quals[1000];
+
+    // whitelist: unique random barcodes
+    uint32_t mask = 1;
+    while (mask < wl_size * 2)
+    {
+        mask <<= 1;
+    }
+    uint32_t *table = calloc(mask, sizeof(uint32_t));
+    uint32_t *whitelist = malloc(sizeof(uint32_t) * wl_size);
+    if (table == NULL || whitelist == NULL)
+    {
+        printf("Failed to allocate whitelist\n");
+        return 1;
+    }
+    for (long w = 0; w < wl_size; w++)
+    {
+        do
+        {
+            whitelist[w] = (uint32_t) next_rand();
+        } while (whitelist[w] == UINT32_MAX || seen_code(whitelist[w], table, mask - 1));
+    }
+    free(table);
+    snprintf(path, sizeof(path), "%s/whitelist.txt.gz", outdir);
+    gzFile wl = gzopen(path, "wb1");
+    if (wl == NULL)
+    {
+        printf("%s could not be opened for writing\n", path);
+        return 1;
+    }
+    for (long w = 0; w < wl_size; w++)
+    {
+        unpack_seq(whitelist[w], BC_LEN, seq);
+        seq[BC_LEN] = '\0';
+        gzprintf(wl, "%s\n", seq);
+    }
+    gzclose(wl);
+
+    // taglist: random tags with a hamming distance of at least MIN_TAG_HDIST between every pair
+    static char tags[MAX_TAGS][TAG_LEN + 1];
+    int n_tags = 0;
+    while (n_tags < t_count)
+    {
+        unpack_seq(next_rand(), TAG_LEN, tags[n_tags]);
+        tags[n_tags][TAG_LEN] = '\0';
+        bool valid = true;
+        for (int t = 0; t < n_tags && valid; t++)
+        {
+            valid = hamming_distance(tags[n_tags], tags[t]) >= MIN_TAG_HDIST;
+        }
+        if (valid)
+        {
+            n_tags++;
+        }
+    }
+    snprintf(path, sizeof(path), "%s/taglist.csv", outdir);
+    FILE *tl = fopen(path, "w");
+    if (tl == NULL)
+    {
+        printf("%s could not be opened for writing\n", path);
+        return 1;
+    }
+    for (int t = 0; t < t_count; t++)
+    {
+        fprintf(tl, "%s,Tag%i\n", tags[t], t + 1);
+    }
+    fclose(tl);
+
+    // molecules: each read pair is drawn from a pool of reads / dup molecules, so molecules are seen "dup" times on average
+    long n_molecules = (long) (reads / dup);
+    if (n_molecules < 1)
+    {
+        n_molecules = 1;
+    }
+    molecule *molecules = malloc(sizeof(molecule) * n_molecules);
+    if (molecules == NULL)
+    {
+        printf("Failed to allocate molecules\n");
+        return 1;
+    }
+    for (long m = 0; m < n_molecules; m++)
+    {
+        // cells are the first "cells" whitelist barcodes; background molecules get a random barcode
+        molecules[m].bc = (rand_unit() < background) ? (uint32_t) next_rand() : whitelist[rand_below(cells)];
+        molecules[m].umi = (uint32_t) rand_below(1u << (2 * UMI_LEN));
+        molecules[m].tag = (uint16_t) rand_below(t_count);
+    }
+
+    // fastq pairs: reads are split evenly across lanes
+    memset(r2 + TAG_LEN, 'A', r2_len - TAG_LEN);
+    for (int l = 0; l < lanes; l++)
+    {
+        snprintf(path, sizeof(path), "%s/bench_S1_L00%i_R1_001.fastq.gz", outdir, l + 1);
+        gzFile fq1 = gzopen(path, "wb1");
+        snprintf(path, sizeof(path), "%s/bench_S1_L00%i_R2_001.fastq.gz", outdir, l + 1);
+        gzFile fq2 = gzopen(path, "wb1");
+        if (fq1 == NULL || fq2 == NULL)
+        {
+            printf("%s could not be opened for writing\n", path);
+            return 1;
+        }
+        long lane_reads = reads / lanes + (l < reads % lanes ? 1 : 0);
+        for (long r = 0; r < lane_reads; r++)
+        {
+            const molecule* mol = &molecules[rand_below(n_molecules)];
+
+            unpack_seq(mol->bc, BC_LEN, seq);
+            unpack_seq(mol->umi, UMI_LEN, seq + BC_LEN);
+            memset(quals, GEN_HIGH_Q, BC_LEN + UMI_LEN);
+            add_errors(seq, quals, BC_LEN, error_rate, n_rate);
+            add_errors(seq + BC_LEN, quals + BC_LEN, UMI_LEN, 0.0, n_rate);
+            gzprintf(fq1, "@bench:%li:%i R1\n%.*s\n+\n%.*s\n", r, l + 1, BC_LEN + UMI_LEN, seq, BC_LEN + UMI_LEN, quals);
+
+            memcpy(r2, tags[mol->tag], TAG_LEN);
+            memset(quals, GEN_HIGH_Q, r2_len);
+            add_errors(r2, quals, TAG_LEN, error_rate, n_rate);
+            gzprintf(fq2, "@bench:%li:%i R2\n%.*s\n+\n%.*s\n", r, l + 1, r2_len, r2, r2_len, quals);
+        }
+        gzclose(fq1);
+        gzclose(fq2);
+    }
+
+    printf("Wrote %li read pairs in %i lanes, %li whitelist barcodes, %li cells, %i tags and %li molecules to %s\n", reads, lanes, wl_size, cells, t_count, n_molecules, outdir);
+    free(molecules);
+    free(whitelist);
+    return 0;
+}
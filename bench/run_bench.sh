@@ -0,0 +1,22 @@
+#!/bin/bash
+# Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+# See LICENSE for code reuse permissions.
+#
+# Builds barcounter and the benchmark programs, generates a synthetic data set and runs the benchmark harness.
+# Run from the repository root. Data and binaries are written to bench_data/ unless BENCH_DIR is set.
+# Usage:
+#     bench/run_bench.sh [threads] [read pairs] [extra gen_citeseq options]
+set -e
+
+threads=${1:-1}
+reads=${2:-2000000}
+shift 2 2>/dev/null || shift $#
+dir=${BENCH_DIR:-bench_data}
+mkdir -p "$dir"
+
+gcc -O2 Bar_Count.c barcodes.c tags.c umis.c chemistry.c pipeline.c fastq.c input.c spill.c collapse.c checkpoint.c state.c batch.c counts.c output.c -lz -lpthread -o "$dir/barcounter"
+gcc -O2 -I. bench/gen_citeseq.c tags.c -lz -o "$dir/gen_citeseq"
+gcc -O2 -I. bench/bench_pipeline.c barcodes.c tags.c umis.c fastq.c input.c counts.c -lz -lpthread -o "$dir/bench_pipeline"
+
+"$dir/gen_citeseq" -o "$dir/data" -r "$reads" "$@"
+"$dir/bench_pipeline" "$dir/data" "$dir/barcounter" "$threads"
@@ -0,0 +1,82 @@
+#!/bin/bash
+# Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+# See LICENSE for code reuse permissions.
+#
+# Builds barcounter with AddressSanitizer, generates a small synthetic data set, and checks that malformed inputs are rejected with their exit codes.
+# Run from the repository root. Data and binaries are written to check_data/ unless CHECK_DIR is set, and CHECK_CFLAGS replaces the sanitizer flags.
+# Usage:
+#     bench/run_checks.sh
+set -e
+
+dir=${CHECK_DIR:-check_data}
+cflags=${CHECK_CFLAGS:--O1 -g -fsanitize=address}
+mkdir -p "$dir"
+
+gcc $cflags Bar_Count.c barcodes.c tags.c umis.c chemistry.c pipeline.c fastq.c input.c spill.c collapse.c checkpoint.c state.c batch.c counts.c output.c -lz -lpthread -o "$dir/barcounter"
+gcc -O2 -I. bench/gen_citeseq.c tags.c -lz -o "$dir/gen_citeseq"
+"$dir/gen_citeseq" -o "$dir/data" -r 200000 -w 20000 -c 2000 -t 20 > /dev/null
+
+failed=0
+
+# run barcounter with the arguments after "expected" and "name" and compare its exit code with "expected"
+expect_exit()
+{
+    local expected=$1
+    local name=$2
+    shift 2
+    set +e
+    "$dir/barcounter" "$@" > "$dir/$name.out" 2>&1
+    local code=$?
+    set -e
+    if [ "$code" -eq "$expected" ]
+    then
+        echo "ok      $name (exit code $code)"
+    else
+        echo "FAILED  $name (exit code $code, expected $expected, see $dir/$name.out)"
+        failed=1
+    fi
+}
+
+wl="$dir/data/whitelist.txt.gz"
+tl="$dir/data/taglist.csv"
+r1="$dir/data/bench_S1_L001_R1_001.fastq.gz"
+r2="$dir/data/bench_S1_L001_R2_001.fastq.gz"
+
+expect_exit 0 complete -w "$wl" -t "$tl" -1 "$r1" -2 "$r2" -o "$dir/out_complete/"
+
+# one fastq file ends halfway through the other. The longer file is plaintext, so several of its blocks are queued when the shorter one ends
+mkdir -p "$dir/short1" "$dir/short2"
+zcat "$r1" | head -n 400000 | gzip > "$dir/short1/short1_S1_L001_R1_001.fastq.gz"
+zcat "$r2" > "$dir/short1/short1_S1_L001_R2_001.fastq"
+zcat "$r1" > "$dir/short2/short2_S1_L001_R1_001.fastq"
+zcat "$r2" | head -n 400000 | gzip > "$dir/short2/short2_S1_L001_R2_001.fastq.gz"
+expect_exit 46 short_read1 -w "$wl" -t "$tl" -1 "$dir/short1/short1_S1_L001_R1_001.fastq.gz" -2 "$dir/short1/short1_S1_L001_R2_001.fastq" -o "$dir/out_short1/"
+expect_exit 46 short_read2 -w "$wl" -t "$tl" -1 "$dir/short2/short2_S1_L001_R1_001.fastq" -2 "$dir/short2/short2_S1_L001_R2_001.fastq.gz" -o "$dir/out_short2/"
+
+# gzip files cut off inside a member, and a plaintext fastq cut off inside a record
+mkdir -p "$dir/cut"
+size=$(stat -c %s "$r1")
+head -c $((size / 2)) "$r1" > "$dir/cut/cut_S1_L001_R1_001.fastq.gz"
+cp "$r2" "$dir/cut/cut_S1_L001_R2_001.fastq.gz"
+expect_exit 29 truncated_gzip -w "$wl" -t "$tl" -1 "$dir/cut/cut_S1_L001_R1_001.fastq.gz" -2 "$dir/cut/cut_S1_L001_R2_001.fastq.gz" -o "$dir/out_cut/"
+zcat "$r1" | head -c 1000002 > "$dir/cut/cutrec_S1_L001_R1_001.fastq"
+zcat "$r2" | head -n $(( $(zcat "$r1" | head -c 1000002 | wc -l) / 4 * 4 )) > "$dir/cut/cutrec_S1_L001_R2_001.fastq"
+expect_exit 29 truncated_record -w "$wl" -t "$tl" -1 "$dir/cut/cutrec_S1_L001_R1_001.fastq" -2 "$dir/cut/cutrec_S1_L001_R2_001.fastq" -o "$dir/out_cutrec/"
+# a quality line in the middle of the file that is shorter than its sequence line
+zcat "$r1" | awk 'NR == 200000 { $0 = substr($0, 1, length($0) - 5) } { print }' > "$dir/cut/shortqual_S1_L001_R1_001.fastq"
+cp "$r2" "$dir/cut/shortqual_S1_L001_R2_001.fastq.gz"
+expect_exit 29 short_quality -w "$wl" -t "$tl" -1 "$dir/cut/shortqual_S1_L001_R1_001.fastq" -2 "$dir/cut/shortqual_S1_L001_R2_001.fastq.gz" -o "$dir/out_shortqual/"
+head -c $(( $(stat -c %s "$wl") / 2 )) "$wl" > "$dir/cut/whitelist.txt.gz"
+expect_exit 21 truncated_whitelist -w "$dir/cut/whitelist.txt.gz" -t "$tl" -1 "$r1" -2 "$r2" -o "$dir/out_cutwl/"
+
+# whitelist index file whose hash shift doesn't match its table size
+"$dir/barcounter" index -w "$wl" -o "$dir/cut/whitelist.bcidx" > /dev/null
+printf '\x00\x00\x00\x00' | dd of="$dir/cut/whitelist.bcidx" bs=1 seek=28 conv=notrunc status=none
+expect_exit 21 corrupt_index -w "$dir/cut/whitelist.bcidx" -t "$tl" -1 "$r1" -2 "$r2" -o "$dir/out_bcidx/"
+
+if [ "$failed" -ne 0 ]
+then
+    echo "Some checks failed"
+    exit 1
+fi
+echo "All checks passed"
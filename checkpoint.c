@@ -0,0 +1,214 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+#include "umis.h"
+
+// set the maximum length of a checkpoint file path
+#define CKPT_PATH_LEN 600
+
+// add the "len" bytes of "data" to the 64 bit FNV-1a hash "h"
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// add the name, size and modification time of fastq file "path" to hash "h"
+static uint64_t hash_input(uint64_t h, const char *path)
+{
+    struct stat st;
+    int64_t size = -1;
+    int64_t mtime = -1;
+    if (stat(path, &st) == 0)
+    {
+        size = (int64_t) st.st_size;
+        mtime = (int64_t) st.st_mtime;
+    }
+    h = hash_bytes(h, path, strlen(path) + 1);
+    h = hash_bytes(h, &size, sizeof(size));
+    return hash_bytes(h, &mtime, sizeof(mtime));
+}
+
+// Returns an identifier of the fastq files of lane job "job"
+static uint64_t checkpoint_input_id(const lane_job* job)
+{
+    uint64_t h = hash_input(0xcbf29ce484222325ULL, job->path1);
+    return (job->path2 != NULL) ? hash_input(h, job->path2) : h;
+}
+
+// Returns an identifier of the run settings that determine the UMI keys of a fastq pair: the whitelist barcodes in "index",
+// the "t_count" tags in "tags", the read geometry "geometry" and whether reads are counted for UMI collapsing ("count_reads").
+uint64_t checkpoint_run_id(const bc_index* index, char tags[MAX_TAGS][TAG_LEN + 1], int t_count, const read_geometry* geometry, bool count_reads)
+{
+    int32_t settings[7] = {geometry->bc_first, geometry->umi_first, geometry->umi_len, geometry->tag_first, geometry->tag_window, count_reads, t_count};
+    uint64_t h = 0xcbf29ce484222325ULL;
+    h = hash_bytes(h, &index->n_barcodes, sizeof(index->n_barcodes));
+    h = hash_bytes(h, index->codes, (size_t) index->n_barcodes * sizeof(uint32_t));
+    for (int t = 0; t < t_count; t++)
+    {
+        h = hash_bytes(h, tags[t], TAG_LEN);
+    }
+    return hash_bytes(h, settings, sizeof(settings));
+}
+
+// Write the UMI set and statistics of the completed lane job "job" to the checkpoint file "path". The file is written under a temporary name
+// and renamed when complete, so an interrupted write never leaves a partial checkpoint. Returns true if successful, else returns false.
+bool write_checkpoint(const char *path, const lane_job* job, uint64_t run_id)
+{
+    char temp_path[CKPT_PATH_LEN];
+    const umi_set* set = &job->umis;
+    ckpt_header header;
+    size_t n = 0;
+    bool success;
+
+    snprintf(temp_path, CKPT_PATH_LEN, "%s.tmp", path);
+    FILE *fp = fopen(temp_path, "wb");
+    uint64_t *keys = malloc(CKPT_CHUNK * sizeof(uint64_t));
+    uint32_t *reads = malloc(CKPT_CHUNK * sizeof(uint32_t));
+    if (fp == NULL || keys == NULL || reads == NULL)
+    {
+        if (fp != NULL)
+        {
+            fclose(fp);
+            remove(temp_path);
+        }
+        free(keys);
+        free(reads);
+        return false;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CKPT_MAGIC, sizeof(header.magic));
+    header.version = CKPT_VERSION;
+    header.endian = 0x01020304;
+    header.run_id = run_id;
+    header.input_id = checkpoint_input_id(job);
+    header.n_keys = set->n_keys;
+    header.has_reads = (set->reads != NULL);
+    header.stats[0] = job->stats.total_reads;
+    header.stats[1] = job->stats.valid_barcodes;
+    header.stats[2] = job->stats.corrected_barcodes;
+    header.stats[3] = job->stats.valid_tags;
+    header.stats[4] = job->stats.ambiguous_barcodes;
+    header.stats[5] = job->stats.shifted_tags;
+    success = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    // write every key, then the read count of every key in the same order
+    for (uint64_t s = 0; s <= set->mask && success; s++)
+    {
+        if (set->keys[s] != 0)
+        {
+            keys[n++] = set->keys[s];
+        }
+        if (n == CKPT_CHUNK || (s == set->mask && n > 0))
+        {
+            success = fwrite(keys, sizeof(uint64_t), n, fp) == n;
+            n = 0;
+        }
+    }
+    for (uint64_t s = 0; s <= set->mask && success && set->reads != NULL; s++)
+    {
+        if (set->keys[s] != 0)
+        {
+            reads[n++] = set->reads[s];
+        }
+        if (n == CKPT_CHUNK || (s == set->mask && n > 0))
+        {
+            success = fwrite(reads, sizeof(uint32_t), n, fp) == n;
+            n = 0;
+        }
+    }
+    free(keys);
+    free(reads);
+
+    // the checkpoint must be on disk before it replaces an older one
+    success = success && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    success = (fclose(fp) == 0) && success;
+    if (!success || rename(temp_path, path) != 0)
+    {
+        remove(temp_path);
+        return false;
+    }
+    return true;
+}
+
+// Load the UMI set and statistics of lane job "job" from the checkpoint file "path" and mark the job as resumed. Returns false, leaving "job" unchanged,
+// if the file doesn't exist, is incomplete, or was written by a run with a different "run_id" or for different fastq files.
+bool read_checkpoint(const char *path, lane_job* job, uint64_t run_id)
+{
+    ckpt_header header;
+    struct stat st;
+    umi_set set;
+    bool success;
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return false;
+    }
+    success = fread(&header, sizeof(header), 1, fp) == 1 && memcmp(header.magic, CKPT_MAGIC, sizeof(header.magic)) == 0
+        && header.version == CKPT_VERSION && header.endian == 0x01020304 && header.run_id == run_id
+        && header.input_id == checkpoint_input_id(job) && (header.has_reads != 0) == (job->umis.reads != NULL);
+    // the file must hold exactly the keys and read counts given in the header
+    size_t entry_size = sizeof(uint64_t) + (header.has_reads ? sizeof(uint32_t) : 0);
+    success = success && fstat(fileno(fp), &st) == 0 && (uint64_t) st.st_size == sizeof(header) + header.n_keys * entry_size;
+    if (!success || !init_umi_set(&set, header.has_reads != 0))
+    {
+        fclose(fp);
+        return false;
+    }
+
+    // read the keys and their read counts side by side through a second stream opened at the read counts
+    FILE *fp_reads = header.has_reads ? fopen(path, "rb") : NULL;
+    uint64_t *keys = malloc(CKPT_CHUNK * sizeof(uint64_t));
+    uint32_t *reads = malloc(CKPT_CHUNK * sizeof(uint32_t));
+    success = keys != NULL && reads != NULL && (!header.has_reads || (fp_reads != NULL && fseek(fp_reads, (long) (sizeof(header) + header.n_keys * sizeof(uint64_t)), SEEK_SET) == 0));
+    for (uint64_t done = 0; done < header.n_keys && success; )
+    {
+        size_t n = (header.n_keys - done < CKPT_CHUNK) ? (size_t) (header.n_keys - done) : CKPT_CHUNK;
+        success = fread(keys, sizeof(uint64_t), n, fp) == n && (!header.has_reads || fread(reads, sizeof(uint32_t), n, fp_reads) == n);
+        for (size_t k = 0; k < n && success; k++)
+        {
+            add_umi_reads(&set, keys[k], header.has_reads ? reads[k] : 1);
+        }
+        done += n;
+    }
+    free(keys);
+    free(reads);
+    fclose(fp);
+    if (fp_reads != NULL)
+    {
+        fclose(fp_reads);
+    }
+    if (!success)
+    {
+        unload_umi_set(&set);
+        return false;
+    }
+
+    unload_umi_set(&job->umis);
+    job->umis = set;
+    job->stats.total_reads = header.stats[0];
+    job->stats.valid_barcodes = header.stats[1];
+    job->stats.corrected_barcodes = header.stats[2];
+    job->stats.valid_tags = header.stats[3];
+    job->stats.ambiguous_barcodes = header.stats[4];
+    job->stats.shifted_tags = header.stats[5];
+    job->resumed = true;
+    return true;
+}
@@ -0,0 +1,54 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "barcodes.h"
+#include "tags.h"
+#include "chemistry.h"
+#include "pipeline.h"
+
+// set the file extension of checkpoint files
+#define CKPT_EXT ".ckpt"
+
+// set the magic bytes and format version at the start of a checkpoint file
+#define CKPT_MAGIC "BCCKPT\0\0"
+#define CKPT_VERSION 1
+
+// set the number of keys written or read at once
+#define CKPT_CHUNK 65536
+
+// define ckpt_header struct for the start of a checkpoint file. The header is followed by "n_keys" UMI keys and, if "has_reads" is set, the read count of each key.
+// "run_id" identifies the whitelist, taglist, read geometry and UMI collapsing of the run and "input_id" the fastq pair, so a checkpoint is only
+// resumed by a run that would have produced it. "stats" holds the summary statistics of the pair in count_stats order.
+typedef struct ckpt_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint64_t run_id;
+    uint64_t input_id;
+    uint64_t n_keys;
+    uint32_t has_reads;
+    uint32_t reserved;
+    uint64_t stats[6];
+} ckpt_header;
+
+// Returns an identifier of the run settings that determine the UMI keys of a fastq pair: the whitelist barcodes in "index",
+// the "t_count" tags in "tags", the read geometry "geometry" and whether reads are counted for UMI collapsing ("count_reads").
+uint64_t checkpoint_run_id(const bc_index* index, char tags[MAX_TAGS][TAG_LEN + 1], int t_count, const read_geometry* geometry, bool count_reads);
+
+// Write the UMI set and statistics of the completed lane job "job" to the checkpoint file "path". The file is written under a temporary name
+// and renamed when complete, so an interrupted write never leaves a partial checkpoint. Returns true if successful, else returns false.
+bool write_checkpoint(const char *path, const lane_job* job, uint64_t run_id);
+
+// Load the UMI set and statistics of lane job "job" from the checkpoint file "path" and mark the job as resumed. Returns false, leaving "job" unchanged,
+// if the file doesn't exist, is incomplete, or was written by a run with a different "run_id" or for different fastq files.
+bool read_checkpoint(const char *path, lane_job* job, uint64_t run_id);
+
+#endif // CHECKPOINT_H
@@ -0,0 +1,39 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "chemistry.h"
+
+// chemistry presets: name, barcode offset, UMI offset, UMI length, tag offset and tag window (tags are only looked up at their offset).
+// 10X 3' v3 and v2 read the tag from the start of read2; TotalSeq-B (3' v3) and TotalSeq-C (5', 10 base UMI) tags start at base 11 of read2.
+static const read_geometry chemistries[] = {
+    {"10xv3", BC_FIRST, UMI_FIRST, UMI_LEN, TAG_FIRST, 0},
+    {"10xv2", 0, 16, 10, 0, 0},
+    {"totalseq-b", 0, 16, 12, 10, 0},
+    {"totalseq-c", 0, 16, 10, 10, 0}
+};
+
+// Set "geometry" to the chemistry preset "name" (10xv3, 10xv2, totalseq-b or totalseq-c). Returns true if successful, false if "name" is not a preset.
+bool find_chemistry(const char *name, read_geometry* geometry)
+{
+    for (size_t c = 0; c < sizeof(chemistries) / sizeof(chemistries[0]); c++)
+    {
+        if (strcmp(name, chemistries[c].name) == 0)
+        {
+            *geometry = chemistries[c];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns true if every offset and the tag window of "geometry" are non negative and its UMI length is between 1 and UMI_MAX_LEN.
+bool check_geometry(const read_geometry* geometry)
+{
+    return geometry->bc_first >= 0 && geometry->umi_first >= 0 && geometry->tag_first >= 0 && geometry->tag_window >= 0
+        && geometry->umi_len >= 1 && geometry->umi_len <= UMI_MAX_LEN;
+}
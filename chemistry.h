@@ -0,0 +1,52 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#ifndef CHEMISTRY_H
+#define CHEMISTRY_H
+
+#include <stdbool.h>
+
+#include "barcodes.h"
+#include "tags.h"
+#include "umis.h"
+
+// set the default chemistry preset
+#define DEFAULT_CHEMISTRY "10xv3"
+
+// define read_geometry struct for the positions of the barcode, UMI and tag in a read pair.
+// Barcode and tag lengths are fixed at BC_LEN and TAG_LEN because the whitelist index, whitelist index files and tag index are built for them;
+// the offsets and the UMI length (at most UMI_MAX_LEN) are chosen at runtime.
+// If "tag_window" is greater than 0, tags are searched for up to "tag_window" bases before or after "tag_first" (see find_tag_index).
+typedef struct read_geometry {
+    const char *name;
+    int bc_first;
+    int umi_first;
+    int umi_len;
+    int tag_first;
+    int tag_window;
+} read_geometry;
+
+// Set "geometry" to the chemistry preset "name" (10xv3, 10xv2, totalseq-b or totalseq-c). Returns true if successful, false if "name" is not a preset.
+bool find_chemistry(const char *name, read_geometry* geometry);
+
+// Returns true if every offset and the tag window of "geometry" are non negative and its UMI length is between 1 and UMI_MAX_LEN.
+bool check_geometry(const read_geometry* geometry);
+
+// Returns the shortest read1 sequence that holds the barcode and UMI of "geometry".
+static inline int geometry_r1_len(const read_geometry* geometry)
+{
+    int bc_end = geometry->bc_first + BC_LEN;
+    int umi_end = geometry->umi_first + geometry->umi_len;
+    return bc_end > umi_end ? bc_end : umi_end;
+}
+
+// Returns the shortest read2 sequence that can hold the tag of "geometry", at the start of its tag window.
+static inline int geometry_r2_len(const read_geometry* geometry)
+{
+    int tag_start = geometry->tag_first - geometry->tag_window;
+    return (tag_start > 0 ? tag_start : 0) + TAG_LEN;
+}
+
+#endif // CHEMISTRY_H
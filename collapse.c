@@ -0,0 +1,358 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "collapse.h"
+#include "umis.h"
+#include "spill.h"
+#include "counts.h"
+
+// set the largest UMI group whose neighbors are found by comparing every pair of UMIs instead of looking up each substitution
+#define COLLAPSE_SCAN_MAX 32
+
+// define collapse_job struct for the sorted UMI keys "keys" from "start" to "end" collapsed by one thread. The range starts and ends on barcode boundaries.
+// The number of molecules of each barcode/tag combination is written to "molecules" at the position of its first key.
+typedef struct collapse_job {
+    const umi_set* set;
+    const uint64_t *keys;
+    uint32_t *molecules;
+    size_t start;
+    size_t end;
+    int umi_len;
+    bool success;
+} collapse_job;
+
+// Initialize an empty UMI group. Returns true if successful, else returns false.
+bool init_umi_group(umi_group* group)
+{
+    group->umis = malloc(UMI_GROUP_INIT * sizeof(uint32_t));
+    group->reads = malloc(UMI_GROUP_INIT * sizeof(uint32_t));
+    group->order = malloc(UMI_GROUP_INIT * sizeof(uint64_t));
+    group->stack = malloc(UMI_GROUP_INIT * sizeof(uint32_t));
+    group->visited = malloc(UMI_GROUP_INIT);
+    group->n = 0;
+    group->max = UMI_GROUP_INIT;
+    return group->umis != NULL && group->reads != NULL && group->order != NULL && group->stack != NULL && group->visited != NULL;
+}
+
+// double the room of every array of the group. Returns true if successful, else returns false.
+static bool grow_umi_group(umi_group* group)
+{
+    uint32_t max = group->max * 2;
+    uint32_t *umis = realloc(group->umis, max * sizeof(uint32_t));
+    if (umis != NULL)
+    {
+        group->umis = umis;
+    }
+    uint32_t *reads = realloc(group->reads, max * sizeof(uint32_t));
+    if (reads != NULL)
+    {
+        group->reads = reads;
+    }
+    uint64_t *order = realloc(group->order, max * sizeof(uint64_t));
+    if (order != NULL)
+    {
+        group->order = order;
+    }
+    uint32_t *stack = realloc(group->stack, max * sizeof(uint32_t));
+    if (stack != NULL)
+    {
+        group->stack = stack;
+    }
+    uint8_t *visited = realloc(group->visited, max);
+    if (visited != NULL)
+    {
+        group->visited = visited;
+    }
+    if (umis == NULL || reads == NULL || order == NULL || stack == NULL || visited == NULL)
+    {
+        return false;
+    }
+    group->max = max;
+    return true;
+}
+
+// Append packed UMI "umi" with "reads" reads to the group. UMIs must be appended in ascending order. Returns true if successful, else returns false.
+bool add_group_umi(umi_group* group, uint32_t umi, uint32_t reads)
+{
+    if (group->n == group->max && !grow_umi_group(group))
+    {
+        return false;
+    }
+    group->umis[group->n] = umi;
+    group->reads[group->n] = reads;
+    group->n++;
+    return true;
+}
+
+// compare two visiting order entries for qsort
+static int compare_order(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Returns the position of packed UMI "umi" in the "n" ascending UMIs "umis", or -1 if it is not present
+static inline int64_t find_group_umi(const uint32_t *umis, uint32_t n, uint32_t umi)
+{
+    uint32_t lo = 0;
+    uint32_t hi = n;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (umis[mid] < umi)
+        {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo < n && umis[lo] == umi) ? (int64_t) lo : -1;
+}
+
+// Returns true if packed UMIs "a" and "b" differ at exactly one base
+static inline bool one_substitution(uint32_t a, uint32_t b)
+{
+    uint32_t x = a ^ b;
+    x = (x | (x >> 1)) & 0x55555555u;
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+// absorb UMI "v" of the group into the molecule being built if it hasn't been absorbed yet and has at most half (plus one) of the reads of UMI "u"
+static inline void absorb_umi(umi_group* group, uint32_t u, uint32_t v, uint32_t *depth)
+{
+    if (!group->visited[v] && 2 * (uint64_t) group->reads[v] <= (uint64_t) group->reads[u] + 1)
+    {
+        group->visited[v] = 1;
+        group->stack[(*depth)++] = v;
+    }
+}
+
+// Collapse the UMIs of length "umi_len" in the group with directional adjacency and empty the group. Returns the number of molecules.
+// A UMI absorbs every UMI one substitution away that has at most half (plus one) of its reads, and the absorbed UMIs absorb their own neighbors in turn.
+// Starting from the UMI with the most reads, every UMI not absorbed by an earlier one starts a new molecule.
+uint32_t collapse_umi_group(umi_group* group, int umi_len)
+{
+    uint32_t n = group->n;
+    uint32_t molecules = 0;
+    group->n = 0;
+    if (n <= 1)
+    {
+        return n;
+    }
+
+    // visit UMIs by descending read count, ties in ascending UMI order
+    for (uint32_t i = 0; i < n; i++)
+    {
+        group->order[i] = ((uint64_t) (UINT32_MAX - group->reads[i]) << 32) | i;
+    }
+    qsort(group->order, n, sizeof(uint64_t), compare_order);
+    memset(group->visited, 0, n);
+
+    for (uint32_t o = 0; o < n; o++)
+    {
+        uint32_t root = (uint32_t) group->order[o];
+        if (group->visited[root])
+        {
+            continue;
+        }
+        molecules++;
+        group->visited[root] = 1;
+        uint32_t depth = 0;
+        group->stack[depth++] = root;
+        while (depth > 0)
+        {
+            uint32_t u = group->stack[--depth];
+            if (n <= COLLAPSE_SCAN_MAX)
+            {
+                // small groups compare every pair of packed UMIs
+                for (uint32_t v = 0; v < n; v++)
+                {
+                    if (one_substitution(group->umis[u], group->umis[v]))
+                    {
+                        absorb_umi(group, u, v, &depth);
+                    }
+                }
+            } else {
+                // large groups look up the 3 substitutions at every base of the packed UMI
+                for (int p = 0; p < umi_len; p++)
+                {
+                    for (uint32_t d = 1; d <= 3; d++)
+                    {
+                        int64_t v = find_group_umi(group->umis, n, group->umis[u] ^ (d << (2 * p)));
+                        if (v >= 0)
+                        {
+                            absorb_umi(group, u, (uint32_t) v, &depth);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return molecules;
+}
+
+// Unloads the UMI group from memory.
+void free_umi_group(umi_group* group)
+{
+    free(group->umis);
+    free(group->reads);
+    free(group->order);
+    free(group->stack);
+    free(group->visited);
+    group->umis = NULL;
+    group->reads = NULL;
+    group->order = NULL;
+    group->stack = NULL;
+    group->visited = NULL;
+    group->n = 0;
+    group->max = 0;
+}
+
+// collapse thread: collapse every barcode/tag combination in the key range of a collapse job
+static void* collapse_thread(void* arg)
+{
+    collapse_job* job = arg;
+    const uint64_t *keys = job->keys;
+    umi_group group;
+    size_t k = job->start;
+
+    job->success = init_umi_group(&group);
+    while (job->success && k < job->end)
+    {
+        size_t first = k;
+        // a combination with a single UMI is a single molecule, its reads don't matter
+        if (k + 1 == job->end || !umi_key_same_group(keys[k], keys[k + 1]))
+        {
+            job->molecules[first] = 1;
+            k++;
+            continue;
+        }
+        while (k < job->end && umi_key_same_group(keys[first], keys[k]))
+        {
+            if (!add_group_umi(&group, umi_key_umi(keys[k]), get_umi_reads(job->set, keys[k])))
+            {
+                job->success = false;
+                break;
+            }
+            k++;
+        }
+        job->molecules[first] = collapse_umi_group(&group, job->umi_len);
+    }
+    free_umi_group(&group);
+    return NULL;
+}
+
+// Collapse the UMIs of length "umi_len" of every barcode/tag combination in UMI set "set", which must count reads, and add one tag count in "counts"
+// for every molecule. Barcodes are divided between "threads" threads. Sets "collapsed" to the number of UMIs absorbed into another UMI.
+// Returns true if successful, else returns false.
+bool collapse_umi_set(const umi_set* set, int umi_len, count_matrix* counts, int threads, unsigned long long int *collapsed)
+{
+    size_t n = set->n_keys;
+    bool success = true;
+    size_t k = 0;
+
+    *collapsed = 0;
+    if (n == 0)
+    {
+        return true;
+    }
+
+    // sort the keys so the UMIs of each barcode/tag combination are adjacent and ascending
+    uint64_t *keys = malloc(n * sizeof(uint64_t));
+    uint64_t *scratch = malloc(n * sizeof(uint64_t));
+    uint32_t *molecules = calloc(n, sizeof(uint32_t));
+    collapse_job* jobs = malloc(sizeof(collapse_job) * threads);
+    pthread_t* tids = malloc(sizeof(pthread_t) * threads);
+    bool *started = calloc(threads, sizeof(bool));
+    if (keys == NULL || scratch == NULL || molecules == NULL || jobs == NULL || tids == NULL || started == NULL)
+    {
+        free(keys);
+        free(scratch);
+        free(molecules);
+        free(jobs);
+        free(tids);
+        free(started);
+        return false;
+    }
+    for (uint64_t s = 0; s <= set->mask; s++)
+    {
+        if (set->keys[s] != 0)
+        {
+            keys[k++] = set->keys[s];
+        }
+    }
+    radix_sort_keys(keys, scratch, n);
+    free(scratch);
+
+    // divide the keys into equal ranges, each extended to the end of its last barcode
+    size_t start = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        size_t end = (t == threads - 1) ? n : n * (t + 1) / threads;
+        if (end < start)
+        {
+            end = start;
+        }
+        while (end < n && end > 0 && umi_key_bc(keys[end]) == umi_key_bc(keys[end - 1]))
+        {
+            end++;
+        }
+        jobs[t].set = set;
+        jobs[t].keys = keys;
+        jobs[t].molecules = molecules;
+        jobs[t].start = start;
+        jobs[t].end = end;
+        jobs[t].umi_len = umi_len;
+        jobs[t].success = true;
+        start = end;
+    }
+
+    // the first range is collapsed on this thread, as is any range whose thread could not be created
+    for (int t = 1; t < threads; t++)
+    {
+        started[t] = jobs[t].start < jobs[t].end && pthread_create(&tids[t], NULL, collapse_thread, &jobs[t]) == 0;
+    }
+    collapse_thread(&jobs[0]);
+    for (int t = 1; t < threads; t++)
+    {
+        if (started[t])
+        {
+            pthread_join(tids[t], NULL);
+        } else {
+            collapse_thread(&jobs[t]);
+        }
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        success &= jobs[t].success;
+    }
+
+    // credit one tag count per molecule
+    unsigned long long int total = 0;
+    for (k = 0; k < n && success; k++)
+    {
+        for (uint32_t m = 0; m < molecules[k]; m++)
+        {
+            add_count(counts, umi_key_bc(keys[k]), umi_key_tag(keys[k]));
+        }
+        total += molecules[k];
+    }
+    *collapsed = n - total;
+
+    free(keys);
+    free(molecules);
+    free(jobs);
+    free(tids);
+    free(started);
+    return success;
+}
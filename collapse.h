@@ -0,0 +1,49 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#ifndef COLLAPSE_H
+#define COLLAPSE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "umis.h"
+#include "counts.h"
+
+// set the initial number of UMIs a UMI group has room for
+#define UMI_GROUP_INIT 256
+
+// define umi_group struct for the UMIs of one barcode/tag combination: "umis" holds the "n" packed UMIs in ascending order and "reads" the read count of each.
+// "order", "stack" and "visited" are scratch space for collapsing. Every array has room for "max" UMIs.
+typedef struct umi_group {
+    uint32_t *umis;
+    uint32_t *reads;
+    uint64_t *order;
+    uint32_t *stack;
+    uint8_t *visited;
+    uint32_t n;
+    uint32_t max;
+} umi_group;
+
+// Initialize an empty UMI group. Returns true if successful, else returns false.
+bool init_umi_group(umi_group* group);
+
+// Append packed UMI "umi" with "reads" reads to the group. UMIs must be appended in ascending order. Returns true if successful, else returns false.
+bool add_group_umi(umi_group* group, uint32_t umi, uint32_t reads);
+
+// Collapse the UMIs of length "umi_len" in the group with directional adjacency and empty the group. Returns the number of molecules.
+// A UMI absorbs every UMI one substitution away that has at most half (plus one) of its reads, and the absorbed UMIs absorb their own neighbors in turn.
+// Starting from the UMI with the most reads, every UMI not absorbed by an earlier one starts a new molecule.
+uint32_t collapse_umi_group(umi_group* group, int umi_len);
+
+// Unloads the UMI group from memory.
+void free_umi_group(umi_group* group);
+
+// Collapse the UMIs of length "umi_len" of every barcode/tag combination in UMI set "set", which must count reads, and add one tag count in "counts"
+// for every molecule. Barcodes are divided between "threads" threads. Sets "collapsed" to the number of UMIs absorbed into another UMI.
+// Returns true if successful, else returns false.
+bool collapse_umi_set(const umi_set* set, int umi_len, count_matrix* counts, int threads, unsigned long long int *collapsed);
+
+#endif // COLLAPSE_H
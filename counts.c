@@ -0,0 +1,176 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "counts.h"
+
+// exit the program when the count matrix cannot grow
+static void count_alloc_failed(void)
+{
+    printf("Failed to allocate memory for tag counts. Exiting...\n");
+    exit(30);
+}
+
+// double the number of rows the slab can hold, zeroing the new rows
+static void grow_rows(count_matrix* m)
+{
+    uint32_t max_rows = m->max_rows * 2;
+    size_t old_len = (size_t) m->max_rows * m->t_count;
+    size_t new_len = (size_t) max_rows * m->t_count;
+
+    if (m->wide != NULL)
+    {
+        uint32_t *wide = realloc(m->wide, new_len * sizeof(uint32_t));
+        if (wide == NULL)
+        {
+            count_alloc_failed();
+        }
+        memset(wide + old_len, 0, (new_len - old_len) * sizeof(uint32_t));
+        m->wide = wide;
+    } else {
+        uint16_t *narrow = realloc(m->narrow, new_len * sizeof(uint16_t));
+        if (narrow == NULL)
+        {
+            count_alloc_failed();
+        }
+        memset(narrow + old_len, 0, (new_len - old_len) * sizeof(uint16_t));
+        m->narrow = narrow;
+    }
+    unsigned long int *totals = realloc(m->totals, max_rows * sizeof(unsigned long int));
+    if (totals == NULL)
+    {
+        count_alloc_failed();
+    }
+    memset(totals + m->max_rows, 0, (max_rows - m->max_rows) * sizeof(unsigned long int));
+    m->totals = totals;
+    uint32_t *ids = realloc(m->ids, max_rows * sizeof(uint32_t));
+    if (ids == NULL)
+    {
+        count_alloc_failed();
+    }
+    m->ids = ids;
+    m->max_rows = max_rows;
+}
+
+// copy the 16 bit slab into a 32 bit slab once a counter is about to overflow
+static void promote_counts(count_matrix* m)
+{
+    size_t len = (size_t) m->max_rows * m->t_count;
+    m->wide = malloc(len * sizeof(uint32_t));
+    if (m->wide == NULL)
+    {
+        count_alloc_failed();
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        m->wide[i] = m->narrow[i];
+    }
+    free(m->narrow);
+    m->narrow = NULL;
+}
+
+// Initialize an empty count matrix for "n_barcodes" barcodes and "t_count" tags. Returns true if successful, else returns false.
+bool init_count_matrix(count_matrix* m, uint32_t n_barcodes, int t_count)
+{
+    m->n_barcodes = n_barcodes;
+    m->t_count = t_count;
+    m->n_rows = 0;
+    m->max_rows = COUNT_INIT_ROWS;
+    m->rows = calloc(n_barcodes, sizeof(uint32_t));
+    m->narrow = calloc((size_t) m->max_rows * t_count, sizeof(uint16_t));
+    m->wide = NULL;
+    m->totals = calloc(m->max_rows, sizeof(unsigned long int));
+    m->ids = malloc(m->max_rows * sizeof(uint32_t));
+    return m->rows != NULL && m->narrow != NULL && m->totals != NULL && m->ids != NULL;
+}
+
+// Add one count for tag index "t_index" to barcode ID "bc_id", allocating the barcode's row if needed. Exits the program if memory cannot be allocated.
+void add_count(count_matrix* m, uint32_t bc_id, int t_index)
+{
+    uint32_t row = m->rows[bc_id];
+    if (row == 0)
+    {
+        if (m->n_rows == m->max_rows)
+        {
+            grow_rows(m);
+        }
+        m->ids[m->n_rows] = bc_id;
+        row = ++m->n_rows;
+        m->rows[bc_id] = row;
+    }
+    size_t i = (size_t) (row - 1) * m->t_count + t_index;
+    if (m->wide == NULL)
+    {
+        if (m->narrow[i] != UINT16_MAX)
+        {
+            m->narrow[i]++;
+            m->totals[row - 1]++;
+            return;
+        }
+        promote_counts(m);
+    }
+    m->wide[i]++;
+    m->totals[row - 1]++;
+}
+
+// Returns the total count of barcode ID "bc_id", 0 if the barcode has no counts.
+unsigned long int get_total(const count_matrix* m, uint32_t bc_id)
+{
+    uint32_t row = m->rows[bc_id];
+    return (row == 0) ? 0 : m->totals[row - 1];
+}
+
+// Returns the count of tag index "t_index" for barcode ID "bc_id".
+unsigned int get_count(const count_matrix* m, uint32_t bc_id, int t_index)
+{
+    uint32_t row = m->rows[bc_id];
+    if (row == 0)
+    {
+        return 0;
+    }
+    size_t i = (size_t) (row - 1) * m->t_count + t_index;
+    return (m->wide != NULL) ? m->wide[i] : m->narrow[i];
+}
+
+// compare two barcode IDs for qsort
+static int compare_ids(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Returns a newly allocated array of the n_rows barcode IDs that have counts, in whitelist order. Returns NULL if memory cannot be allocated.
+uint32_t* sorted_count_ids(const count_matrix* m)
+{
+    uint32_t *ids = malloc(sizeof(uint32_t) * (m->n_rows + 1));
+    if (ids == NULL)
+    {
+        return NULL;
+    }
+    memcpy(ids, m->ids, sizeof(uint32_t) * m->n_rows);
+    qsort(ids, m->n_rows, sizeof(uint32_t), compare_ids);
+    return ids;
+}
+
+// Unloads the count matrix from memory.
+void free_count_matrix(count_matrix* m)
+{
+    free(m->rows);
+    free(m->ids);
+    m->ids = NULL;
+    free(m->narrow);
+    free(m->wide);
+    free(m->totals);
+    m->rows = NULL;
+    m->narrow = NULL;
+    m->wide = NULL;
+    m->totals = NULL;
+}
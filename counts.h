@@ -0,0 +1,49 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#ifndef COUNTS_H
+#define COUNTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// set the initial number of barcode rows in the count slab
+#define COUNT_INIT_ROWS 1024
+
+// define count_matrix struct for the barcode x tag count matrix. A barcode's row of "t_count" counters is only allocated when it is first counted.
+// "rows" maps each dense barcode ID to its row number + 1 (0 if the barcode has no counts). Rows are stored row-major in one contiguous slab,
+// "narrow" with 16 bit counters until a counter would overflow, after which the whole slab is promoted to 32 bit counters in "wide".
+// "totals" holds the total count of each row and "ids" the barcode ID of each row.
+typedef struct count_matrix {
+    uint32_t *rows;
+    uint32_t *ids;
+    uint32_t n_barcodes;
+    int t_count;
+    uint32_t n_rows;
+    uint32_t max_rows;
+    uint16_t *narrow;
+    uint32_t *wide;
+    unsigned long int *totals;
+} count_matrix;
+
+// Initialize an empty count matrix for "n_barcodes" barcodes and "t_count" tags. Returns true if successful, else returns false.
+bool init_count_matrix(count_matrix* m, uint32_t n_barcodes, int t_count);
+
+// Add one count for tag index "t_index" to barcode ID "bc_id", allocating the barcode's row if needed. Exits the program if memory cannot be allocated.
+void add_count(count_matrix* m, uint32_t bc_id, int t_index);
+
+// Returns the total count of barcode ID "bc_id", 0 if the barcode has no counts.
+unsigned long int get_total(const count_matrix* m, uint32_t bc_id);
+
+// Returns the count of tag index "t_index" for barcode ID "bc_id".
+unsigned int get_count(const count_matrix* m, uint32_t bc_id, int t_index);
+
+// Returns a newly allocated array of the n_rows barcode IDs that have counts, in whitelist order. Returns NULL if memory cannot be allocated.
+uint32_t* sorted_count_ids(const count_matrix* m);
+
+// Unloads the count matrix from memory.
+void free_count_matrix(count_matrix* m);
+
+#endif // COUNTS_H
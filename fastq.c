@@ -0,0 +1,535 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "fastq.h"
+#include "input.h"
+
+// allocate a block with room for "size" bytes of fastq text
+static fq_block* new_block(size_t size)
+{
+    fq_block* block = malloc(sizeof(fq_block));
+    if (block == NULL)
+    {
+        return NULL;
+    }
+    block->data = malloc(size + FQ_BLOCK_PAD);
+    if (block->data == NULL)
+    {
+        free(block);
+        return NULL;
+    }
+    block->size = size;
+    block->len = 0;
+    block->refs = 0;
+    block->next = NULL;
+    return block;
+}
+
+// free a single block
+static void free_block(fq_block* block)
+{
+    free(block->data);
+    free(block);
+}
+
+// free a linked list of blocks
+static void free_blocks(fq_block* block)
+{
+    fq_block* temp = NULL;
+    while (block != NULL)
+    {
+        temp = block->next;
+        free_block(block);
+        block = temp;
+    }
+}
+
+// grow a block so it can hold at least "size" bytes. Returns true if successful, else returns false.
+static bool grow_block(fq_block* block, size_t size)
+{
+    if (block->size >= size)
+    {
+        return true;
+    }
+    char *data = realloc(block->data, size + FQ_BLOCK_PAD);
+    if (data == NULL)
+    {
+        return false;
+    }
+    block->data = data;
+    block->size = size;
+    return true;
+}
+
+// wait for a free block to refill. Returns NULL if the reader is being closed.
+static fq_block* take_free_block(fq_reader* r)
+{
+    fq_block* block = NULL;
+    pthread_mutex_lock(&r->lock);
+    while (r->free == NULL && !r->stop)
+    {
+        pthread_cond_wait(&r->ready, &r->lock);
+    }
+    if (!r->stop)
+    {
+        block = r->free;
+        r->free = block->next;
+        block->next = NULL;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return block;
+}
+
+// pass a block of complete records to the parser
+static void push_full_block(fq_reader* r, fq_block* block)
+{
+    block->next = NULL;
+    pthread_mutex_lock(&r->lock);
+    if (r->full_tail == NULL)
+    {
+        r->full = block;
+    } else {
+        r->full_tail->next = block;
+    }
+    r->full_tail = block;
+    pthread_cond_broadcast(&r->ready);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// return a block to the decompressor thread's free list. Called with the lock held.
+static void free_block_locked(fq_reader* r, fq_block* block)
+{
+    block->refs = 0;
+    block->next = r->free;
+    r->free = block;
+    pthread_cond_broadcast(&r->ready);
+}
+
+// return an unused block to the decompressor thread
+static void release_block(fq_reader* r, fq_block* block)
+{
+    pthread_mutex_lock(&r->lock);
+    free_block_locked(r, block);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Returns a pointer to the first newline in "p" before "end", or "end" if there is none.
+// Scans 32 bytes at a time with AVX2 or 16 bytes at a time with SSE2 when the compiler targets them, then finishes byte by byte.
+static inline const char* find_newline(const char *p, const char *end)
+{
+#if defined(__AVX2__)
+    const __m256i nl32 = _mm256_set1_epi8('\n');
+    while (end - p >= 32)
+    {
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) p), nl32));
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i nl16 = _mm_set1_epi8('\n');
+    while (end - p >= 16)
+    {
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) p), nl16));
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && *p != '\n')
+    {
+        p++;
+    }
+    return p;
+}
+
+// Returns the number of newlines in the "len" bytes of "data".
+static size_t count_newlines(const char *data, size_t len)
+{
+    const char *p = data;
+    const char *end = data + len;
+    size_t n = 0;
+#if defined(__AVX2__)
+    const __m256i nl32 = _mm256_set1_epi8('\n');
+    while (end - p >= 32)
+    {
+        n += __builtin_popcount((unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) p), nl32)));
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i nl16 = _mm_set1_epi8('\n');
+    while (end - p >= 16)
+    {
+        n += __builtin_popcount((unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) p), nl16)));
+        p += 16;
+    }
+#endif
+    while (p < end)
+    {
+        n += (*p++ == '\n');
+    }
+    return n;
+}
+
+// Returns the number of bytes in "data" up to and including the newline that ends the last complete record of "record_lines" lines.
+// Counts every newline in the block, then steps back over the lines of the trailing partial record.
+static size_t last_record_end(const char *data, size_t len, int record_lines)
+{
+    size_t lines = count_newlines(data, len);
+    size_t partial = lines % record_lines;
+    if (lines < (size_t) record_lines)
+    {
+        return 0;
+    }
+    // the partial record holds "partial" complete lines plus any unterminated text after the last newline
+    size_t end = len;
+    while (true)
+    {
+        end--;
+        if (data[end] == '\n')
+        {
+            if (partial == 0)
+            {
+                return end + 1;
+            }
+            partial--;
+        }
+    }
+}
+
+// Returns the position of the last newline in "data" before position "pos", or -1 if there is none.
+static long prev_newline(const char *data, long pos)
+{
+    do
+    {
+        pos--;
+    } while (pos >= 0 && data[pos] != '\n');
+    return pos;
+}
+
+// Returns true if the quality line of the last record in the "len" bytes of "data", which end with a newline, is as long as its sequence line.
+// Used when the file ended without a final newline, where a quality line cut short would otherwise pass as a complete record.
+static bool last_quals_complete(const char *data, size_t len)
+{
+    long quals_end = (long) len - 1;
+    long plus_end = prev_newline(data, quals_end);
+    long seq_end = prev_newline(data, plus_end);
+    long header_end = prev_newline(data, seq_end);
+    // lines of files with Windows line endings also end with a carriage return
+    long quals_len = quals_end - plus_end - (data[quals_end - 1] == '\r');
+    long seq_len = seq_end - header_end - (data[seq_end - 1] == '\r');
+    return quals_len == seq_len;
+}
+
+// decompressor thread: decompress the input file into large blocks, trim each block to whole fastq records and hand it to the parser.
+// The partial record at the end of a block is moved to the start of the next block.
+static void* decompress_thread(void* arg)
+{
+    fq_reader* r = arg;
+    bool finished = false;
+    bool error = false;
+    ssize_t n;
+    fq_block* block = NULL;
+    fq_block* next = NULL;
+
+    block = take_free_block(r);
+    while (block != NULL)
+    {
+        // fill the block with decompressed text
+        while (block->len < block->size)
+        {
+            METRIC_ONLY(double t = metric_now();)
+            n = in_read(r->in, block->data + block->len, block->size - block->len);
+            METRIC_ONLY(r->metrics.decompress_seconds += metric_now() - t;)
+            if (n <= 0)
+            {
+                error = (n < 0);
+                finished = true;
+                break;
+            }
+            METRIC_ONLY(r->metrics.bytes_out += n;)
+            block->len += n;
+        }
+
+        // terminate a final line that is missing its newline
+        bool terminated = false;
+        if (finished && block->len > 0 && block->data[block->len - 1] != '\n')
+        {
+            if (!grow_block(block, block->len + 1))
+            {
+                error = true;
+                break;
+            }
+            block->data[block->len++] = '\n';
+            terminated = true;
+        }
+
+        size_t end = last_record_end(block->data, block->len, r->record_lines);
+        // a single record is larger than the block, grow the block and keep filling it
+        if (end == 0 && !finished)
+        {
+            if (!grow_block(block, block->size * 2))
+            {
+                error = true;
+                break;
+            }
+            continue;
+        }
+
+        if (finished)
+        {
+            // a partial record left at the end is from a truncated file. Only trailing blank lines may follow the last record.
+            for (size_t p = end; p < block->len; p++)
+            {
+                if (block->data[p] != '\n' && block->data[p] != '\r')
+                {
+                    error = true;
+                    break;
+                }
+            }
+            if (terminated && end == block->len && !last_quals_complete(block->data, end))
+            {
+                error = true;
+            }
+            block->len = end;
+            if (end > 0)
+            {
+                push_full_block(r, block);
+            } else {
+                release_block(r, block);
+            }
+            break;
+        }
+
+        // move the partial record at the end of the block to the start of the next block
+        next = take_free_block(r);
+        if (next == NULL)
+        {
+            release_block(r, block);
+            break;
+        }
+        size_t tail = block->len - end;
+        if (!grow_block(next, tail + FQ_BLOCK_SIZE / 2))
+        {
+            error = true;
+            release_block(r, next);
+            release_block(r, block);
+            break;
+        }
+        memcpy(next->data, block->data + end, tail);
+        next->len = tail;
+        block->len = end;
+        push_full_block(r, block);
+        block = next;
+    }
+
+    METRIC_ONLY(r->metrics.bytes_in = r->in->bytes_in;)
+    // the error is published together with the end of the stream, so the parser sees it as soon as it runs out of blocks
+    pthread_mutex_lock(&r->lock);
+    r->error = error;
+    r->done = true;
+    pthread_cond_broadcast(&r->ready);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+// open "path", or standard input for FQ_STDIN, and start decompressing it into blocks of whole records of "record_lines" lines
+static fq_reader* open_reader(const char *path, int record_lines)
+{
+    fq_reader* r = calloc(1, sizeof(fq_reader));
+    if (r == NULL)
+    {
+        return NULL;
+    }
+    r->in = in_open(path);
+    if (r->in == NULL)
+    {
+        free(r);
+        return NULL;
+    }
+    r->record_lines = record_lines;
+    for (int b = 0; b < FQ_QUEUE_BLOCKS; b++)
+    {
+        fq_block* block = new_block(FQ_BLOCK_SIZE);
+        if (block == NULL)
+        {
+            free_blocks(r->free);
+            in_close(r->in);
+            free(r);
+            return NULL;
+        }
+        block->next = r->free;
+        r->free = block;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->ready, NULL);
+    if (pthread_create(&r->thread, NULL, decompress_thread, r) != 0)
+    {
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->ready);
+        free_blocks(r->free);
+        in_close(r->in);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+// Open a gzipped, bgzipped, zstd compressed or plaintext fastq file and start decompressing it on a separate thread. Returns NULL if the file cannot be opened.
+// "path" may be a named pipe, or FQ_STDIN to read from standard input.
+fq_reader* fq_open(const char *path)
+{
+    return open_reader(path, 4);
+}
+
+// Open an interleaved fastq file, in which each read1 record is directly followed by its read2 record, like fq_open.
+// Successive calls to fq_next_record return read1 and read2 of a pair in turn, and both records of a pair are always in the same block.
+fq_reader* fq_open_interleaved(const char *path)
+{
+    return open_reader(path, 8);
+}
+
+// Read the next fastq record from "reader" into "rec". Returns true if a record was read, false at the end of the file or at a malformed record.
+bool fq_next_record(fq_reader* reader, fq_record* rec)
+{
+    if (reader->malformed)
+    {
+        return false;
+    }
+    while (reader->current == NULL || reader->pos >= reader->current->len)
+    {
+        // drop the reader's reference to the finished block and wait for the next one
+        if (reader->current != NULL)
+        {
+            fq_release_block(reader, reader->current);
+            reader->current = NULL;
+        }
+        pthread_mutex_lock(&reader->lock);
+        while (reader->full == NULL && !reader->done)
+        {
+            pthread_cond_wait(&reader->ready, &reader->lock);
+        }
+        if (reader->full != NULL)
+        {
+            reader->current = reader->full;
+            reader->current->refs = 1;
+            reader->full = reader->current->next;
+            reader->current->next = NULL;
+            if (reader->full == NULL)
+            {
+                reader->full_tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&reader->lock);
+        if (reader->current == NULL)
+        {
+            return false;
+        }
+        reader->pos = 0;
+    }
+
+    // blocks only hold complete records, so each of the four lines ends with a newline inside the block
+    const char *end = reader->current->data + reader->current->len;
+    const char *line = reader->current->data + reader->pos;
+    const char *nl = NULL;
+
+    nl = find_newline(line, end);
+    line = nl + 1;
+    nl = find_newline(line, end);
+    rec->seq = line;
+    rec->seq_len = nl - line;
+    line = nl + 1;
+    nl = find_newline(line, end);
+    line = nl + 1;
+    nl = find_newline(line, end);
+    rec->quals = line;
+    rec->quals_len = nl - line;
+    rec->block = reader->current;
+    reader->pos = (nl + 1) - reader->current->data;
+
+    // barcode correction reads a quality score for every base, a short quality line would make it read past the record
+    if (rec->quals_len != rec->seq_len)
+    {
+        pthread_mutex_lock(&reader->lock);
+        reader->malformed = true;
+        pthread_mutex_unlock(&reader->lock);
+        return false;
+    }
+
+    return true;
+}
+
+// Take a reference to "block" of "reader" so the records in it stay valid after the reader has moved on to the next block.
+void fq_retain_block(fq_reader* reader, fq_block* block)
+{
+    pthread_mutex_lock(&reader->lock);
+    block->refs++;
+    pthread_mutex_unlock(&reader->lock);
+}
+
+// Drop a reference to "block" of "reader" taken with fq_retain_block. The block is refilled once no references remain. "block" may be NULL.
+void fq_release_block(fq_reader* reader, fq_block* block)
+{
+    if (block == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&reader->lock);
+    block->refs--;
+    if (block->refs == 0)
+    {
+        free_block_locked(reader, block);
+    }
+    pthread_mutex_unlock(&reader->lock);
+}
+
+// Returns true if the decompressor thread of "reader" hit a read or decompression error, the file ended inside a record, or a record was malformed.
+bool fq_failed(fq_reader* reader)
+{
+    bool failed;
+    pthread_mutex_lock(&reader->lock);
+    failed = reader->error || reader->malformed;
+    pthread_mutex_unlock(&reader->lock);
+    return failed;
+}
+
+// Stop the decompressor thread of "reader", close the file and free all blocks.
+void fq_close(fq_reader* reader)
+{
+    pthread_mutex_lock(&reader->lock);
+    reader->stop = true;
+    pthread_cond_broadcast(&reader->ready);
+    pthread_mutex_unlock(&reader->lock);
+    pthread_join(reader->thread, NULL);
+
+    // the current block is no longer linked to the queued blocks
+    if (reader->current != NULL)
+    {
+        free_block(reader->current);
+    }
+    free_blocks(reader->full);
+    free_blocks(reader->free);
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->ready);
+    in_close(reader->in);
+    free(reader);
+}
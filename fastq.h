@@ -0,0 +1,96 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#ifndef FASTQ_H
+#define FASTQ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "metrics.h"
+#include "input.h"
+
+// set the size of each block of decompressed fastq text handed from the decompressor thread to the parser
+#define FQ_BLOCK_SIZE (4 * 1024 * 1024)
+
+// set the number of decompressed blocks in flight for each fastq file. Blocks stay in flight until every batch referencing them has been counted.
+#define FQ_QUEUE_BLOCKS 8
+
+// set the number of spare bytes allocated after each block so fixed length reads of a truncated final line stay inside the allocation
+#define FQ_BLOCK_PAD 64
+
+// set the path that reads a fastq stream from standard input
+#define FQ_STDIN IN_STDIN
+
+// define fq_block struct for a buffer of decompressed fastq text. Each block only contains complete fastq records.
+// "refs" counts the reader and read batches still pointing into the block; it returns to the decompressor when the count drops to 0.
+typedef struct fq_block {
+    char *data;
+    size_t size;
+    size_t len;
+    int refs;
+    struct fq_block* next;
+} fq_block;
+
+// define fq_record struct for the sequence and quality lines of one fastq record. Lines are not NUL terminated but are always followed by a newline.
+// Pointers point into "block" and are valid until the next call to fq_next_record on the same reader, or for as long as a reference to "block" is held.
+typedef struct fq_record {
+    const char *seq;
+    size_t seq_len;
+    const char *quals;
+    size_t quals_len;
+    fq_block* block;
+} fq_record;
+
+// define fq_reader struct for a fastq file decompressed on its own thread.
+// "full" holds decompressed blocks waiting to be parsed, "free" holds blocks ready to be refilled.
+// "record_lines" is the number of lines kept together in a block: 4 for a single fastq, 8 for an interleaved fastq so read1 and read2 of a pair share a block.
+// "malformed" is set by fq_next_record when a record's quality line is not the length of its sequence line.
+// "metrics" is only written by the decompressor thread and may be read once fq_next_record has returned false.
+typedef struct fq_reader {
+    in_stream* in;
+    int record_lines;
+    bool error;
+    bool malformed;
+    bool done;
+    bool stop;
+    fq_block* full;
+    fq_block* full_tail;
+    fq_block* free;
+    fq_block* current;
+    size_t pos;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_t thread;
+#ifdef BARCOUNTER_METRICS
+    file_metrics metrics;
+#endif
+} fq_reader;
+
+// Open a gzipped, bgzipped, zstd compressed or plaintext fastq file and start decompressing it on a separate thread. Returns NULL if the file cannot be opened.
+// "path" may be a named pipe, or FQ_STDIN to read from standard input.
+fq_reader* fq_open(const char *path);
+
+// Open an interleaved fastq file, in which each read1 record is directly followed by its read2 record, like fq_open.
+// Successive calls to fq_next_record return read1 and read2 of a pair in turn, and both records of a pair are always in the same block.
+fq_reader* fq_open_interleaved(const char *path);
+
+// Read the next fastq record from "reader" into "rec". Returns true if a record was read, false at the end of the file or at a malformed record.
+bool fq_next_record(fq_reader* reader, fq_record* rec);
+
+// Take a reference to "block" of "reader" so the records in it stay valid after the reader has moved on to the next block.
+void fq_retain_block(fq_reader* reader, fq_block* block);
+
+// Drop a reference to "block" of "reader" taken with fq_retain_block. The block is refilled once no references remain. "block" may be NULL.
+void fq_release_block(fq_reader* reader, fq_block* block);
+
+// Returns true if the decompressor thread of "reader" hit a read or decompression error, the file ended inside a record, or a record was malformed.
+bool fq_failed(fq_reader* reader);
+
+// Stop the decompressor thread of "reader", close the file and free all blocks.
+void fq_close(fq_reader* reader);
+
+#endif // FASTQ_H
@@ -0,0 +1,401 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "input.h"
+
+// read from "fd" until "size" bytes have been read or the end of the input is reached, so pipes that return short reads still fill the buffer.
+// Returns the number of bytes read, or -1 on a read error.
+static ssize_t fill_input(int fd, unsigned char *buf, size_t size)
+{
+    size_t total = 0;
+    while (total < size)
+    {
+        ssize_t n = read(fd, buf + total, size - total);
+        if (n < 0)
+        {
+            return -1;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+// move the unread input bytes of "s" to the start of its buffer and read from the file until at least "need" bytes are available or the end of the file is reached.
+// Returns the number of unread input bytes.
+static size_t refill_input(in_stream* s, size_t need)
+{
+    if (s->in_len - s->in_pos >= need || s->eof)
+    {
+        return s->in_len - s->in_pos;
+    }
+    memmove(s->in, s->in + s->in_pos, s->in_len - s->in_pos);
+    s->in_len -= s->in_pos;
+    s->in_pos = 0;
+    ssize_t n = fill_input(s->fd, s->in + s->in_len, IN_BUFFER_SIZE - s->in_len);
+    if (n < 0)
+    {
+        s->error = true;
+        n = 0;
+    }
+    s->eof = (s->in_len + n < IN_BUFFER_SIZE);
+    s->in_len += n;
+    s->bytes_in += n;
+    return s->in_len;
+}
+
+// Returns the total size of the bgzip block starting at "h", or 0 if "h" is not the header of a bgzip block.
+// A bgzip block is a gzip member with a "BC" extra subfield holding the block size minus 1.
+static size_t bgzf_block_size(const unsigned char *h, size_t len)
+{
+    if (len < 18 || h[0] != 0x1f || h[1] != 0x8b || h[2] != 8 || (h[3] & 4) == 0)
+    {
+        return 0;
+    }
+    size_t xlen = h[10] | (h[11] << 8);
+    size_t pos = 12;
+    while (pos + 4 <= 12 + xlen && pos + 4 <= len)
+    {
+        size_t slen = h[pos + 2] | (h[pos + 3] << 8);
+        if (h[pos] == 'B' && h[pos + 1] == 'C' && slen == 2 && pos + 6 <= len)
+        {
+            return (size_t) (h[pos + 4] | (h[pos + 5] << 8)) + 1;
+        }
+        pos += 4 + slen;
+    }
+    return 0;
+}
+
+// detect the format of "s" from its first bytes and prepare the matching decompressor. Returns true if successful, else returns false.
+static bool detect_format(in_stream* s)
+{
+    size_t n = refill_input(s, IN_BUFFER_SIZE);
+    const unsigned char *h = s->in;
+
+    if (n >= 4 && h[0] == 0x28 && h[1] == 0xb5 && h[2] == 0x2f && h[3] == 0xfd)
+    {
+#ifdef HAVE_ZSTD
+        s->format = IN_ZSTD;
+        s->zstd = ZSTD_createDStream();
+        return s->zstd != NULL && !ZSTD_isError(ZSTD_initDStream(s->zstd));
+#else
+        printf("zstd compressed input requires BarCounter to be compiled with -DHAVE_ZSTD and -lzstd\n");
+        return false;
+#endif
+    }
+    if (n >= 2 && h[0] == 0x1f && h[1] == 0x8b)
+    {
+        // bgzip blocks are inflated whole as raw deflate data, other gzip files are inflated as a stream
+        if (bgzf_block_size(h, n) > 0)
+        {
+            s->format = IN_BGZIP;
+            s->block = malloc(IN_BGZF_BLOCK);
+            s->strm_init = (s->block != NULL && inflateInit2(&s->strm, -15) == Z_OK);
+        } else {
+            s->format = IN_GZIP;
+            s->strm_init = (inflateInit2(&s->strm, 15 + 16) == Z_OK);
+        }
+        return s->strm_init;
+    }
+    s->format = IN_PLAIN;
+    return true;
+}
+
+// read plaintext. Buffered bytes are copied first, after that the file is read straight into "buf".
+static ssize_t read_plain(in_stream* s, char *buf, size_t len)
+{
+    size_t avail = s->in_len - s->in_pos;
+    if (avail > 0)
+    {
+        size_t copy = (len < avail) ? len : avail;
+        memcpy(buf, s->in + s->in_pos, copy);
+        s->in_pos += copy;
+        return copy;
+    }
+    if (s->eof)
+    {
+        return 0;
+    }
+    ssize_t n = fill_input(s->fd, (unsigned char *) buf, len);
+    if (n < 0)
+    {
+        return -1;
+    }
+    s->eof = (n == 0);
+    s->bytes_in += n;
+    return n;
+}
+
+// inflate a gzip stream. Fastq files may be concatenations of several gzip members. Returns -1 if the file ends inside a member.
+static ssize_t read_gzip(in_stream* s, char *buf, size_t len)
+{
+    s->strm.next_out = (unsigned char *) buf;
+    s->strm.avail_out = len;
+    while (s->strm.avail_out > 0)
+    {
+        if (s->in_pos == s->in_len && refill_input(s, 1) == 0)
+        {
+            // the end of the file must also be the end of a member
+            if (s->member_open)
+            {
+                return -1;
+            }
+            break;
+        }
+        s->strm.next_in = s->in + s->in_pos;
+        s->strm.avail_in = s->in_len - s->in_pos;
+        int ret = inflate(&s->strm, Z_NO_FLUSH);
+        s->in_pos = s->in_len - s->strm.avail_in;
+        s->member_open = (ret != Z_STREAM_END);
+        if (ret == Z_STREAM_END)
+        {
+            inflateReset(&s->strm);
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            return -1;
+        }
+    }
+    return len - s->strm.avail_out;
+}
+
+// inflate the next bgzip block into the block buffer and check its CRC and size. Returns 1 if a block was read, 0 at the end of the file or -1 on an error.
+static int next_bgzf_block(in_stream* s)
+{
+    size_t avail = refill_input(s, 18);
+    if (avail == 0)
+    {
+        return 0;
+    }
+    size_t size = bgzf_block_size(s->in + s->in_pos, avail);
+    if (size < 26 || refill_input(s, size) < size)
+    {
+        return -1;
+    }
+    const unsigned char *b = s->in + s->in_pos;
+    size_t xlen = b[10] | (b[11] << 8);
+    const unsigned char *trailer = b + size - 8;
+    uint32_t crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint32_t) trailer[3] << 24);
+    uint32_t isize = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | ((uint32_t) trailer[7] << 24);
+    if (isize > IN_BGZF_BLOCK || 12 + xlen + 8 > size)
+    {
+        return -1;
+    }
+
+    inflateReset(&s->strm);
+    s->strm.next_in = (unsigned char *) b + 12 + xlen;
+    s->strm.avail_in = size - 12 - xlen - 8;
+    s->strm.next_out = s->block;
+    s->strm.avail_out = IN_BGZF_BLOCK;
+    if (inflate(&s->strm, Z_FINISH) != Z_STREAM_END || IN_BGZF_BLOCK - s->strm.avail_out != isize || crc32(0, s->block, isize) != crc)
+    {
+        return -1;
+    }
+    s->in_pos += size;
+    s->block_pos = 0;
+    s->block_len = isize;
+    return 1;
+}
+
+// read bgzip blocks. Each block is inflated in a single call because its compressed and decompressed sizes are known from its header and trailer.
+static ssize_t read_bgzip(in_stream* s, char *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        if (s->block_pos == s->block_len)
+        {
+            int ret = next_bgzf_block(s);
+            if (ret < 0)
+            {
+                return -1;
+            }
+            if (ret == 0)
+            {
+                break;
+            }
+            continue;
+        }
+        size_t copy = s->block_len - s->block_pos;
+        if (copy > len - done)
+        {
+            copy = len - done;
+        }
+        memcpy(buf + done, s->block + s->block_pos, copy);
+        s->block_pos += copy;
+        done += copy;
+    }
+    return done;
+}
+
+#ifdef HAVE_ZSTD
+// decompress a zstd stream, which may hold several frames
+static ssize_t read_zstd(in_stream* s, char *buf, size_t len)
+{
+    ZSTD_outBuffer out = {buf, len, 0};
+    while (out.pos < out.size)
+    {
+        if (s->in_pos == s->in_len && refill_input(s, 1) == 0)
+        {
+            // the end of the file must also be the end of a frame
+            if (s->zstd_left != 0)
+            {
+                return -1;
+            }
+            break;
+        }
+        ZSTD_inBuffer in = {s->in, s->in_len, s->in_pos};
+        s->zstd_left = ZSTD_decompressStream(s->zstd, &out, &in);
+        s->in_pos = in.pos;
+        if (ZSTD_isError(s->zstd_left))
+        {
+            return -1;
+        }
+    }
+    return out.pos;
+}
+#endif
+
+// Open the file "path", or standard input for IN_STDIN, for reading. The format is detected from its first bytes on the first read:
+// gzip, bgzip (blocked gzip), zstd (if compiled with -DHAVE_ZSTD and -lzstd) or plaintext. Returns NULL if the file cannot be opened.
+in_stream* in_open(const char *path)
+{
+    in_stream* s = calloc(1, sizeof(in_stream));
+    if (s == NULL)
+    {
+        return NULL;
+    }
+    s->in = malloc(IN_BUFFER_SIZE);
+    // standard input is duplicated so in_close can close it like any other file
+    s->fd = (strcmp(path, IN_STDIN) == 0) ? dup(STDIN_FILENO) : open(path, O_RDONLY);
+    if (s->in == NULL || s->fd < 0)
+    {
+        if (s->fd >= 0)
+        {
+            close(s->fd);
+        }
+        free(s->in);
+        free(s);
+        return NULL;
+    }
+    s->format = IN_UNKNOWN;
+    return s;
+}
+
+// Read up to "len" decompressed bytes from "s" into "buf". Returns the number of bytes read, 0 at the end of the file or -1 on a read or decompression error.
+ssize_t in_read(in_stream* s, char *buf, size_t len)
+{
+    ssize_t n = -1;
+    if (s->format == IN_UNKNOWN && !detect_format(s))
+    {
+        s->error = true;
+    }
+    if (s->error)
+    {
+        return -1;
+    }
+    switch (s->format)
+    {
+        case IN_PLAIN: n = read_plain(s, buf, len); break;
+        case IN_GZIP: n = read_gzip(s, buf, len); break;
+        case IN_BGZIP: n = read_bgzip(s, buf, len); break;
+#ifdef HAVE_ZSTD
+        case IN_ZSTD: n = read_zstd(s, buf, len); break;
+#endif
+        default: break;
+    }
+    if (n < 0 || s->error)
+    {
+        s->error = true;
+        return -1;
+    }
+    return n;
+}
+
+// Read decompressed bytes from "s" into "line" up to and including the next newline, reading at most "size" - 1 bytes, and NUL terminate them.
+// Returns "line", or NULL at the end of the file or on an error.
+char* in_gets(in_stream* s, char *line, int size)
+{
+    int len = 0;
+    if (s->text == NULL && (s->text = malloc(IN_BUFFER_SIZE)) == NULL)
+    {
+        s->error = true;
+        return NULL;
+    }
+    while (len < size - 1)
+    {
+        if (s->text_pos == s->text_len)
+        {
+            ssize_t n = in_read(s, s->text, IN_BUFFER_SIZE);
+            if (n <= 0)
+            {
+                break;
+            }
+            s->text_pos = 0;
+            s->text_len = n;
+        }
+        char c = s->text[s->text_pos++];
+        line[len++] = c;
+        if (c == '\n')
+        {
+            break;
+        }
+    }
+    line[len] = '\0';
+    return (len > 0) ? line : NULL;
+}
+
+// Returns true if "s" hit a read or decompression error.
+bool in_failed(const in_stream* s)
+{
+    return s->error;
+}
+
+// Returns the name of the detected format of "s".
+const char* in_format_name(const in_stream* s)
+{
+    switch (s->format)
+    {
+        case IN_PLAIN: return "plaintext";
+        case IN_GZIP: return "gzip";
+        case IN_BGZIP: return "bgzip";
+        case IN_ZSTD: return "zstd";
+        default: return "unknown";
+    }
+}
+
+// Close the file of "s" and free its buffers.
+void in_close(in_stream* s)
+{
+    if (s->strm_init)
+    {
+        inflateEnd(&s->strm);
+    }
+#ifdef HAVE_ZSTD
+    if (s->zstd != NULL)
+    {
+        ZSTD_freeDStream(s->zstd);
+    }
+#endif
+    close(s->fd);
+    free(s->in);
+    free(s->block);
+    free(s->text);
+    free(s);
+}
@@ -0,0 +1,82 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// set the size of each read from an input file
+#define IN_BUFFER_SIZE (1024 * 1024)
+
+// set the largest decompressed size of a bgzip block
+#define IN_BGZF_BLOCK 65536
+
+// set the path that reads from standard input
+#define IN_STDIN "-"
+
+// formats of an input file, detected from its first bytes. IN_UNKNOWN until the first read.
+typedef enum in_format {
+    IN_UNKNOWN,
+    IN_PLAIN,
+    IN_GZIP,
+    IN_BGZIP,
+    IN_ZSTD
+} in_format;
+
+// define in_stream struct for a buffered input file that is decompressed according to its detected format.
+// "in" holds compressed bytes read from the file, "block" holds the current decompressed bgzip block and "text" holds decompressed bytes for in_gets.
+// "member_open" is true while a gzip member has been started but not yet ended, so a file truncated inside a member is reported as an error.
+typedef struct in_stream {
+    int fd;
+    in_format format;
+    bool eof;
+    bool error;
+    unsigned char *in;
+    size_t in_pos;
+    size_t in_len;
+    z_stream strm;
+    bool strm_init;
+    bool member_open;
+    unsigned char *block;
+    size_t block_pos;
+    size_t block_len;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream* zstd;
+    size_t zstd_left;
+#endif
+    char *text;
+    size_t text_pos;
+    size_t text_len;
+    uint64_t bytes_in;
+} in_stream;
+
+// Open the file "path", or standard input for IN_STDIN, for reading. The format is detected from its first bytes on the first read:
+// gzip, bgzip (blocked gzip), zstd (if compiled with -DHAVE_ZSTD and -lzstd) or plaintext. Returns NULL if the file cannot be opened.
+in_stream* in_open(const char *path);
+
+// Read up to "len" decompressed bytes from "s" into "buf". Returns the number of bytes read, 0 at the end of the file or -1 on a read or decompression error.
+ssize_t in_read(in_stream* s, char *buf, size_t len);
+
+// Read decompressed bytes from "s" into "line" up to and including the next newline, reading at most "size" - 1 bytes, and NUL terminate them.
+// Returns "line", or NULL at the end of the file or on an error.
+char* in_gets(in_stream* s, char *line, int size);
+
+// Returns true if "s" hit a read or decompression error.
+bool in_failed(const in_stream* s);
+
+// Returns the name of the detected format of "s".
+const char* in_format_name(const in_stream* s);
+
+// Close the file of "s" and free its buffers.
+void in_close(in_stream* s);
+
+#endif // INPUT_H
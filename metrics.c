@@ -0,0 +1,104 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#ifdef BARCOUNTER_METRICS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "metrics.h"
+#include "pipeline.h"
+
+// names of the stages in the metrics file, in metric_stage order
+static const char *stage_names[N_STAGES] = {"load", "read", "barcode_lookup", "barcode_correction", "tag_lookup", "umi", "dedup", "merge", "output"};
+
+// Add the timings and call counts of "src" to "dest".
+void merge_stage_metrics(stage_metrics* dest, const stage_metrics* src)
+{
+    for (int s = 0; s < N_STAGES; s++)
+    {
+        dest->seconds[s] += src->seconds[s];
+        dest->calls[s] += src->calls[s];
+        dest->sampled[s] += src->sampled[s];
+    }
+}
+
+// write "s" as a JSON string, escaping quotes, backslashes and control characters
+static void put_json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '"' || *s == '\\')
+        {
+            fprintf(out, "\\%c", *s);
+        }
+        else if ((unsigned char) *s < 0x20)
+        {
+            fprintf(out, "\\u%04x", (unsigned char) *s);
+        } else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// write the metrics of one fastq file. Every read pair of a lane is one read in each of its two files.
+static void put_file_metrics(FILE *out, const char *path, const file_metrics* m, unsigned long long int reads, double seconds, bool last)
+{
+    fprintf(out, "    {\"path\": ");
+    put_json_string(out, path);
+    fprintf(out, ", \"bytes_in\": %llu, \"bytes_out\": %llu, \"decompress_seconds\": %.6f, \"reads\": %llu, \"seconds\": %.6f, \"reads_per_second\": %.1f, \"mb_per_second\": %.2f}%s\n",
+            (unsigned long long int) m->bytes_in, (unsigned long long int) m->bytes_out, m->decompress_seconds, reads, seconds,
+            seconds > 0 ? reads / seconds : 0.0, seconds > 0 ? m->bytes_in / seconds / 1e6 : 0.0, last ? "" : ",");
+}
+
+// Write the metrics of a run to the JSON file "path": wall time and throughput, the time spent in each stage, barcode correction attempts and results,
+// and the bytes, reads and throughput of every fastq file in "jobs". Returns true if successful, else returns false.
+bool write_metrics_json(const char *path, const count_stats* stats, const lane_job* jobs, int n_jobs, int threads, double wall_seconds)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL)
+    {
+        return false;
+    }
+    const stage_metrics* m = &stats->metrics;
+
+    fprintf(out, "{\n  \"wall_seconds\": %.6f,\n  \"threads\": %i,\n  \"total_reads\": %llu,\n  \"reads_per_second\": %.1f,\n  \"sample_interval\": %i,\n",
+            wall_seconds, threads, stats->total_reads, wall_seconds > 0 ? stats->total_reads / wall_seconds : 0.0, METRICS_SAMPLE);
+
+    // per read stages are sampled, so their total time is estimated from the mean time of the sampled calls
+    fprintf(out, "  \"stages\": {\n");
+    for (int s = 0; s < N_STAGES; s++)
+    {
+        double total = (m->sampled[s] > 0) ? m->seconds[s] * m->calls[s] / m->sampled[s] : 0.0;
+        fprintf(out, "    \"%s\": {\"calls\": %llu, \"timed_calls\": %llu, \"seconds\": %.6f, \"ns_per_call\": %.1f}%s\n", stage_names[s],
+                (unsigned long long int) m->calls[s], (unsigned long long int) m->sampled[s], total,
+                m->calls[s] > 0 ? total * 1e9 / m->calls[s] : 0.0, s == N_STAGES - 1 ? "" : ",");
+    }
+    fprintf(out, "  },\n");
+
+    fprintf(out, "  \"barcode_correction\": {\"attempts\": %llu, \"corrected\": %llu, \"ambiguous\": %llu, \"uncorrectable\": %llu},\n",
+            (unsigned long long int) m->calls[STAGE_CORRECT], stats->corrected_barcodes, stats->ambiguous_barcodes,
+            (unsigned long long int) m->calls[STAGE_CORRECT] - stats->corrected_barcodes - stats->ambiguous_barcodes);
+
+    fprintf(out, "  \"files\": [\n");
+    for (int j = 0; j < n_jobs; j++)
+    {
+        // an interleaved fastq holds both reads of every pair in one file
+        bool interleaved = (jobs[j].path2 == NULL);
+        put_file_metrics(out, jobs[j].path1, &jobs[j].metrics.r1, jobs[j].stats.total_reads, jobs[j].metrics.seconds, interleaved && j == n_jobs - 1);
+        if (!interleaved)
+        {
+            put_file_metrics(out, jobs[j].path2, &jobs[j].metrics.r2, jobs[j].stats.total_reads, jobs[j].metrics.seconds, j == n_jobs - 1);
+        }
+    }
+    fprintf(out, "  ]\n}\n");
+    return fclose(out) == 0;
+}
+
+#endif // BARCOUNTER_METRICS
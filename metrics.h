@@ -0,0 +1,90 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+// Run metrics are only compiled in when BARCOUNTER_METRICS is defined (gcc -DBARCOUNTER_METRICS ... metrics.c).
+// Otherwise every METRIC_ macro expands to nothing, and no metrics fields, timers or output exist in the program.
+#ifdef BARCOUNTER_METRICS
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// set how often the per read stages are timed: 1 of every METRICS_SAMPLE read pairs. Calls are counted for every read pair.
+#define METRICS_SAMPLE 64
+
+// stages of a run. The per read stages (barcode lookup, barcode correction, tag lookup, UMI packing) are sampled, the other stages are timed in full.
+typedef enum metric_stage {
+    STAGE_LOAD,
+    STAGE_READ,
+    STAGE_BARCODE,
+    STAGE_CORRECT,
+    STAGE_TAG,
+    STAGE_UMI,
+    STAGE_DEDUP,
+    STAGE_MERGE,
+    STAGE_OUTPUT,
+    N_STAGES
+} metric_stage;
+
+// define stage_metrics struct for the stage timings of one thread or of the whole run.
+// "seconds" is the time spent in the "sampled" calls of each stage, out of "calls" calls in total.
+// "read_pairs" counts every read pair seen by one thread and picks which of them are timed. It is not merged.
+typedef struct stage_metrics {
+    double seconds[N_STAGES];
+    uint64_t calls[N_STAGES];
+    uint64_t sampled[N_STAGES];
+    uint64_t read_pairs;
+} stage_metrics;
+
+// define file_metrics struct for one fastq file: bytes read from disk, bytes of fastq text produced and time spent decompressing
+typedef struct file_metrics {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    double decompress_seconds;
+} file_metrics;
+
+// define lane_metrics struct for one read1/read2 fastq pair and the wall time taken to process it
+typedef struct lane_metrics {
+    file_metrics r1;
+    file_metrics r2;
+    double seconds;
+} lane_metrics;
+
+struct count_stats;
+struct lane_job;
+
+// Returns the current monotonic time in seconds.
+static inline double metric_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Add the timings and call counts of "src" to "dest".
+void merge_stage_metrics(stage_metrics* dest, const stage_metrics* src);
+
+// Write the metrics of a run to the JSON file "path": wall time and throughput, the time spent in each stage, barcode correction attempts and results,
+// and the bytes, reads and throughput of every fastq file in "jobs". Returns true if successful, else returns false.
+bool write_metrics_json(const char *path, const struct count_stats* stats, const struct lane_job* jobs, int n_jobs, int threads, double wall_seconds);
+
+#define METRIC_ONLY(x) x
+#define METRIC_TIMER(t) double t = 0
+#define METRIC_START(t, on) do { if (on) { t = metric_now(); } } while (0)
+#define METRIC_STOP(m, stage, t, on) do { (m)->calls[stage]++; if (on) { (m)->seconds[stage] += metric_now() - t; (m)->sampled[stage]++; } } while (0)
+
+#else
+
+#define METRIC_ONLY(x)
+#define METRIC_TIMER(t)
+#define METRIC_START(t, on)
+#define METRIC_STOP(m, stage, t, on)
+
+#endif // BARCOUNTER_METRICS
+
+#endif // METRICS_H
@@ -0,0 +1,288 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "output.h"
+#include "barcodes.h"
+#include "tags.h"
+#include "counts.h"
+
+// define out_file struct for a buffered plaintext or gzipped output file. Lines are formatted into "buf" and written when it is full.
+typedef struct out_file {
+    FILE *fp;
+    gzFile gz;
+    char *buf;
+    size_t len;
+    bool error;
+} out_file;
+
+// two digit strings "00" to "99" used to format two decimal digits at a time
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// open output file "path", gzipped if "gzipped" is true. Returns true if successful, else returns false.
+static bool open_out(out_file* out, const char *path, bool gzipped)
+{
+    out->fp = NULL;
+    out->gz = NULL;
+    out->len = 0;
+    out->error = false;
+    out->buf = malloc(OUT_BUF_SIZE);
+    if (gzipped)
+    {
+        out->gz = gzopen(path, "wb");
+    } else {
+        out->fp = fopen(path, "w");
+    }
+    if (out->buf == NULL || (out->fp == NULL && out->gz == NULL))
+    {
+        printf("%s could not be opened for writing\n", path);
+        free(out->buf);
+        if (out->fp != NULL)
+        {
+            fclose(out->fp);
+        }
+        if (out->gz != NULL)
+        {
+            gzclose(out->gz);
+        }
+        return false;
+    }
+    return true;
+}
+
+// write the buffered text to the file
+static void flush_out(out_file* out)
+{
+    if (out->len == 0)
+    {
+        return;
+    }
+    if (out->gz != NULL)
+    {
+        out->error |= gzwrite(out->gz, out->buf, (unsigned int) out->len) != (int) out->len;
+    } else {
+        out->error |= fwrite(out->buf, 1, out->len, out->fp) != out->len;
+    }
+    out->len = 0;
+}
+
+// append "len" bytes of "s" to the output buffer
+static inline void put_str(out_file* out, const char *s, size_t len)
+{
+    if (out->len + len > OUT_BUF_SIZE)
+    {
+        flush_out(out);
+    }
+    // text longer than the buffer is written directly
+    if (len > OUT_BUF_SIZE)
+    {
+        if (out->gz != NULL)
+        {
+            out->error |= gzwrite(out->gz, s, (unsigned int) len) != (int) len;
+        } else {
+            out->error |= fwrite(s, 1, len, out->fp) != len;
+        }
+        return;
+    }
+    memcpy(out->buf + out->len, s, len);
+    out->len += len;
+}
+
+// append character "c" to the output buffer
+static inline void put_char(out_file* out, char c)
+{
+    if (out->len == OUT_BUF_SIZE)
+    {
+        flush_out(out);
+    }
+    out->buf[out->len++] = c;
+}
+
+// append the decimal digits of "v" to the output buffer, formatting two digits at a time
+static inline void put_uint(out_file* out, unsigned long int v)
+{
+    char digits[24];
+    int n = sizeof(digits);
+    while (v >= 100)
+    {
+        unsigned int r = (unsigned int) (v % 100);
+        v /= 100;
+        n -= 2;
+        memcpy(digits + n, digit_pairs + 2 * r, 2);
+    }
+    if (v >= 10)
+    {
+        n -= 2;
+        memcpy(digits + n, digit_pairs + 2 * v, 2);
+    } else {
+        digits[--n] = (char) ('0' + v);
+    }
+    put_str(out, digits + n, sizeof(digits) - n);
+}
+
+// flush and close an output file. Returns true if every write succeeded, else returns false.
+static bool close_out(out_file* out)
+{
+    flush_out(out);
+    if (out->gz != NULL)
+    {
+        out->error |= gzclose(out->gz) != Z_OK;
+    } else {
+        out->error |= fclose(out->fp) != 0;
+    }
+    free(out->buf);
+    out->buf = NULL;
+    return !out->error;
+}
+
+// Write the dense tag counts CSV "path" (cell_barcode,total,<tag names>) with one row per counted barcode in whitelist order.
+// Returns true if successful, else returns false.
+bool write_counts_csv(const char *path, const bc_index* index, const count_matrix* counts, char names[MAX_TAGS][NAME_LEN + 1], int t_count)
+{
+    out_file out;
+    char barcode[BC_LEN + 1];
+    uint32_t *ids = sorted_count_ids(counts);
+    if (ids == NULL || !open_out(&out, path, false))
+    {
+        free(ids);
+        return false;
+    }
+
+    // write header
+    put_str(&out, "cell_barcode,total", strlen("cell_barcode,total"));
+    for (int n = 0; n < t_count; n++)
+    {
+        put_char(&out, ',');
+        put_str(&out, names[n], strlen(names[n]));
+    }
+    put_char(&out, '\n');
+
+    // write counts of every counted barcode
+    for (uint32_t r = 0; r < counts->n_rows; r++)
+    {
+        unpack_bc(index->codes[ids[r]], barcode);
+        put_str(&out, barcode, BC_LEN);
+        put_char(&out, ',');
+        put_uint(&out, get_total(counts, ids[r]));
+        for (int fg = 0; fg < t_count; fg++)
+        {
+            put_char(&out, ',');
+            put_uint(&out, get_count(counts, ids[r], fg));
+        }
+        put_char(&out, '\n');
+    }
+    free(ids);
+    return close_out(&out);
+}
+
+// Write the sparse tag counts to directory "dir" (created if needed) as matrix.mtx.gz, barcodes.tsv.gz and features.tsv.gz.
+// Rows of the matrix are tags and columns are the counted barcodes in whitelist order; only non zero counts are written.
+// Returns true if successful, else returns false.
+bool write_counts_mtx(const char *dir, const bc_index* index, const count_matrix* counts, char tags[MAX_TAGS][TAG_LEN + 1], char names[MAX_TAGS][NAME_LEN + 1], int t_count)
+{
+    struct stat st;
+    char path[1000];
+    out_file out;
+    char barcode[BC_LEN + 1];
+    unsigned long int nnz = 0;
+    bool success = true;
+
+    if (stat(dir, &st) == -1 && mkdir(dir, 0777) != 0)
+    {
+        printf("Could not create output directory %s\n", dir);
+        return false;
+    }
+    uint32_t *ids = sorted_count_ids(counts);
+    if (ids == NULL)
+    {
+        return false;
+    }
+
+    // features.tsv.gz: tag sequence, tag name and feature type of each matrix row
+    snprintf(path, sizeof(path), "%sfeatures.tsv.gz", dir);
+    if (!open_out(&out, path, true))
+    {
+        free(ids);
+        return false;
+    }
+    for (int t = 0; t < t_count; t++)
+    {
+        put_str(&out, tags[t], TAG_LEN);
+        put_char(&out, '\t');
+        put_str(&out, names[t], strlen(names[t]));
+        put_char(&out, '\t');
+        put_str(&out, MTX_FEATURE_TYPE, strlen(MTX_FEATURE_TYPE));
+        put_char(&out, '\n');
+    }
+    success &= close_out(&out);
+
+    // barcodes.tsv.gz: the barcode of each matrix column
+    snprintf(path, sizeof(path), "%sbarcodes.tsv.gz", dir);
+    if (!open_out(&out, path, true))
+    {
+        free(ids);
+        return false;
+    }
+    for (uint32_t r = 0; r < counts->n_rows; r++)
+    {
+        unpack_bc(index->codes[ids[r]], barcode);
+        put_str(&out, barcode, BC_LEN);
+        put_char(&out, '\n');
+    }
+    success &= close_out(&out);
+
+    // matrix.mtx.gz: the header needs the number of non zero entries, which are counted first
+    for (uint32_t r = 0; r < counts->n_rows; r++)
+    {
+        for (int t = 0; t < t_count; t++)
+        {
+            nnz += (get_count(counts, ids[r], t) != 0);
+        }
+    }
+    snprintf(path, sizeof(path), "%smatrix.mtx.gz", dir);
+    if (!open_out(&out, path, true))
+    {
+        free(ids);
+        return false;
+    }
+    put_str(&out, "%%MatrixMarket matrix coordinate integer general\n", strlen("%%MatrixMarket matrix coordinate integer general\n"));
+    put_uint(&out, t_count);
+    put_char(&out, ' ');
+    put_uint(&out, counts->n_rows);
+    put_char(&out, ' ');
+    put_uint(&out, nnz);
+    put_char(&out, '\n');
+    for (uint32_t r = 0; r < counts->n_rows; r++)
+    {
+        for (int t = 0; t < t_count; t++)
+        {
+            unsigned int c = get_count(counts, ids[r], t);
+            if (c != 0)
+            {
+                put_uint(&out, t + 1);
+                put_char(&out, ' ');
+                put_uint(&out, r + 1);
+                put_char(&out, ' ');
+                put_uint(&out, c);
+                put_char(&out, '\n');
+            }
+        }
+    }
+    success &= close_out(&out);
+    free(ids);
+    return success;
+}
@@ -0,0 +1,30 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+
+#include "barcodes.h"
+#include "tags.h"
+#include "counts.h"
+
+// set the size of the buffer used to format output lines before they are written
+#define OUT_BUF_SIZE (256 * 1024)
+
+// set the feature type written to the third column of features.tsv.gz
+#define MTX_FEATURE_TYPE "Antibody Capture"
+
+// Write the dense tag counts CSV "path" (cell_barcode,total,<tag names>) with one row per counted barcode in whitelist order.
+// Returns true if successful, else returns false.
+bool write_counts_csv(const char *path, const bc_index* index, const count_matrix* counts, char names[MAX_TAGS][NAME_LEN + 1], int t_count);
+
+// Write the sparse tag counts to directory "dir" (created if needed) as matrix.mtx.gz, barcodes.tsv.gz and features.tsv.gz.
+// Rows of the matrix are tags and columns are the counted barcodes in whitelist order; only non zero counts are written.
+// Returns true if successful, else returns false.
+bool write_counts_mtx(const char *dir, const bc_index* index, const count_matrix* counts, char tags[MAX_TAGS][TAG_LEN + 1], char names[MAX_TAGS][NAME_LEN + 1], int t_count);
+
+#endif // OUTPUT_H
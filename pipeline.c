@@ -0,0 +1,572 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+#include "fastq.h"
+#include "barcodes.h"
+#include "tags.h"
+#include "umis.h"
+#include "chemistry.h"
+#include "spill.h"
+#include "checkpoint.h"
+#include "metrics.h"
+
+// define pipeline struct for the state shared by the reader thread and worker threads of a single fastq pair.
+// "mismatched" is set by the reader thread if one fastq file ends before the other.
+typedef struct pipeline {
+    fq_reader* pinR1;
+    fq_reader* pinR2;
+    bool mismatched;
+    count_ctx* ctx;
+    lane_job* job;
+    batch_queue free_batches;
+    batch_queue full_batches;
+#ifdef BARCOUNTER_METRICS
+    stage_metrics reader_metrics;
+#endif
+} pipeline;
+
+// initialize an empty batch queue
+static void init_queue(batch_queue* q)
+{
+    q->head = NULL;
+    q->tail = NULL;
+    q->closed = false;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->ready, NULL);
+}
+
+// destroy a batch queue and free any batches left in it
+static void destroy_queue(batch_queue* q)
+{
+    read_batch* temp = NULL;
+    while (q->head != NULL)
+    {
+        temp = q->head->next;
+        free(q->head);
+        q->head = temp;
+    }
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->ready);
+}
+
+// add a batch to the end of a queue and wake a waiting thread
+static void push_batch(batch_queue* q, read_batch* batch)
+{
+    batch->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == NULL)
+    {
+        q->head = batch;
+    } else {
+        q->tail->next = batch;
+    }
+    q->tail = batch;
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// remove a batch from the front of a queue, waiting until one is available. Returns NULL once the queue is closed and empty.
+static read_batch* pop_batch(batch_queue* q)
+{
+    read_batch* batch = NULL;
+    pthread_mutex_lock(&q->lock);
+    while (q->head == NULL && !q->closed)
+    {
+        pthread_cond_wait(&q->ready, &q->lock);
+    }
+    if (q->head != NULL)
+    {
+        batch = q->head;
+        q->head = batch->next;
+        if (q->head == NULL)
+        {
+            q->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return batch;
+}
+
+// mark a queue as closed and wake every waiting thread
+static void close_queue(batch_queue* q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// reader thread: fill free batches with pointers to the read pairs in the decompressed fastq blocks and pass them to the worker threads.
+// A batch ends when either fastq file moves on to a new block, so each batch references exactly one block of each file.
+// Read pairs too short for the read geometry are passed on with a NULL read1 sequence so they are still counted as reads.
+static void* reader_thread(void* arg)
+{
+    pipeline* p = arg;
+    fq_record rec1;
+    fq_record rec2;
+    bool eof = false;
+    bool pending = false;
+    size_t r1_min = (size_t) geometry_r1_len(&p->ctx->geometry);
+    size_t r2_min = (size_t) geometry_r2_len(&p->ctx->geometry);
+
+    while (!eof)
+    {
+        read_batch* batch = pop_batch(&p->free_batches);
+        METRIC_ONLY(double t = metric_now();)
+        batch->n_reads = 0;
+        batch->r1_block = NULL;
+        batch->r2_block = NULL;
+        while (batch->n_reads < BATCH_READS)
+        {
+            // if either fastq file has no more records the EOF has been reached, stop reading. Both files must end together.
+            if (!pending)
+            {
+                bool more1 = fq_next_record(p->pinR1, &rec1);
+                bool more2 = fq_next_record(p->pinR2, &rec2);
+                if (!more1 || !more2)
+                {
+                    p->mismatched = (more1 != more2);
+                    eof = true;
+                    break;
+                }
+            }
+            pending = false;
+            if (batch->n_reads == 0)
+            {
+                batch->r1_block = rec1.block;
+                batch->r2_block = rec2.block;
+                fq_retain_block(p->pinR1, rec1.block);
+                fq_retain_block(p->pinR2, rec2.block);
+            }
+            // keep a read pair from a new block for the next batch
+            else if (rec1.block != batch->r1_block || rec2.block != batch->r2_block)
+            {
+                pending = true;
+                break;
+            }
+            read_pair* rp = &batch->reads[batch->n_reads];
+            rp->r1_seq = (rec1.seq_len >= r1_min && rec2.seq_len >= r2_min) ? rec1.seq : NULL;
+            rp->r1_quals = rec1.quals;
+            rp->r2_seq = rec2.seq;
+            rp->r2_len = (int) rec2.seq_len;
+            batch->n_reads++;
+        }
+        METRIC_STOP(&p->reader_metrics, STAGE_READ, t, true);
+        push_batch(&p->full_batches, batch);
+    }
+    close_queue(&p->full_batches);
+    return NULL;
+}
+
+// Check a single read pair against the whitelist index and tag index. "packed" is true if the barcode of the read was packed into "code" without an 'N'.
+// If the barcode, tag and UMI are valid, set "key" to the UMI key of the read and return true, else return false. Updates the per thread statistics in "stats". In a sharded run a read is counted by the shard of its whitelist barcode, and reads without one by shard 0,
+// so the statistics of all shards add up to those of an unsharded run.
+static bool process_read_pair(const read_pair* rp, uint32_t code, bool packed, count_ctx* ctx, uint64_t *key, count_stats* stats)
+{
+    const read_geometry* geometry = &ctx->geometry;
+    const char *curr_bc;
+    const char *n_base = NULL;
+    uint32_t umi;
+    int bc_id = -1;
+    int tag_index = -1;
+    bool corrected = false;
+    bool shard_zero = ctx->shard_index == 0;
+
+    // update read count, reads too short for the read geometry are not counted further
+    stats->total_reads += shard_zero;
+    if (rp->r1_seq == NULL)
+    {
+        return false;
+    }
+    curr_bc = rp->r1_seq + geometry->bc_first;
+    // in a sharded run total_reads only counts the reads of this shard, so sampling uses its own count of every read pair
+    METRIC_ONLY(bool sample = (stats->metrics.read_pairs++ % METRICS_SAMPLE) == 0;)
+    METRIC_TIMER(t);
+
+    // ensure barcode is valid and in whitelist
+    METRIC_START(t, sample);
+    if (packed)
+    {
+        bc_id = find_bc_code(code, ctx->bc_index);
+        METRIC_STOP(&stats->metrics, STAGE_BARCODE, t, sample);
+    } else {
+        // barcodes with an 'N' can only be corrected at the position of that 'N', and only if it is the only one
+        n_base = memchr(curr_bc, 'N', BC_LEN);
+        if (memchr(n_base + 1, 'N', BC_LEN - (n_base - curr_bc) - 1) != NULL)
+        {
+            return false;
+        }
+    }
+
+    // allow for single mismatch at low quality basecall in barcode using the precomputed neighbor index
+    if (bc_id == -1)
+    {
+        METRIC_START(t, sample);
+        bc_id = correct_bc(code, rp->r1_quals + geometry->bc_first, (n_base != NULL) ? (int) (n_base - curr_bc) : -1, ctx->bc_index);
+        METRIC_STOP(&stats->metrics, STAGE_CORRECT, t, sample);
+        if (bc_id == BC_AMBIGUOUS)
+        {
+            stats->ambiguous_barcodes += shard_zero;
+            return false;
+        }
+        corrected = bc_id != -1;
+    }
+    if (bc_id == -1)
+    {
+        return false;
+    }
+    // a sharded run skips the barcodes of other shards and takes over the read count of its own barcodes from shard 0
+    if (ctx->shard_count > 1)
+    {
+        if (bc_shard(ctx->bc_index->codes[bc_id], ctx->shard_count) != ctx->shard_index)
+        {
+            stats->total_reads -= shard_zero;
+            return false;
+        }
+        stats->total_reads += !shard_zero;
+    }
+    // update valid barcode count
+    stats->corrected_barcodes += corrected;
+    stats->valid_barcodes++;
+
+    // ensure read2 seq is in the taglist
+    METRIC_START(t, sample);
+    if (geometry->tag_window == 0)
+    {
+        tag_index = get_tag_index(rp->r2_seq + geometry->tag_first, ctx->tag_index);
+    } else {
+        int tag_pos;
+        tag_index = find_tag_index(rp->r2_seq, rp->r2_len, geometry->tag_first, geometry->tag_window, ctx->tag_index, &tag_pos);
+        if (tag_index != -1 && tag_pos != geometry->tag_first)
+        {
+            stats->shifted_tags++;
+        }
+    }
+    METRIC_STOP(&stats->metrics, STAGE_TAG, t, sample);
+    if (tag_index == -1)
+    {
+        return false;
+    }
+    stats->valid_tags++;
+
+    // UMIs with an 'N' are not counted
+    METRIC_START(t, sample);
+    bool umi_valid = pack_umi(rp->r1_seq + geometry->umi_first, geometry->umi_len, &umi);
+    METRIC_STOP(&stats->metrics, STAGE_UMI, t, sample);
+    if (!umi_valid)
+    {
+        return false;
+    }
+    *key = umi_key(bc_id, tag_index, umi);
+    return true;
+}
+
+// worker thread: validate the read pairs of each batch without locking, then add the UMI keys of the batch to the lane UMI set under the lane lock
+static void* worker_thread(void* arg)
+{
+    pipeline* p = arg;
+    count_ctx* ctx = p->ctx;
+    lane_job* job = p->job;
+    count_stats stats = {0};
+    METRIC_TIMER(t);
+    uint64_t *hits = malloc(sizeof(uint64_t) * BATCH_READS);
+    int n_hits;
+    read_batch* batch = NULL;
+
+    uint32_t codes[LOOKUP_BATCH_MAX];
+    bool packed[LOOKUP_BATCH_MAX];
+
+    while ((batch = pop_batch(&p->full_batches)) != NULL)
+    {
+        n_hits = 0;
+        for (int g = 0; g < batch->n_reads; g += ctx->lookup_batch)
+        {
+            int n = (batch->n_reads - g < ctx->lookup_batch) ? batch->n_reads - g : ctx->lookup_batch;
+            // pack the barcodes of a group of reads and prefetch their whitelist slots, then look them up once the slots are arriving
+            for (int r = 0; r < n; r++)
+            {
+                const read_pair* rp = &batch->reads[g + r];
+                packed[r] = rp->r1_seq != NULL && pack_bc(rp->r1_seq + ctx->geometry.bc_first, &codes[r]);
+                if (packed[r] && n > 1)
+                {
+                    prefetch_bc_code(codes[r], ctx->bc_index);
+                }
+            }
+            for (int r = 0; r < n; r++)
+            {
+                if (process_read_pair(&batch->reads[g + r], codes[r], packed[r], ctx, &hits[n_hits], &stats))
+                {
+                    n_hits++;
+                }
+            }
+        }
+        // the fastq blocks and the batch buffer can be reused as soon as the reads have been parsed
+        fq_release_block(p->pinR1, batch->r1_block);
+        fq_release_block(p->pinR2, batch->r2_block);
+        push_batch(&p->free_batches, batch);
+
+        // in sort mode, keys are deduplicated when the sorted runs are merged
+        METRIC_START(t, true);
+        if (ctx->spill != NULL)
+        {
+            if (!spill_keys(ctx->spill, hits, n_hits))
+            {
+                printf("Failed to write sorted UMI run to %s. Exiting...\n", ctx->spill->dir);
+                exit(32);
+            }
+            METRIC_STOP(&stats.metrics, STAGE_DEDUP, t, true);
+            continue;
+        }
+
+        // tag counts are credited when the lane UMI set is merged, so UMIs seen in several lanes are only counted once
+        pthread_mutex_lock(&job->lock);
+        add_umis(&job->umis, hits, n_hits, ctx->lookup_batch);
+        pthread_mutex_unlock(&job->lock);
+        METRIC_STOP(&stats.metrics, STAGE_DEDUP, t, true);
+    }
+
+    // add per thread statistics to the lane totals
+    pthread_mutex_lock(&job->lock);
+    job->stats.total_reads += stats.total_reads;
+    job->stats.valid_barcodes += stats.valid_barcodes;
+    job->stats.corrected_barcodes += stats.corrected_barcodes;
+    job->stats.valid_tags += stats.valid_tags;
+    job->stats.ambiguous_barcodes += stats.ambiguous_barcodes;
+    job->stats.shifted_tags += stats.shifted_tags;
+    METRIC_ONLY(merge_stage_metrics(&job->stats.metrics, &stats.metrics);)
+    pthread_mutex_unlock(&job->lock);
+
+    free(hits);
+    return NULL;
+}
+
+// Initialize lane job "job" for fastq pair "path1"/"path2", or interleaved fastq "path1" if "path2" is NULL, with an empty UMI set.
+// If "count_reads" is true the UMI set also counts the reads of every UMI for collapsing.
+void init_lane_job(lane_job* job, const char *path1, const char *path2, bool count_reads)
+{
+    job->path1 = path1;
+    job->path2 = path2;
+    job->checkpoint = NULL;
+    job->resumed = false;
+    if (!init_umi_set(&job->umis, count_reads))
+    {
+        printf("Failed to allocate memory for UMIs. Exiting...\n");
+        exit(30);
+    }
+    memset(&job->stats, 0, sizeof(count_stats));
+    METRIC_ONLY(memset(&job->metrics, 0, sizeof(lane_metrics));)
+    job->status = 0;
+    pthread_mutex_init(&job->lock, NULL);
+}
+
+// Release the lock held by lane job "job". Does not unload its UMI set.
+void free_lane_job(lane_job* job)
+{
+    pthread_mutex_destroy(&job->lock);
+}
+
+// Process every read pair in the open fastq readers "pinR1" and "pinR2" using one reader thread and "threads" worker threads.
+// UMIs and summary statistics are accumulated into "job". Returns true if successful, else returns false.
+bool count_fastq_pair(fq_reader* pinR1, fq_reader* pinR2, count_ctx* ctx, lane_job* job, int threads)
+{
+    pipeline p;
+    pthread_t reader;
+    pthread_t workers[MAX_THREADS];
+    int started = 0;
+
+    p.pinR1 = pinR1;
+    p.pinR2 = pinR2;
+    p.mismatched = false;
+    p.ctx = ctx;
+    p.job = job;
+    METRIC_ONLY(memset(&p.reader_metrics, 0, sizeof(stage_metrics));)
+    init_queue(&p.free_batches);
+    init_queue(&p.full_batches);
+
+    // allocate enough batches to keep every worker busy while the reader fills the next ones
+    for (int b = 0; b < 2 * threads + 2; b++)
+    {
+        read_batch* batch = malloc(sizeof(read_batch));
+        if (batch == NULL)
+        {
+            printf("Failed to allocate read batch\n");
+            destroy_queue(&p.free_batches);
+            destroy_queue(&p.full_batches);
+            return false;
+        }
+        push_batch(&p.free_batches, batch);
+    }
+
+    if (pthread_create(&reader, NULL, reader_thread, &p) != 0)
+    {
+        printf("Failed to create reader thread\n");
+        destroy_queue(&p.free_batches);
+        destroy_queue(&p.full_batches);
+        return false;
+    }
+    for (int w = 0; w < threads; w++)
+    {
+        if (pthread_create(&workers[w], NULL, worker_thread, &p) != 0)
+        {
+            printf("Failed to create worker thread %i, continuing with %i worker threads\n", w + 1, started);
+            break;
+        }
+        started++;
+    }
+    // if no worker could be started the reader would wait forever for a free batch, process the batches on this thread instead
+    if (started == 0)
+    {
+        worker_thread(&p);
+    }
+
+    pthread_join(reader, NULL);
+    for (int w = 0; w < started; w++)
+    {
+        pthread_join(workers[w], NULL);
+    }
+    METRIC_ONLY(merge_stage_metrics(&job->stats.metrics, &p.reader_metrics);)
+    if (p.mismatched)
+    {
+        job->status = 46;
+    }
+
+    destroy_queue(&p.free_batches);
+    destroy_queue(&p.full_batches);
+    return true;
+}
+
+// define lane_pool struct for the state shared by the threads running fastq pairs concurrently
+typedef struct lane_pool {
+    lane_job* jobs;
+    int n_jobs;
+    int next_job;
+    int workers;
+    count_ctx* ctx;
+    pthread_mutex_t lock;
+} lane_pool;
+
+// run a single fastq pair from start to finish, recording any failure in the job status, and write its checkpoint if it has one.
+// An interleaved fastq ("path2" is NULL) is read through a single reader that returns read1 and read2 in turn.
+static void run_lane(lane_job* job, count_ctx* ctx, int workers)
+{
+    METRIC_ONLY(double start = metric_now();)
+    bool interleaved = (job->path2 == NULL);
+    fq_reader* pinR1 = interleaved ? fq_open_interleaved(job->path1) : fq_open(job->path1);
+    fq_reader* pinR2 = interleaved ? pinR1 : fq_open(job->path2);
+
+    // ensure all fastq readers are valid
+    if (pinR1 == NULL || pinR2 == NULL)
+    {
+        job->status = (pinR1 == NULL) ? 22 : 23;
+    }
+    else if (!count_fastq_pair(pinR1, pinR2, ctx, job, workers))
+    {
+        job->status = 28;
+    }
+    // ensure both fastq files were decompressed to the end
+    else if (fq_failed(pinR1) || fq_failed(pinR2))
+    {
+        job->status = 29;
+    }
+    // a failed checkpoint only costs the ability to resume this pair
+    else if (job->status == 0 && job->checkpoint != NULL && !write_checkpoint(job->checkpoint, job, ctx->run_id))
+    {
+        printf("Failed to write checkpoint %s, continuing without it\n", job->checkpoint);
+    }
+#ifdef BARCOUNTER_METRICS
+    job->metrics.seconds = metric_now() - start;
+    if (pinR1 != NULL && pinR2 != NULL)
+    {
+        job->metrics.r1 = pinR1->metrics;
+        if (!interleaved)
+        {
+            job->metrics.r2 = pinR2->metrics;
+        }
+    }
+#endif
+    if (pinR1 != NULL)
+    {
+        fq_close(pinR1);
+    }
+    if (pinR2 != NULL && !interleaved)
+    {
+        fq_close(pinR2);
+    }
+}
+
+// lane thread: take the next unprocessed fastq pair from the pool until none are left
+static void* lane_thread(void* arg)
+{
+    lane_pool* pool = arg;
+    int j;
+
+    while (true)
+    {
+        pthread_mutex_lock(&pool->lock);
+        j = pool->next_job++;
+        pthread_mutex_unlock(&pool->lock);
+        if (j >= pool->n_jobs)
+        {
+            break;
+        }
+        if (pool->jobs[j].resumed)
+        {
+            continue;
+        }
+        run_lane(&pool->jobs[j], pool->ctx, pool->workers);
+    }
+    return NULL;
+}
+
+// Process the "n_jobs" fastq pairs in "jobs" concurrently, skipping pairs resumed from a checkpoint. Up to "threads" pairs run at once and the "threads" worker threads are divided between them.
+// Each job records its own UMI set, statistics and status; the caller merges them in order.
+void count_fastq_lanes(lane_job* jobs, int n_jobs, count_ctx* ctx, int threads)
+{
+    lane_pool pool;
+    pthread_t lanes[MAX_THREADS];
+    int pending = 0;
+    int started = 0;
+
+    for (int j = 0; j < n_jobs; j++)
+    {
+        pending += !jobs[j].resumed;
+    }
+    if (pending == 0)
+    {
+        return;
+    }
+    int concurrent = pending < threads ? pending : threads;
+
+    pool.jobs = jobs;
+    pool.n_jobs = n_jobs;
+    pool.next_job = 0;
+    pool.workers = threads / concurrent;
+    pool.ctx = ctx;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    // a single concurrent pair runs on this thread
+    for (int l = 1; l < concurrent; l++)
+    {
+        if (pthread_create(&lanes[started], NULL, lane_thread, &pool) != 0)
+        {
+            printf("Failed to create lane thread, continuing with %i concurrent fastq pairs\n", started + 1);
+            break;
+        }
+        started++;
+    }
+    lane_thread(&pool);
+    for (int l = 0; l < started; l++)
+    {
+        pthread_join(lanes[l], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+}
@@ -0,0 +1,129 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "fastq.h"
+#include "barcodes.h"
+#include "tags.h"
+#include "umis.h"
+#include "chemistry.h"
+#include "spill.h"
+#include "metrics.h"
+
+// set the maximum number of worker threads
+#define MAX_THREADS 256
+
+// set the maximum number of shards a run can be split into
+#define MAX_SHARDS 1024
+
+// set the default and maximum number of read pairs whose whitelist and UMI set lookups are prefetched together
+#define LOOKUP_BATCH_DEFAULT 32
+#define LOOKUP_BATCH_MAX 64
+
+// set the number of read pairs handed from the reader thread to a worker thread at once
+#define BATCH_READS 4096
+
+// define read_pair struct pointing at the read1 sequence and qualities and the read2 sequence (of length "r2_len") of a single read pair inside the decompressed fastq blocks.
+// Lines are not copied or NUL terminated; each is followed by a newline, so reads of any length are supported.
+// "r1_seq" is NULL if either read is too short to hold the barcode, UMI or tag of the read geometry.
+typedef struct read_pair {
+    const char *r1_seq;
+    const char *r1_quals;
+    const char *r2_seq;
+    int r2_len;
+} read_pair;
+
+// define read_batch struct for a block of read pairs passed between the reader and worker threads.
+// Every read pair of a batch lies in "r1_block" and "r2_block", which the batch holds a reference to until its reads have been counted.
+typedef struct read_batch {
+    int n_reads;
+    fq_block* r1_block;
+    fq_block* r2_block;
+    read_pair reads[BATCH_READS];
+    struct read_batch* next;
+} read_batch;
+
+// define batch_queue struct, a blocking FIFO of read batches. "closed" is set once no more batches will be pushed
+typedef struct batch_queue {
+    read_batch* head;
+    read_batch* tail;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} batch_queue;
+
+// define count_stats struct for the summary statistics reported at the end of a run.
+// "shifted_tags" counts the valid tags found away from the expected offset by the tag window search.
+// Builds with BARCOUNTER_METRICS also accumulate stage timings in "metrics".
+typedef struct count_stats {
+    unsigned long long int total_reads;
+    unsigned long long int valid_barcodes;
+    unsigned long long int corrected_barcodes;
+    unsigned long long int valid_tags;
+    unsigned long long int ambiguous_barcodes;
+    unsigned long long int shifted_tags;
+#ifdef BARCOUNTER_METRICS
+    stage_metrics metrics;
+#endif
+} count_stats;
+
+// define count_ctx struct holding the read only lookup structures shared by all lanes and worker threads.
+// If "spill" is not NULL, UMI keys are appended to it for sort based deduplication instead of being added to the lane UMI sets.
+// "geometry" gives the positions of the barcode, UMI and tag in each read pair. "run_id" identifies the run settings in checkpoint files.
+// A run split into "shard_count" shards only counts the barcodes whose bc_shard is "shard_index"; an unsharded run has one shard.
+// Workers look up "lookup_batch" read pairs at a time, prefetching their whitelist and UMI set slots first; 1 looks up one read pair at a time.
+typedef struct count_ctx {
+    const bc_index* bc_index;
+    const tag_index* tag_index;
+    int t_count;
+    key_spill* spill;
+    read_geometry geometry;
+    uint64_t run_id;
+    int shard_index;
+    int shard_count;
+    int lookup_batch;
+} count_ctx;
+
+// define lane_job struct for one read1/read2 fastq pair, or one interleaved fastq if "path2" is NULL. Each pair is deduplicated into its own UMI set "umis".
+// "status" is 0 if the pair was processed successfully, otherwise the program exit code describing the failure.
+// "lock" guards "umis" and "stats" while the pair is being processed. Builds with BARCOUNTER_METRICS record file sizes and timings of the pair in "metrics".
+// If "checkpoint" is not NULL the UMI set and statistics are written to that checkpoint file once the pair is processed. "resumed" is set
+// when they were loaded from a checkpoint instead, and the pair is not processed again.
+typedef struct lane_job {
+    const char *path1;
+    const char *path2;
+    const char *checkpoint;
+    bool resumed;
+    umi_set umis;
+    count_stats stats;
+    int status;
+    pthread_mutex_t lock;
+#ifdef BARCOUNTER_METRICS
+    lane_metrics metrics;
+#endif
+} lane_job;
+
+// Initialize lane job "job" for fastq pair "path1"/"path2", or interleaved fastq "path1" if "path2" is NULL, with an empty UMI set.
+// If "count_reads" is true the UMI set also counts the reads of every UMI for collapsing.
+void init_lane_job(lane_job* job, const char *path1, const char *path2, bool count_reads);
+
+// Release the lock held by lane job "job". Does not unload its UMI set.
+void free_lane_job(lane_job* job);
+
+// Process every read pair in the open fastq readers "pinR1" and "pinR2" using one reader thread and "threads" worker threads.
+// UMIs and summary statistics are accumulated into "job". Returns true if successful, else returns false.
+// If one fastq file holds more records than the other, the job status is set to 46.
+bool count_fastq_pair(fq_reader* pinR1, fq_reader* pinR2, count_ctx* ctx, lane_job* job, int threads);
+
+// Process the "n_jobs" fastq pairs in "jobs" concurrently, skipping pairs resumed from a checkpoint. Up to "threads" pairs run at once and the "threads" worker threads are divided between them.
+// Each job records its own UMI set, statistics and status; the caller merges them in order.
+void count_fastq_lanes(lane_job* jobs, int n_jobs, count_ctx* ctx, int threads);
+
+#endif // PIPELINE_H
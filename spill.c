@@ -0,0 +1,464 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "spill.h"
+#include "umis.h"
+#include "collapse.h"
+#include "counts.h"
+
+// set the minimum number of keys read at once from each sorted run while merging
+#define SPILL_MIN_READ 1024
+
+// define run_cursor struct for reading one sorted run during the merge
+typedef struct run_cursor {
+    FILE *fp;
+    uint64_t *buf;
+    size_t n;
+    size_t pos;
+} run_cursor;
+
+// define run_merge struct for the "n_runs" sorted runs merged in one pass, with a min-heap of the "n_heap" runs that still have keys
+typedef struct run_merge {
+    run_cursor cursors[SPILL_MAX_FANIN];
+    run_cursor* heap[SPILL_MAX_FANIN];
+    int n_runs;
+    int n_heap;
+    size_t max_read;
+} run_merge;
+
+// format the path of run number "run" in "path"
+static void run_path(const key_spill* spill, int run, char *path)
+{
+    snprintf(path, SPILL_PATH_LEN + 32, "%srun_%05i.bin", spill->dir, run);
+}
+
+// Sort "n" keys in place with a least significant digit radix sort, using "scratch" (room for "n" keys) as the second buffer.
+// Byte positions that are equal in every key are skipped.
+void radix_sort_keys(uint64_t *keys, uint64_t *scratch, size_t n)
+{
+    size_t counts[256];
+    uint64_t all_and = ~0ULL;
+    uint64_t all_or = 0;
+    uint64_t *src = keys;
+    uint64_t *dst = scratch;
+    uint64_t *temp = NULL;
+
+    for (size_t k = 0; k < n; k++)
+    {
+        all_and &= keys[k];
+        all_or |= keys[k];
+    }
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        // skip bytes that do not differ between keys
+        if ((((all_and ^ all_or) >> shift) & 0xff) == 0)
+        {
+            continue;
+        }
+        memset(counts, 0, sizeof(counts));
+        for (size_t k = 0; k < n; k++)
+        {
+            counts[(src[k] >> shift) & 0xff]++;
+        }
+        size_t total = 0;
+        for (int b = 0; b < 256; b++)
+        {
+            size_t c = counts[b];
+            counts[b] = total;
+            total += c;
+        }
+        for (size_t k = 0; k < n; k++)
+        {
+            dst[counts[(src[k] >> shift) & 0xff]++] = src[k];
+        }
+        temp = src;
+        src = dst;
+        dst = temp;
+    }
+    if (src != keys)
+    {
+        memcpy(keys, src, n * sizeof(uint64_t));
+    }
+}
+
+// sort the "n" keys of "keys", drop duplicates unless they are kept as read counts for collapsing, and write them to run file number "run".
+// Uses the scratch buffer of "spill", which only the thread writing a run touches, and is called without the lock held.
+static bool write_run(key_spill* spill, uint64_t *keys, size_t n, int run)
+{
+    char path[SPILL_PATH_LEN + 32];
+    size_t unique = 0;
+
+    radix_sort_keys(keys, spill->scratch, n);
+    for (size_t k = 0; k < n; k++)
+    {
+        if (unique == 0 || keys[k] != keys[unique - 1] || spill->collapse_len != 0)
+        {
+            keys[unique++] = keys[k];
+        }
+    }
+
+    run_path(spill, run, path);
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        printf("Could not create temporary file %s\n", path);
+        return false;
+    }
+    if (fwrite(keys, sizeof(uint64_t), unique, fp) != unique)
+    {
+        printf("Could not write temporary file %s\n", path);
+        fclose(fp);
+        return false;
+    }
+    if (fclose(fp) != 0)
+    {
+        printf("Could not write temporary file %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+// Initialize sort based deduplication with temporary directory "dir" (created if needed) and a memory budget of "budget_mb" megabytes.
+// If "collapse_len" is not 0, UMIs of that length are collapsed with directional adjacency instead of only being deduplicated. Returns true if successful, else returns false.
+bool init_key_spill(key_spill* spill, const char *dir, size_t budget_mb, int collapse_len)
+{
+    struct stat st;
+
+    snprintf(spill->dir, SPILL_PATH_LEN, "%s", dir);
+    if (stat(spill->dir, &st) == -1 && mkdir(spill->dir, 0777) != 0)
+    {
+        printf("Could not create temporary directory %s\n", spill->dir);
+        return false;
+    }
+    // the sort buffer being filled, the spare buffer being written and its radix sort scratch space share the budget
+    spill->budget = budget_mb * 1024 * 1024;
+    spill->max_keys = spill->budget / (3 * sizeof(uint64_t));
+    spill->buffer = malloc(spill->max_keys * sizeof(uint64_t));
+    spill->spare = malloc(spill->max_keys * sizeof(uint64_t));
+    spill->scratch = malloc(spill->max_keys * sizeof(uint64_t));
+    spill->n_keys = 0;
+    spill->n_runs = 0;
+    spill->collapse_len = collapse_len;
+    spill->collapsed = 0;
+    pthread_mutex_init(&spill->lock, NULL);
+    pthread_cond_init(&spill->ready, NULL);
+    return spill->buffer != NULL && spill->spare != NULL && spill->scratch != NULL;
+}
+
+// Append "n" UMI keys to the spill buffer, writing a sorted run to disk whenever the buffer is full. Returns true if successful, else returns false.
+// The full buffer is swapped for the spare buffer under the lock and written outside it, so only threads that fill the new buffer before the run is written wait.
+bool spill_keys(key_spill* spill, const uint64_t *keys, size_t n)
+{
+    bool success = true;
+    size_t copy;
+
+    pthread_mutex_lock(&spill->lock);
+    while (n > 0 && success)
+    {
+        // wait for the run being written if the buffer is full again
+        while (spill->n_keys == spill->max_keys && spill->spare == NULL)
+        {
+            pthread_cond_wait(&spill->ready, &spill->lock);
+        }
+        if (spill->n_keys == spill->max_keys)
+        {
+            uint64_t *full = spill->buffer;
+            int run = spill->n_runs++;
+            spill->buffer = spill->spare;
+            spill->spare = NULL;
+            spill->n_keys = 0;
+            pthread_mutex_unlock(&spill->lock);
+            success = write_run(spill, full, spill->max_keys, run);
+            pthread_mutex_lock(&spill->lock);
+            spill->spare = full;
+            pthread_cond_broadcast(&spill->ready);
+            continue;
+        }
+        copy = spill->max_keys - spill->n_keys;
+        if (copy > n)
+        {
+            copy = n;
+        }
+        memcpy(spill->buffer + spill->n_keys, keys, copy * sizeof(uint64_t));
+        spill->n_keys += copy;
+        keys += copy;
+        n -= copy;
+    }
+    pthread_mutex_unlock(&spill->lock);
+    return success;
+}
+
+// read the next block of keys of a run into its cursor. Returns false when the run is exhausted.
+static bool refill_cursor(run_cursor* c, size_t max_read)
+{
+    c->n = fread(c->buf, sizeof(uint64_t), max_read, c->fp);
+    c->pos = 0;
+    return c->n > 0;
+}
+
+// restore the min-heap property of the run heap "heap" of "n" cursors from position "i" down
+static void sift_down(run_cursor** heap, int n, int i)
+{
+    while (true)
+    {
+        int smallest = i;
+        int l = 2 * i + 1;
+        int r = 2 * i + 2;
+        if (l < n && heap[l]->buf[heap[l]->pos] < heap[smallest]->buf[heap[smallest]->pos])
+        {
+            smallest = l;
+        }
+        if (r < n && heap[r]->buf[heap[r]->pos] < heap[smallest]->buf[heap[smallest]->pos])
+        {
+            smallest = r;
+        }
+        if (smallest == i)
+        {
+            return;
+        }
+        run_cursor* temp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = temp;
+        i = smallest;
+    }
+}
+
+// collapse the UMIs of the barcode/tag combination of UMI key "key" in "group" and add one tag count in "counts" for every molecule
+static void flush_group(key_spill* spill, umi_group* group, uint64_t key, count_matrix* counts)
+{
+    uint32_t n = group->n;
+    uint32_t molecules = collapse_umi_group(group, spill->collapse_len);
+    for (uint32_t m = 0; m < molecules; m++)
+    {
+        add_count(counts, umi_key_bc(key), umi_key_tag(key));
+    }
+    spill->collapsed += n - molecules;
+}
+
+// open the "count" sorted runs starting at run number "first" for merging with read buffers of "max_read" keys. Returns true if successful, else returns false.
+static bool open_runs(const key_spill* spill, run_merge* m, int first, int count, size_t max_read)
+{
+    char path[SPILL_PATH_LEN + 32];
+    bool success = true;
+
+    memset(m, 0, sizeof(run_merge));
+    m->max_read = max_read;
+    for (int r = 0; r < count && success; r++)
+    {
+        run_cursor* c = &m->cursors[m->n_runs++];
+        run_path(spill, first + r, path);
+        c->fp = fopen(path, "rb");
+        c->buf = malloc(max_read * sizeof(uint64_t));
+        if (c->fp == NULL || c->buf == NULL)
+        {
+            printf("Could not read temporary file %s\n", path);
+            success = false;
+        }
+        else if (refill_cursor(c, max_read))
+        {
+            m->heap[m->n_heap++] = c;
+        }
+    }
+    for (int i = m->n_heap / 2 - 1; i >= 0; i--)
+    {
+        sift_down(m->heap, m->n_heap, i);
+    }
+    return success;
+}
+
+// pop the smallest key of the runs in "m" into "key". Returns false once every run is exhausted.
+static bool next_run_key(run_merge* m, uint64_t *key)
+{
+    if (m->n_heap == 0)
+    {
+        return false;
+    }
+    run_cursor* top = m->heap[0];
+    *key = top->buf[top->pos++];
+    if (top->pos == top->n && !refill_cursor(top, m->max_read))
+    {
+        m->heap[0] = m->heap[--m->n_heap];
+    }
+    sift_down(m->heap, m->n_heap, 0);
+    return true;
+}
+
+// close the runs of "m" and free their read buffers. Returns false if any run could not be read to the end.
+static bool close_runs(run_merge* m)
+{
+    bool success = true;
+    for (int r = 0; r < m->n_runs; r++)
+    {
+        if (m->cursors[r].fp != NULL)
+        {
+            success = !ferror(m->cursors[r].fp) && success;
+            fclose(m->cursors[r].fp);
+        }
+        free(m->cursors[r].buf);
+    }
+    return success;
+}
+
+// Returns the number of keys of each of "buffers" merge read and write buffers sharing the memory budget of "spill"
+static size_t merge_read_size(const key_spill* spill, int buffers)
+{
+    size_t max_read = spill->budget / sizeof(uint64_t) / buffers;
+    return (max_read < SPILL_MIN_READ) ? SPILL_MIN_READ : max_read;
+}
+
+// merge the "count" sorted runs starting at run number "first" into the new run number "out", then remove them.
+// Duplicate keys are dropped unless they are kept as read counts for collapsing. Returns true if successful, else returns false.
+static bool merge_run_pass(const key_spill* spill, int first, int count, int out)
+{
+    char path[SPILL_PATH_LEN + 32];
+    run_merge m;
+    uint64_t key;
+    uint64_t last = 0;
+    size_t n = 0;
+    size_t max_read = merge_read_size(spill, count + 1);
+
+    memset(&m, 0, sizeof(run_merge));
+    run_path(spill, out, path);
+    FILE *fp = fopen(path, "wb");
+    uint64_t *buf = malloc(max_read * sizeof(uint64_t));
+    bool success = fp != NULL && buf != NULL && open_runs(spill, &m, first, count, max_read);
+    while (success && next_run_key(&m, &key))
+    {
+        if (key != last || spill->collapse_len != 0)
+        {
+            buf[n++] = key;
+        }
+        last = key;
+        if (n == max_read)
+        {
+            success = fwrite(buf, sizeof(uint64_t), n, fp) == n;
+            n = 0;
+        }
+    }
+    success = success && fwrite(buf, sizeof(uint64_t), n, fp) == n;
+    if (fp != NULL)
+    {
+        success = (fclose(fp) == 0) && success;
+        success = close_runs(&m) && success;
+    }
+    if (!success)
+    {
+        printf("Could not merge temporary runs into %s\n", path);
+    }
+    free(buf);
+
+    for (int r = first; r < first + count; r++)
+    {
+        run_path(spill, r, path);
+        remove(path);
+    }
+    return success;
+}
+
+// Write the remaining keys, merge all sorted runs, SPILL_MAX_FANIN at a time, and add one tag count in "counts" for every unique barcode/UMI/tag combination,
+// or for every molecule left after collapsing each barcode/tag combination. Returns true if successful, else returns false.
+bool merge_key_spill(key_spill* spill, count_matrix* counts)
+{
+    bool success = true;
+    uint64_t key;
+    uint64_t last = 0;
+    umi_group group;
+    run_merge m;
+    int first = 0;
+
+    if (spill->n_keys > 0 && !write_run(spill, spill->buffer, spill->n_keys, spill->n_runs++))
+    {
+        return false;
+    }
+    spill->n_keys = 0;
+    // release the sort buffers so the merge read buffers fit in the same budget
+    free(spill->buffer);
+    free(spill->spare);
+    free(spill->scratch);
+    spill->buffer = NULL;
+    spill->spare = NULL;
+    spill->scratch = NULL;
+    if (spill->n_runs == 0)
+    {
+        return true;
+    }
+
+    // merge the oldest runs into new runs until the rest can be merged at once, so at most SPILL_MAX_FANIN runs are open
+    while (spill->n_runs - first > SPILL_MAX_FANIN)
+    {
+        if (!merge_run_pass(spill, first, SPILL_MAX_FANIN, spill->n_runs))
+        {
+            return false;
+        }
+        first += SPILL_MAX_FANIN;
+        spill->n_runs++;
+    }
+
+    if (!init_umi_group(&group))
+    {
+        return false;
+    }
+    success = open_runs(spill, &m, first, spill->n_runs - first, merge_read_size(spill, spill->n_runs - first));
+
+    // pop keys in sorted order. Each run is already unique, so a key is new whenever it differs from the previous key.
+    // When collapsing, repeated keys are the reads of a UMI and each barcode/tag combination is collapsed once all of its UMIs have been read.
+    while (success && next_run_key(&m, &key))
+    {
+        if (spill->collapse_len == 0)
+        {
+            if (key != last)
+            {
+                add_count(counts, umi_key_bc(key), umi_key_tag(key));
+            }
+        }
+        else if (key == last)
+        {
+            group.reads[group.n - 1]++;
+        } else {
+            if (group.n > 0 && !umi_key_same_group(key, last))
+            {
+                flush_group(spill, &group, last, counts);
+            }
+            success = add_group_umi(&group, umi_key_umi(key), 1);
+        }
+        last = key;
+    }
+    success = close_runs(&m) && success;
+    if (success && group.n > 0)
+    {
+        flush_group(spill, &group, last, counts);
+    }
+    free_umi_group(&group);
+    return success;
+}
+
+// Remove the temporary run files and directory and free the spill buffers.
+void free_key_spill(key_spill* spill)
+{
+    char path[SPILL_PATH_LEN + 32];
+    for (int r = 0; r < spill->n_runs; r++)
+    {
+        run_path(spill, r, path);
+        remove(path);
+    }
+    rmdir(spill->dir);
+    free(spill->buffer);
+    free(spill->spare);
+    free(spill->scratch);
+    spill->buffer = NULL;
+    spill->spare = NULL;
+    spill->scratch = NULL;
+    pthread_mutex_destroy(&spill->lock);
+    pthread_cond_destroy(&spill->ready);
+}
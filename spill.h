@@ -0,0 +1,66 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "counts.h"
+
+// set the default memory budget in megabytes for sort based UMI deduplication
+#define SPILL_DEFAULT_MB 1024
+
+// set the minimum memory budget in megabytes for sort based UMI deduplication
+#define SPILL_MIN_MB 16
+
+// set the maximum length of the temporary directory path
+#define SPILL_PATH_LEN 500
+
+// set the maximum number of sorted runs merged at once. More runs are merged in passes through intermediate runs, so the number of open files stays bounded.
+#define SPILL_MAX_FANIN 64
+
+// define key_spill struct for sort based UMI deduplication. UMI keys are appended to "buffer"; when it is full it is swapped with "spare" and the keys are
+// radix sorted, duplicates are dropped and the sorted run is written to "dir" without holding the lock, while other threads keep filling the new buffer.
+// "spare" is NULL while a run is being written. "budget" is the memory budget in bytes shared by the buffers of both phases.
+// If "collapse_len" is not 0, duplicates are kept as read counts and the UMIs of that length are collapsed while merging; "collapsed" counts the UMIs absorbed.
+// "lock" guards the buffers and run count while worker threads append keys, "ready" signals that the spare buffer is back.
+typedef struct key_spill {
+    char dir[SPILL_PATH_LEN];
+    size_t budget;
+    uint64_t *buffer;
+    uint64_t *spare;
+    uint64_t *scratch;
+    size_t n_keys;
+    size_t max_keys;
+    int n_runs;
+    int collapse_len;
+    unsigned long long int collapsed;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} key_spill;
+
+// Initialize sort based deduplication with temporary directory "dir" (created if needed) and a memory budget of "budget_mb" megabytes.
+// If "collapse_len" is not 0, UMIs of that length are collapsed with directional adjacency instead of only being deduplicated. Returns true if successful, else returns false.
+bool init_key_spill(key_spill* spill, const char *dir, size_t budget_mb, int collapse_len);
+
+// Append "n" UMI keys to the spill buffer, writing a sorted run to disk whenever the buffer is full. Returns true if successful, else returns false.
+bool spill_keys(key_spill* spill, const uint64_t *keys, size_t n);
+
+// Write the remaining keys, merge all sorted runs, SPILL_MAX_FANIN at a time, and add one tag count in "counts" for every unique barcode/UMI/tag combination,
+// or for every molecule left after collapsing each barcode/tag combination. Returns true if successful, else returns false.
+bool merge_key_spill(key_spill* spill, count_matrix* counts);
+
+// Remove the temporary run files and directory and free the spill buffers.
+void free_key_spill(key_spill* spill);
+
+// Sort "n" keys in place with a least significant digit radix sort, using "scratch" (room for "n" keys) as the second buffer.
+// Byte positions that are equal in every key are skipped.
+void radix_sort_keys(uint64_t *keys, uint64_t *scratch, size_t n);
+
+#endif // SPILL_H
@@ -0,0 +1,420 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "state.h"
+#include "umis.h"
+#include "collapse.h"
+#include "spill.h"
+#include "counts.h"
+
+// define state_cursor struct for reading the keys and read counts of one state file during a merge. "codes" holds the barcode table of the file,
+// "left" the number of keys not yet read into "keys" and "reads". The current key is split into its packed barcode "code" and the tag and UMI bits "low".
+typedef struct state_cursor {
+    FILE *fp_keys;
+    FILE *fp_reads;
+    uint32_t *codes;
+    uint64_t n_barcodes;
+    uint64_t *keys;
+    uint32_t *reads;
+    size_t n;
+    size_t pos;
+    uint64_t left;
+    uint32_t code;
+    uint64_t low;
+    bool error;
+} state_cursor;
+
+// Write the deduplicated UMIs of UMI set "set", which must count reads, to the state file "path" with the "t_count" tags and names of the run,
+// UMI length "umi_len", summary statistics "stats" and shard "shard_index" of "shard_count". Barcode IDs are resolved to packed barcodes with "index".
+// Returns true if successful, else returns false.
+bool write_state_file(const char *path, const umi_set* set, const bc_index* index, char tags[MAX_TAGS][TAG_LEN + 1], char names[MAX_TAGS][NAME_LEN + 1],
+    int t_count, int umi_len, const count_stats* stats, int shard_index, int shard_count)
+{
+    size_t n = set->n_keys;
+    size_t n_bc = 0;
+    size_t k = 0;
+    bool success;
+
+    // mark the counted barcodes, then number them in ascending order of their packed sequence
+    uint32_t *positions = malloc(((size_t) index->n_barcodes + 1) * sizeof(uint32_t));
+    if (positions == NULL)
+    {
+        return false;
+    }
+    memset(positions, 0xff, ((size_t) index->n_barcodes + 1) * sizeof(uint32_t));
+    for (uint64_t s = 0; s <= set->mask; s++)
+    {
+        if (set->keys[s] != 0 && positions[umi_key_bc(set->keys[s])] == UINT32_MAX)
+        {
+            positions[umi_key_bc(set->keys[s])] = 0;
+            n_bc++;
+        }
+    }
+    uint64_t *table = malloc((n_bc + 1) * sizeof(uint64_t));
+    uint64_t *keys = malloc((n + 1) * sizeof(uint64_t));
+    uint64_t *scratch = malloc(((n > n_bc ? n : n_bc) + 1) * sizeof(uint64_t));
+    uint32_t *buf = malloc(STATE_CHUNK * sizeof(uint32_t));
+    if (table == NULL || keys == NULL || scratch == NULL || buf == NULL)
+    {
+        free(positions);
+        free(table);
+        free(keys);
+        free(scratch);
+        free(buf);
+        return false;
+    }
+    for (uint32_t id = 0; id < index->n_barcodes; id++)
+    {
+        if (positions[id] != UINT32_MAX)
+        {
+            table[k++] = ((uint64_t) index->codes[id] << 32) | id;
+        }
+    }
+    radix_sort_keys(table, scratch, n_bc);
+    for (size_t p = 0; p < n_bc; p++)
+    {
+        positions[(uint32_t) table[p]] = (uint32_t) p;
+    }
+
+    // replace the barcode ID of every key with its barcode table position and sort the keys
+    k = 0;
+    for (uint64_t s = 0; s <= set->mask; s++)
+    {
+        if (set->keys[s] != 0)
+        {
+            keys[k++] = UMI_KEY_USED | ((uint64_t) positions[umi_key_bc(set->keys[s])] << UMI_KEY_BC_SHIFT) | (set->keys[s] & STATE_KEY_LOW_MASK);
+        }
+    }
+    radix_sort_keys(keys, scratch, n);
+    free(scratch);
+    free(positions);
+
+    state_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATE_MAGIC, sizeof(header.magic));
+    header.version = STATE_VERSION;
+    header.endian = 0x01020304;
+    header.bc_len = BC_LEN;
+    header.umi_len = (uint32_t) umi_len;
+    header.t_count = (uint32_t) t_count;
+    header.shard_index = (uint16_t) shard_index;
+    header.shard_count = (uint16_t) shard_count;
+    header.n_barcodes = n_bc;
+    header.n_keys = n;
+    header.stats[0] = stats->total_reads;
+    header.stats[1] = stats->valid_barcodes;
+    header.stats[2] = stats->corrected_barcodes;
+    header.stats[3] = stats->valid_tags;
+    header.stats[4] = stats->ambiguous_barcodes;
+    header.stats[5] = stats->shifted_tags;
+
+    FILE *fp = fopen(path, "wb");
+    success = fp != NULL && fwrite(&header, sizeof(header), 1, fp) == 1;
+    for (int t = 0; t < t_count && success; t++)
+    {
+        state_tag tag;
+        memset(&tag, 0, sizeof(tag));
+        strncpy(tag.seq, tags[t], TAG_LEN);
+        strncpy(tag.name, names[t], NAME_LEN);
+        success = fwrite(&tag, sizeof(tag), 1, fp) == 1;
+    }
+    // write the barcode table, the keys, then the read count of every key looked up by its original UMI key
+    for (size_t p = 0; p < n_bc && success; p += STATE_CHUNK)
+    {
+        size_t c = (n_bc - p < STATE_CHUNK) ? n_bc - p : STATE_CHUNK;
+        for (size_t i = 0; i < c; i++)
+        {
+            buf[i] = (uint32_t) (table[p + i] >> 32);
+        }
+        success = fwrite(buf, sizeof(uint32_t), c, fp) == c;
+    }
+    success = success && fwrite(keys, sizeof(uint64_t), n, fp) == n;
+    for (size_t p = 0; p < n && success; p += STATE_CHUNK)
+    {
+        size_t c = (n - p < STATE_CHUNK) ? n - p : STATE_CHUNK;
+        for (size_t i = 0; i < c; i++)
+        {
+            uint32_t id = (uint32_t) table[umi_key_bc(keys[p + i])];
+            buf[i] = get_umi_reads(set, UMI_KEY_USED | ((uint64_t) id << UMI_KEY_BC_SHIFT) | (keys[p + i] & STATE_KEY_LOW_MASK));
+        }
+        success = fwrite(buf, sizeof(uint32_t), c, fp) == c;
+    }
+    if (fp != NULL)
+    {
+        success = (fclose(fp) == 0) && success;
+    }
+    free(table);
+    free(keys);
+    free(buf);
+    return success;
+}
+
+// Read the header of state file "path" into "header" and its tags and names into "tags" and "names". Returns true if successful, else returns false.
+bool read_state_header(const char *path, state_header* header, char tags[MAX_TAGS][TAG_LEN + 1], char names[MAX_TAGS][NAME_LEN + 1])
+{
+    struct stat st;
+    state_tag tag;
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return false;
+    }
+    bool success = fread(header, sizeof(state_header), 1, fp) == 1 && memcmp(header->magic, STATE_MAGIC, sizeof(header->magic)) == 0
+        && header->version == STATE_VERSION && header->endian == 0x01020304 && header->t_count <= MAX_TAGS;
+    for (uint32_t t = 0; success && t < header->t_count; t++)
+    {
+        success = fread(&tag, sizeof(tag), 1, fp) == 1;
+        memcpy(tags[t], tag.seq, TAG_LEN + 1);
+        memcpy(names[t], tag.name, NAME_LEN + 1);
+        tags[t][TAG_LEN] = '\0';
+        names[t][NAME_LEN] = '\0';
+    }
+    // the file must hold exactly the barcode table, keys and read counts given in the header
+    success = success && fstat(fileno(fp), &st) == 0 && (uint64_t) st.st_size == sizeof(state_header) + header->t_count * sizeof(state_tag)
+        + header->n_barcodes * sizeof(uint32_t) + header->n_keys * (sizeof(uint64_t) + sizeof(uint32_t));
+    fclose(fp);
+    return success;
+}
+
+// move cursor "c" to the next key of its state file. Returns false when the file is exhausted or can't be read, which sets "error".
+static bool next_state_key(state_cursor* c)
+{
+    if (++c->pos >= c->n)
+    {
+        if (c->left == 0)
+        {
+            return false;
+        }
+        c->n = (c->left < STATE_CHUNK) ? (size_t) c->left : STATE_CHUNK;
+        if (fread(c->keys, sizeof(uint64_t), c->n, c->fp_keys) != c->n || fread(c->reads, sizeof(uint32_t), c->n, c->fp_reads) != c->n)
+        {
+            c->error = true;
+            return false;
+        }
+        c->left -= c->n;
+        c->pos = 0;
+    }
+    uint32_t p = umi_key_bc(c->keys[c->pos]);
+    if (p >= c->n_barcodes)
+    {
+        c->error = true;
+        return false;
+    }
+    c->code = c->codes[p];
+    c->low = c->keys[c->pos] & STATE_KEY_LOW_MASK;
+    return true;
+}
+
+// open state file "path" with the header "header" for merging into cursor "c" and read its first key. Returns true if successful, else returns false.
+static bool open_state_cursor(state_cursor* c, const char *path, const state_header* header)
+{
+    long keys_offset = (long) (sizeof(state_header) + header->t_count * sizeof(state_tag) + header->n_barcodes * sizeof(uint32_t));
+    memset(c, 0, sizeof(state_cursor));
+    c->fp_keys = fopen(path, "rb");
+    c->fp_reads = fopen(path, "rb");
+    c->codes = malloc((header->n_barcodes + 1) * sizeof(uint32_t));
+    c->keys = malloc(STATE_CHUNK * sizeof(uint64_t));
+    c->reads = malloc(STATE_CHUNK * sizeof(uint32_t));
+    c->n_barcodes = header->n_barcodes;
+    c->left = header->n_keys;
+    if (c->fp_keys == NULL || c->fp_reads == NULL || c->codes == NULL || c->keys == NULL || c->reads == NULL
+        || fseek(c->fp_keys, keys_offset - (long) (header->n_barcodes * sizeof(uint32_t)), SEEK_SET) != 0
+        || fread(c->codes, sizeof(uint32_t), header->n_barcodes, c->fp_keys) != header->n_barcodes
+        || fseek(c->fp_reads, keys_offset + (long) (header->n_keys * sizeof(uint64_t)), SEEK_SET) != 0)
+    {
+        c->error = true;
+        return false;
+    }
+    return true;
+}
+
+// close cursor "c" and free its buffers
+static void close_state_cursor(state_cursor* c)
+{
+    if (c->fp_keys != NULL)
+    {
+        fclose(c->fp_keys);
+    }
+    if (c->fp_reads != NULL)
+    {
+        fclose(c->fp_reads);
+    }
+    free(c->codes);
+    free(c->keys);
+    free(c->reads);
+}
+
+// Returns true if the current key of cursor "a" sorts before the current key of cursor "b"
+static inline bool cursor_less(const state_cursor* a, const state_cursor* b)
+{
+    return a->code < b->code || (a->code == b->code && a->low < b->low);
+}
+
+// restore the min-heap property of the cursor heap "heap" of "n" cursors from position "i" down
+static void sift_down_cursors(state_cursor** heap, int n, int i)
+{
+    while (true)
+    {
+        int smallest = i;
+        int l = 2 * i + 1;
+        int r = 2 * i + 2;
+        if (l < n && cursor_less(heap[l], heap[smallest]))
+        {
+            smallest = l;
+        }
+        if (r < n && cursor_less(heap[r], heap[smallest]))
+        {
+            smallest = r;
+        }
+        if (smallest == i)
+        {
+            return;
+        }
+        state_cursor* temp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = temp;
+        i = smallest;
+    }
+}
+
+// collapse the UMIs in "group" of barcode ID "bc_id" and tag index "t_index" and add one tag count in "counts" for every molecule
+static void flush_state_group(umi_group* group, int umi_len, count_matrix* counts, int bc_id, int t_index, unsigned long long int *collapsed)
+{
+    uint32_t n = group->n;
+    uint32_t molecules = collapse_umi_group(group, umi_len);
+    for (uint32_t m = 0; m < molecules; m++)
+    {
+        add_count(counts, (uint32_t) bc_id, t_index);
+    }
+    *collapsed += n - molecules;
+}
+
+// Merge the "n_files" state files "paths", which share a taglist and UMI length "umi_len", into "counts" (initialized here for "t_count" tags).
+// Combinations of barcode, tag and UMI found in several files are counted once, and with "directional" the UMIs of each barcode and tag are collapsed
+// using the read counts summed over all files; "collapsed" counts the UMIs absorbed. If "whitelist" is not NULL counts use its barcode IDs and barcodes
+// not in it are skipped and counted in "skipped"; otherwise every barcode is counted and numbered in ascending order in "merged", whose codes must be freed.
+// Returns true if successful, else returns false.
+bool merge_state_files(char **paths, int n_files, int t_count, int umi_len, bool directional, const bc_index* whitelist, bc_index* merged,
+    count_matrix* counts, unsigned long long int *collapsed, unsigned long long int *skipped)
+{
+    state_header header;
+    char tags[MAX_TAGS][TAG_LEN + 1];
+    char names[MAX_TAGS][NAME_LEN + 1];
+    uint64_t max_barcodes = 0;
+    bool success = true;
+    umi_group group;
+    int n_heap = 0;
+
+    *collapsed = 0;
+    *skipped = 0;
+    state_cursor* cursors = calloc(n_files, sizeof(state_cursor));
+    state_cursor** heap = malloc(sizeof(state_cursor*) * n_files);
+    if (cursors == NULL || heap == NULL || !init_umi_group(&group))
+    {
+        free(cursors);
+        free(heap);
+        return false;
+    }
+    for (int f = 0; f < n_files && success; f++)
+    {
+        success = read_state_header(paths[f], &header, tags, names) && open_state_cursor(&cursors[f], paths[f], &header);
+        max_barcodes += header.n_barcodes;
+        cursors[f].pos = SIZE_MAX;
+        if (success && next_state_key(&cursors[f]))
+        {
+            heap[n_heap++] = &cursors[f];
+        }
+        success = success && !cursors[f].error;
+    }
+
+    // without a whitelist, barcodes are numbered in the order they are merged, which is ascending order of their packed sequence
+    memset(merged, 0, sizeof(bc_index));
+    if (success && whitelist == NULL)
+    {
+        merged->codes = malloc((max_barcodes + 1) * sizeof(uint32_t));
+        success = merged->codes != NULL;
+    }
+    success = success && init_count_matrix(counts, whitelist != NULL ? whitelist->n_barcodes : (uint32_t) max_barcodes, t_count);
+    for (int i = n_heap / 2 - 1; i >= 0; i--)
+    {
+        sift_down_cursors(heap, n_heap, i);
+    }
+
+    // pop keys in sorted order. A key is new whenever it differs from the previous key; repeated keys add their reads to the last UMI of the group
+    uint32_t last_code = 0;
+    uint64_t last_low = 0;
+    bool first = true;
+    int bc_id = -1;
+    while (success && n_heap > 0)
+    {
+        state_cursor* c = heap[0];
+        uint32_t reads = c->reads[c->pos];
+        bool same_bc = !first && c->code == last_code;
+        bool same_key = same_bc && c->low == last_low;
+        bool same_tag = same_bc && (c->low >> UMI_KEY_TAG_SHIFT) == (last_low >> UMI_KEY_TAG_SHIFT);
+
+        if (directional && group.n > 0 && !same_tag)
+        {
+            flush_state_group(&group, umi_len, counts, bc_id, umi_key_tag(last_low), collapsed);
+        }
+        if (!same_bc)
+        {
+            if (whitelist != NULL)
+            {
+                bc_id = find_bc_code(c->code, whitelist);
+                *skipped += (bc_id == -1);
+            } else {
+                merged->codes[merged->n_barcodes] = c->code;
+                bc_id = (int) merged->n_barcodes++;
+            }
+        }
+        if (bc_id != -1)
+        {
+            if (!directional)
+            {
+                if (!same_key)
+                {
+                    add_count(counts, (uint32_t) bc_id, umi_key_tag(c->low));
+                }
+            }
+            else if (same_key)
+            {
+                group.reads[group.n - 1] += reads;
+            } else {
+                success = add_group_umi(&group, umi_key_umi(c->low), reads);
+            }
+        }
+        last_code = c->code;
+        last_low = c->low;
+        first = false;
+
+        if (!next_state_key(c))
+        {
+            success = success && !c->error;
+            heap[0] = heap[--n_heap];
+        }
+        sift_down_cursors(heap, n_heap, 0);
+    }
+    if (success && directional && group.n > 0)
+    {
+        flush_state_group(&group, umi_len, counts, bc_id, umi_key_tag(last_low), collapsed);
+    }
+
+    for (int f = 0; f < n_files; f++)
+    {
+        close_state_cursor(&cursors[f]);
+    }
+    free_umi_group(&group);
+    free(cursors);
+    free(heap);
+    return success;
+}
@@ -0,0 +1,73 @@
+/*
+Code written by Elliott Swanson of the Allen Institute for Immunology (elliott.swanson@alleninstitute.org). Free for academic use only.
+See LICENSE for code reuse permissions.
+*/
+
+#ifndef STATE_H
+#define STATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "barcodes.h"
+#include "tags.h"
+#include "umis.h"
+#include "counts.h"
+#include "pipeline.h"
+
+// set the file extension of state files
+#define STATE_EXT ".bcstate"
+
+// set the magic bytes and format version at the start of a state file
+#define STATE_MAGIC "BCSTATE\0"
+#define STATE_VERSION 1
+
+// set the number of keys read at once from each state file while merging
+#define STATE_CHUNK 65536
+
+// set the width of the UMI and tag fields of a state key. State keys use the UMI key layout with the barcode ID replaced by the barcode's position in the
+// barcode table of the file, so sorted state keys are sorted by barcode sequence, tag and UMI.
+#define STATE_KEY_LOW_MASK ((1ULL << UMI_KEY_BC_SHIFT) - 1)
+
+// define state_header struct for the start of a state file. The header is followed by "t_count" state_tag records, the "n_barcodes" packed barcodes
+// counted in the run in ascending order, the "n_keys" state keys in ascending order and the read count of each key.
+// "stats" holds the summary statistics of the run in count_stats order. A shard of a sharded run records its "shard_index" and "shard_count";
+// unsharded runs have a "shard_count" of 0 or 1.
+typedef struct state_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t bc_len;
+    uint32_t umi_len;
+    uint32_t t_count;
+    uint16_t shard_index;
+    uint16_t shard_count;
+    uint64_t n_barcodes;
+    uint64_t n_keys;
+    uint64_t stats[6];
+} state_header;
+
+// define state_tag struct for the sequence and name of one tag in a state file, NUL padded
+typedef struct state_tag {
+    char seq[TAG_LEN + 1];
+    char name[NAME_LEN + 1];
+} state_tag;
+
+// Write the deduplicated UMIs of UMI set "set", which must count reads, to the state file "path" with the "t_count" tags and names of the run,
+// UMI length "umi_len", summary statistics "stats" and shard "shard_index" of "shard_count". Barcode IDs are resolved to packed barcodes with "index".
+// Returns true if successful, else returns false.
+bool write_state_file(const char *path, const umi_set* set, const bc_index* index, char tags[MAX_TAGS][TAG_LEN + 1], char names[MAX_TAGS][NAME_LEN + 1],
+    int t_count, int umi_len, const count_stats* stats, int shard_index, int shard_count);
+
+// Read the header of state file "path" into "header" and its tags and names into "tags" and "names". Returns true if successful, else returns false.
+bool read_state_header(const char *path, state_header* header, char tags[MAX_TAGS][TAG_LEN + 1], char names[MAX_TAGS][NAME_LEN + 1]);
+
+// Merge the "n_files" state files "paths", which share a taglist and UMI length "umi_len", into "counts" (initialized here for "t_count" tags).
+// Combinations of barcode, tag and UMI found in several files are counted once, and with "directional" the UMIs of each barcode and tag are collapsed
+// using the read counts summed over all files; "collapsed" counts the UMIs absorbed. If "whitelist" is not NULL counts use its barcode IDs and barcodes
+// not in it are skipped and counted in "skipped"; otherwise every barcode is counted and numbered in ascending order in "merged", whose codes must be freed.
+// Returns true if successful, else returns false.
+bool merge_state_files(char **paths, int n_files, int t_count, int umi_len, bool directional, const bc_index* whitelist, bc_index* merged,
+    count_matrix* counts, unsigned long long int *collapsed, unsigned long long int *skipped);
+
+#endif // STATE_H
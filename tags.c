@@ -6,6 +6,7 @@ See LICENSE for code reuse permissions.
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "tags.h"
@@ -152,141 +153,176 @@ void check_tag_dist(char tags[MAX_TAGS][TAG_LEN + 1], int t_count)
     }
 }
 
-// load a trie of every possible tag seq with 1 hamming distance from a tag in the taglist of length "t_count".
-bool load_tag_trie(char tags[MAX_TAGS][TAG_LEN + 1], tag_node* tag_root, int t_count)
+// 3 bit code of each base (A=1, C=2, G=3, T=4, N=5). Every other character is 0.
+static const unsigned char tag_base_codes[256] = {
+    ['A'] = 1, ['C'] = 2, ['G'] = 3, ['T'] = 4, ['N'] = 5
+};
+
+// Pack the TAG_LEN bases of "tag" into "code" at TAG_BASE_BITS bits per base. Returns false if "tag" contains a non DNA base.
+static inline bool pack_tag(const char *tag, uint64_t *code)
 {
-    char tag[TAG_LEN + 1];
+    uint64_t c = 0;
+    unsigned char b;
+    bool valid = true;
+    for (int i = 0; i < TAG_LEN; i++)
+    {
+        b = tag_base_codes[(unsigned char) tag[i]];
+        valid &= (b != 0);
+        c = (c << TAG_BASE_BITS) | b;
+    }
+    *code = c;
+    return valid;
+}
+
+// Returns the home slot of packed tag "code" (multiplicative hashing of the code into the top bits)
+static inline uint32_t tag_hash(uint64_t code, int shift)
+{
+    return (uint32_t) ((code * 0x9E3779B97F4A7C15ULL) >> shift);
+}
 
-    // set variables for adding seqs + 1 hamming dist from tag. "next" is first base to test (index of bases), "temp" stored temp tag string. Includes 'N' to allow for a single 'N' in tag sequence.
-    char bases[5] = "NACGT";
-    char temp[TAG_LEN + 1];
-    int next;
+// add packed tag sequence "code" with tag index "t" to the tag index. A sequence that is already present takes the new tag index.
+static void insert_tag(tag_index* index, uint64_t code, int t)
+{
+    uint32_t s = tag_hash(code, index->shift);
+    while (index->slots[s] != 0 && (index->slots[s] & TAG_CODE_MASK) != code)
+    {
+        s = (s + 1) & index->mask;
+    }
+    index->slots[s] = ((uint64_t) (t + 1) << TAG_SLOT_INDEX_SHIFT) | code;
+}
+
+// load a hash table of every tag in the taglist of length "t_count" and every seq with 1 hamming distance from a tag (including a single 'N') into "index".
+// Returns true if successful, else returns false.
+bool load_tag_index(char tags[MAX_TAGS][TAG_LEN + 1], tag_index* index, int t_count)
+{
+    uint64_t code;
+    uint64_t variant;
+    uint64_t base;
+    int shift;
+
+    // size the table to a power of two with a load factor of at most 0.5. Each tag adds itself plus 4 substitutions at every position.
+    uint64_t entries = (uint64_t) t_count * (1 + 4 * TAG_LEN);
+    int bits = 4;
+    while (((uint64_t) 1 << bits) < entries * 2)
+    {
+        bits++;
+    }
+    index->mask = (uint32_t) (((uint64_t) 1 << bits) - 1);
+    index->shift = 64 - bits;
+    index->slots = calloc((uint64_t) index->mask + 1, sizeof(uint64_t));
+    if (index->slots == NULL)
+    {
+        return false;
+    }
 
     // loop through all tags in taglist
     for (int t = 0; t < t_count; t++)
     {
-        // update tag to check
-        // tag = tags[t];
-        strcpy(tag, tags[t]);
-
-        if (!add_tag(tag, tag_root, t))
+        if (!pack_tag(tags[t], &code))
         {
-            printf("failed to add tag %s\n", tag);
-            return false;
+            printf("Non DNA base included in taglist tag %s. Exiting...\n", tags[t]);
+            exit(17);
         }
+        insert_tag(index, code, t);
 
-        // change base at every position and add to trie
+        // add tag seq with each of the three remaining bases + 'N' substituted at every position
         for (int m = 0; m < TAG_LEN; m++)
         {
-            // reset temp to equal tag
-            strcpy(temp, tag);
-
-            // add tag string with each of the three remaining bases + 'N' substituted at postion m
-            switch(temp[m])
-            {
-                case 'A': next = 2; break;
-                case 'C': next = 3; break;
-                case 'G': next = 4; break;
-                case 'T': next = 5; break;
-            }
-            for (int r = 0; r < 4; r++)
+            shift = (TAG_LEN - 1 - m) * TAG_BASE_BITS;
+            base = (code >> shift) & 7;
+            for (uint64_t b = 1; b <= 5; b++)
             {
-                temp[m] = bases[(next+r)%5];
-                if (!add_tag(temp, tag_root, t))
+                if (b == base)
                 {
-                    printf("failed to add tag %s\n", tag);
-                    return false;
+                    continue;
                 }
+                variant = (code & ~(7ULL << shift)) | (b << shift);
+                insert_tag(index, variant, t);
             }
         }
     }
     return true;
 }
 
-// add a tag sequene to a trie and update "index" to equal the tag index in "tags" and "names" array. Including 'N' to allow for a single low quality basecall during sequencing.
-bool add_tag(char *tag, tag_node* tag_root, int t)
+// Returns the tag index of packed tag "code", or -1 if it is not in the tag index
+static inline int lookup_tag(uint64_t code, const tag_index* index)
 {
-    int i;
-    // declare and initialize travelling node pointer to NULL
-    tag_node* trav = tag_root;
-
-    for (int c = 0; c < TAG_LEN; c++)
+    uint64_t slot;
+    uint32_t s = tag_hash(code, index->shift);
+    while ((slot = index->slots[s]) != 0)
     {
-        // convert current character to int i for selectng the correct child node
-        switch(tag[c])
-        {
-            case 'A': i = 0; break;
-            case 'C': i = 1; break;
-            case 'G': i = 2; break;
-            case 'T': i = 3; break;
-            case 'N': i = 4; break;
-            default: printf("Non DNA base included in taglist tag %s. Exiting...\n", tag);
-                     exit(17);
-        }
-        //check the value at children[i]. If child doesn't exist, create child node move trav
-        if (trav->children[i] == NULL)
+        if ((slot & TAG_CODE_MASK) == code)
         {
-            trav->children[i] = calloc(1, sizeof(tag_node));
+            return (int) (slot >> TAG_SLOT_INDEX_SHIFT) - 1;
         }
-        trav = trav->children[i];
+        s = (s + 1) & index->mask;
     }
-    trav->exists = true;
-    trav->index = t;
-
-    return true;
+    return -1;
 }
 
-// Check tag_trie for tag seq. If present, returns tag index. Else, returns -1.
-int get_tag_index(const char *tag, tag_node* root)
+// Check the tag index for tag seq. If present, returns tag index. Else, returns -1.
+int get_tag_index(const char *tag, const tag_index* index)
 {
-    tag_node *m_trav = root;
-    int i;
-    for (int c = 0; c < TAG_LEN; c++)
-    {
-        // convert current character to int i for selectng the correct child node
-        switch(tag[c])
-        {
-            case 'A': i = 0; break;
-            case 'C': i = 1; break;
-            case 'G': i = 2; break;
-            case 'T': i = 3; break;
-            case 'N': i = 4; break;
-            default: printf("Non DNA base included in tag %s from input FastQ. Exiting...\n", tag);
-                     exit(25);
-        }
-        //check the value at children[i]
-        if (m_trav->children[i] == NULL)
-        {
-            return -1;
-        }
-        m_trav = m_trav->children[i];
-    }
-    if (m_trav->exists == true)
+    uint64_t code;
+    if (!pack_tag(tag, &code))
     {
-        return m_trav->index;
+        printf("Non DNA base included in tag %.*s from input FastQ. Exiting...\n", TAG_LEN, tag);
+        exit(25);
     }
-    return -1;
+    return lookup_tag(code, index);
 }
 
-// Unloads tag trie from memory. Returns true if successful, else returns false.
-bool unload_tag_trie(tag_node *root)
+// Search read2 sequence "seq" of length "len" for a tag starting at most "window" bases before or after offset "first".
+// The tag at "first" is looked up first; only on a miss is the rest of the window scanned, keeping the hit closest to "first".
+// 'N' is accepted like any other base, and any other non DNA base in the scanned bases exits like get_tag_index. Returns the tag index and sets "pos" to the start of the tag, or returns -1 if no tag is found.
+int find_tag_index(const char *seq, int len, int first, int window, const tag_index* index, int *pos)
 {
-    tag_node *unload_trav = root;
-    unload_tag_helper(unload_trav);
-    return true;
-}
+    uint64_t code;
+    int t;
 
-// helper function for unload_tag_trie
-void unload_tag_helper(tag_node* unload_trav)
-{
-    for (int i=0; i<5; i++)
+    // most reads have the tag at the expected offset
+    if (first + TAG_LEN <= len && (t = get_tag_index(seq + first, index)) != -1)
+    {
+        *pos = first;
+        return t;
+    }
+
+    // roll the packed window one base at a time across the search window
+    int start = (first - window > 0) ? first - window : 0;
+    int end = (first + window + TAG_LEN < len) ? first + window + TAG_LEN : len;
+    int best = -1;
+    int best_dist = window + 1;
+    code = 0;
+    for (int i = start; i < end; i++)
     {
-        if (unload_trav->children[i] != NULL)
+        unsigned char b = tag_base_codes[(unsigned char) seq[i]];
+        if (b == 0)
+        {
+            printf("Non DNA base included in read2 sequence %.*s from input FastQ. Exiting...\n", len, seq);
+            exit(25);
+        }
+        code = ((code << TAG_BASE_BITS) | b) & TAG_CODE_MASK;
+        int p = i - TAG_LEN + 1;
+        int dist = (p > first) ? p - first : first - p;
+        // every later start is further from the expected offset than the best hit
+        if (p > first && dist >= best_dist)
         {
-            unload_tag_helper(unload_trav->children[i]);
+            break;
+        }
+        if (p >= start && p != first && dist < best_dist && (t = lookup_tag(code, index)) != -1)
+        {
+            best = t;
+            best_dist = dist;
+            *pos = p;
         }
     }
-
-    free(unload_trav);
+    return best;
 }
 
+// Unloads tag index from memory. Returns true if successful, else returns false.
+bool unload_tag_index(tag_index* index)
+{
+    free(index->slots);
+    index->slots = NULL;
+    return true;
+}
@@ -7,6 +7,7 @@ See LICENSE for code reuse permissions.
 #define TAGS_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "barcodes.h"
 
@@ -26,13 +27,20 @@ See LICENSE for code reuse permissions.
 #define TAG_FIRST 0
 
 
-// define tag_node struct
-typedef struct tag_node {
-    bool exists;
-    int index;
-    struct tag_node* children[5];
-} tag_node;
+// set the number of bits used per tag base. 3 bits cover A, C, G, T and N (codes 1-5), so 0 never appears in a valid packed tag.
+#define TAG_BASE_BITS 3
 
+// set the mask of the packed tag sequence in a tag index slot. The tag index + 1 is stored above it, starting at TAG_SLOT_INDEX_SHIFT.
+#define TAG_CODE_MASK ((1ULL << (TAG_LEN * TAG_BASE_BITS)) - 1)
+#define TAG_SLOT_INDEX_SHIFT 48
+
+// define tag_index struct, an open addressing hash table with linear probing of every packed tag and every sequence 1 hamming distance
+// (including a single 'N') from a tag. Each slot holds the packed sequence and its tag index + 1; empty slots are 0.
+typedef struct tag_index {
+    uint64_t *slots;
+    uint32_t mask;
+    int shift;
+} tag_index;
 
 // calculate the hamming distance of two strings
 int hamming_distance(char *str1, char *str2);
@@ -51,20 +59,20 @@ int in_names_array(char names[MAX_TAGS][NAME_LEN + 1], char *s, int l);
 // Check Taglist for hamming dist to ensure that each tag has a hamming dist of >= MIN_TAG_HDIST to every other tag
 void check_tag_dist(char tags[MAX_TAGS][TAG_LEN + 1], int t_count);
 
-// load a trie of every possible tag seq with 1 hamming distance from a tag in the taglist of length "t_count".
-bool load_tag_trie(char tags[MAX_TAGS][TAG_LEN + 1], tag_node* tag_root, int t_count);
-
-// add a tag sequene to a trie and update "index" to equal the tag index in "tags" and "names" array. Including 'N' to allow for a single low quality basecall during sequencing.
-bool add_tag(char *tag, tag_node* tag_root, int t);
+// load a hash table of every tag in the taglist of length "t_count" and every seq with 1 hamming distance from a tag (including a single 'N') into "index".
+// Returns true if successful, else returns false.
+bool load_tag_index(char tags[MAX_TAGS][TAG_LEN + 1], tag_index* index, int t_count);
 
-// Check tag_trie for tag seq. If present, returns tag index. Else, returns -1.
-int get_tag_index(const char *tag, tag_node* root);
+// Check the tag index for tag seq. If present, returns tag index. Else, returns -1.
+int get_tag_index(const char *tag, const tag_index* index);
 
-// Unloads tag trie from memory. Returns true if successful, else returns false.
-bool unload_tag_trie(tag_node *root);
+// Search read2 sequence "seq" of length "len" for a tag starting at most "window" bases before or after offset "first".
+// The tag at "first" is looked up first; only on a miss is the rest of the window scanned, keeping the hit closest to "first".
+// 'N' is accepted like any other base, and any other non DNA base in the scanned bases exits like get_tag_index. Returns the tag index and sets "pos" to the start of the tag, or returns -1 if no tag is found.
+int find_tag_index(const char *seq, int len, int first, int window, const tag_index* index, int *pos);
 
-// helper function for unload_tag_trie
-void unload_tag_helper(tag_node* unload_trav);
+// Unloads tag index from memory. Returns true if successful, else returns false.
+bool unload_tag_index(tag_index* index);
 
 
 #endif // TAGS_H
\ No newline at end of file
@@ -6,129 +6,230 @@ See LICENSE for code reuse permissions.
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "umis.h"
-#include "barcodes.h"
+#include "counts.h"
 
-// add a UMI sequene to a trie. Does not allow for 'N' bases.
-// Each UMI leaf will track an array of pointers to linked lists of cell barcodes. This ensures that every combo of barcode/UMI/Tag is unique.
-// If UMI is added: returns true. Else if UMI is NOT added, returns false.
-bool add_umi(char *umi, umi_node* umi_root, int t_count, int t_index, char *cell)
+// Returns the home slot of UMI key "key" (multiplicative hashing of the key into the top bits)
+static inline uint64_t umi_hash(uint64_t key, int shift)
 {
-    int i;
-    // declare and initialize travelling node pointer to NULL
-    umi_node* trav = umi_root;
+    return (key * 0x9E3779B97F4A7C15ULL) >> shift;
+}
 
-    for (int c = 0; c < UMI_LEN; c++)
+// Returns the slot of "key" in "keys", or the empty slot where it would be inserted
+static inline uint64_t find_slot(const uint64_t *keys, uint64_t mask, int shift, uint64_t key)
+{
+    uint64_t s = umi_hash(key, shift);
+    while (keys[s] != 0 && keys[s] != key)
     {
-        // convert current character to int i for selectng the correct child node
-        switch(umi[c])
-        {
-            case 'A': i = 0; break;
-            case 'C': i = 1; break;
-            case 'G': i = 2; break;
-            case 'T': i = 3; break;
-            case 'N': return false;
-            default: printf("Non DNA base included in UMI %s. Exiting...\n", umi);
-                     exit(26);
-        }
-        //check the value at children[i]. If child doesn't exist, create child node move trav
-        if (trav->children[i] == NULL)
+        s = (s + 1) & mask;
+    }
+    return s;
+}
+
+// double the number of slots in the set and re-insert every key, with its read count if the set counts reads. Returns true if successful, else returns false.
+static bool grow_umi_set(umi_set* set)
+{
+    uint64_t n_slots = (set->mask + 1) * 2;
+    uint64_t *keys = calloc(n_slots, sizeof(uint64_t));
+    uint32_t *reads = (set->reads != NULL) ? malloc(n_slots * sizeof(uint32_t)) : NULL;
+    if (keys == NULL || (set->reads != NULL && reads == NULL))
+    {
+        free(keys);
+        free(reads);
+        return false;
+    }
+    for (uint64_t s = 0; s <= set->mask; s++)
+    {
+        if (set->keys[s] != 0)
         {
-            trav->children[i] = calloc(1, sizeof(umi_node));
+            uint64_t d = find_slot(keys, n_slots - 1, set->shift - 1, set->keys[s]);
+            keys[d] = set->keys[s];
+            if (reads != NULL)
+            {
+                reads[d] = set->reads[s];
+            }
         }
-        trav = trav->children[i];
     }
-    trav->exists = true;
+    free(set->keys);
+    free(set->reads);
+    set->keys = keys;
+    set->reads = reads;
+    set->mask = n_slots - 1;
+    set->shift--;
+    return true;
+}
 
-    // allocate array of t_count linked lists of cell barcodes
-    if (trav->tag_lists == NULL)
+// base codes used to pack UMIs: the low 2 bits hold the base (A=0, C=1, G=2, T=3), 0x10 marks a DNA base and 0x20 marks an 'N'. Any other character is 0.
+static const uint8_t umi_base_codes[256] = {
+    ['A'] = 0x10, ['C'] = 0x11, ['G'] = 0x12, ['T'] = 0x13, ['N'] = 0x30
+};
+
+// Pack the "len" bases of "seq" into "code" without branching on the bases. Returns 1 if successful, 0 if "seq" contains an 'N' and -1 for any other non DNA base.
+// Always inlined, so calls with a constant "len" are compiled to fully unrolled copies.
+static inline __attribute__((always_inline)) int pack_bases(const char *seq, int len, uint32_t *code)
+{
+    uint32_t c = 0;
+    uint8_t all = 0x10;
+    uint8_t any = 0;
+    for (int b = 0; b < len; b++)
+    {
+        uint8_t v = umi_base_codes[(unsigned char) seq[b]];
+        c = (c << 2) | (v & 3);
+        all &= v;
+        any |= v;
+    }
+    *code = c;
+    if ((all & 0x10) == 0)
     {
-        trav->tag_lists = calloc(1, sizeof(list_node*) * t_count);
+        return -1;
     }
+    return (any & 0x20) ? 0 : 1;
+}
 
-    // add cell barcode to linked list for specific tag
-    if (trav->tag_lists[t_index] == NULL)
+// Pack UMI "umi" of length "len" (at most UMI_MAX_LEN) into "code" at 2 bits per base. Returns false if the UMI contains an 'N', which are not counted.
+// Exits the program if "umi" contains any other non DNA base.
+bool pack_umi(const char *umi, int len, uint32_t *code)
+{
+    int valid;
+    // the UMI lengths of the chemistry presets get their own unrolled kernels
+    switch (len)
+    {
+        case 12: valid = pack_bases(umi, 12, code); break;
+        case 10: valid = pack_bases(umi, 10, code); break;
+        default: valid = pack_bases(umi, len, code); break;
+    }
+    if (valid < 0)
     {
-        trav->tag_lists[t_index] = calloc(1, sizeof(list_node));
+        printf("Non DNA base included in UMI %.*s. Exiting...\n", len, umi);
+        exit(26);
     }
-    // initialize travelling list pointer to beginning of correct tag list
-    list_node* l_trav = trav->tag_lists[t_index];
+    return valid == 1;
+}
 
-    // check linked list for cell barcode. If cell barcode is already listed: return
-    while (true)
+// Initialize an empty UMI set. If "count_reads" is true the set also counts the reads of every key. Returns true if successful, else returns false.
+bool init_umi_set(umi_set* set, bool count_reads)
+{
+    int bits = 0;
+    while ((1 << bits) < UMI_SET_SLOTS)
     {
-        // node has no "cell" barcode
-        if (strlen(l_trav->barcode) == 0)
-        {
-            // update list node with cell barcode
-            strcpy(l_trav->barcode, cell);
-            return true;
-        }
-        // if "cell" is already in the list: no need to add, break loop
-        else if (strcmp(l_trav->barcode, cell) == 0)
+        bits++;
+    }
+    set->keys = calloc(UMI_SET_SLOTS, sizeof(uint64_t));
+    set->mask = UMI_SET_SLOTS - 1;
+    set->shift = 64 - bits;
+    set->n_keys = 0;
+    set->reads = count_reads ? malloc(UMI_SET_SLOTS * sizeof(uint32_t)) : NULL;
+    return set->keys != NULL && (!count_reads || set->reads != NULL);
+}
+
+// Add "reads" reads of UMI key "key" to the set. Every combination of barcode/UMI/tag is only added once; if the set counts reads, "reads" is added to its read count.
+// If the key is added: returns true. Else if the key was already in the set, returns false.
+bool add_umi_reads(umi_set* set, uint64_t key, uint32_t reads)
+{
+    // keep the set at most half full so probe sequences stay short
+    if ((set->n_keys + 1) * 2 > set->mask + 1)
+    {
+        if (!grow_umi_set(set))
         {
-            return false;
+            printf("Failed to allocate memory for UMIs. Exiting...\n");
+            exit(30);
         }
-        // if match is not found, proceed to next node. Allocate "next" if necessary.
-        if (l_trav->next == NULL)
+    }
+    uint64_t s = find_slot(set->keys, set->mask, set->shift, key);
+    if (set->keys[s] == key)
+    {
+        if (set->reads != NULL)
         {
-            l_trav->next = calloc(1, sizeof(list_node));
+            set->reads[s] += reads;
         }
-        // update l_trav to move to next node
-        l_trav = l_trav->next;
+        return false;
     }
+    set->keys[s] = key;
+    if (set->reads != NULL)
+    {
+        set->reads[s] = reads;
+    }
+    set->n_keys++;
     return true;
 }
 
-// Unloads umi trie from memory. Returns true if successful, else returns false.
-bool unload_umi_trie(umi_node *root, int t_count)
+// Add UMI key "key" to the set. Every combination of barcode/UMI/tag is only added once; if the set counts reads, the read count of the key is incremented.
+// If the key is added: returns true. Else if the key was already in the set, returns false.
+bool add_umi(umi_set* set, uint64_t key)
 {
-    umi_node *unload_trav = root;
-    unload_umi_helper(unload_trav, t_count);
-    return true;
+    return add_umi_reads(set, key, 1);
+}
+
+// Add the "n" UMI keys "keys" to the set as add_umi does, "lookup_batch" keys at a time: the home slots of a group of keys are prefetched
+// before any key of the group is added, so the cache misses of the group overlap.
+void add_umis(umi_set* set, const uint64_t *keys, int n, int lookup_batch)
+{
+    for (int g = 0; g < n; g += lookup_batch)
+    {
+        int end = (n - g < lookup_batch) ? n : g + lookup_batch;
+        // a key added later in the group may grow the set, which only makes the remaining prefetches useless
+        for (int k = g; k < end && lookup_batch > 1; k++)
+        {
+            uint64_t s = umi_hash(keys[k], set->shift);
+            __builtin_prefetch(&set->keys[s], 1, 1);
+            if (set->reads != NULL)
+            {
+                __builtin_prefetch(&set->reads[s], 1, 1);
+            }
+        }
+        for (int k = g; k < end; k++)
+        {
+            add_umi_reads(set, keys[k], 1);
+        }
+    }
 }
 
-// helper function for unload_bc_trie
-void unload_umi_helper(umi_node* unload_trav, int t_count)
+// Returns the number of reads of UMI key "key" in a set that counts reads, 0 if the key is not in the set.
+uint32_t get_umi_reads(const umi_set* set, uint64_t key)
 {
-    // temp variable to track current list node
-    list_node* temp = NULL;
-    list_node* p_next = NULL;
+    uint64_t s = find_slot(set->keys, set->mask, set->shift, key);
+    return (set->keys[s] == key) ? set->reads[s] : 0;
+}
 
-    for (int i=0; i<4; i++)
+// Add one tag count in "counts" to the whitelist barcode of every barcode/UMI/tag combination in UMI set "set".
+void count_umi_set(const umi_set* set, count_matrix* counts)
+{
+    uint64_t key;
+    for (uint64_t s = 0; s <= set->mask; s++)
     {
-        if (unload_trav->children[i] != NULL)
+        key = set->keys[s];
+        if (key != 0)
         {
-            unload_umi_helper(unload_trav->children[i], t_count);
+            add_count(counts, umi_key_bc(key), umi_key_tag(key));
         }
     }
-    // if in leaf node: all linked lists that were allocated via add_umi
-    if (unload_trav->tag_lists != NULL)
+}
+
+// Add every barcode/UMI/tag combination of UMI set "src" to UMI set "dest", summing read counts if both sets count reads.
+// Unless "counts" is NULL, combinations not already in "dest" add one tag count in "counts" to their whitelist barcode.
+void merge_umi_set(umi_set* dest, const umi_set* src, count_matrix* counts)
+{
+    uint64_t key;
+    for (uint64_t s = 0; s <= src->mask; s++)
     {
-        for (int j = 0; j < t_count; j++)
+        key = src->keys[s];
+        if (key != 0 && add_umi_reads(dest, key, (src->reads != NULL) ? src->reads[s] : 1) && counts != NULL)
         {
-            if (unload_trav->tag_lists[j] != NULL)
-            {
-                temp = unload_trav->tag_lists[j];
-                while (true)
-                {
-                    // if not at end of list: track pointer to next node, free current node, move to next node
-                    if (temp->next != NULL)
-                    {
-                        p_next = temp->next;
-                        free(temp);
-                        temp = p_next;
-                    }
-                    else {
-                        free(temp);
-                        break;
-                    }
-                }
-            }
+            add_count(counts, umi_key_bc(key), umi_key_tag(key));
         }
-        free(unload_trav->tag_lists);
     }
-    free(unload_trav);
-}
\ No newline at end of file
+}
+
+// Unloads UMI set from memory. Returns true if successful, else returns false.
+bool unload_umi_set(umi_set* set)
+{
+    free(set->keys);
+    free(set->reads);
+    set->keys = NULL;
+    set->reads = NULL;
+    set->n_keys = 0;
+    return true;
+}
@@ -7,40 +7,103 @@ See LICENSE for code reuse permissions.
 #define UMIS_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
-#include "barcodes.h"
+#include "counts.h"
 
-// set the length of UMI
+// set the default length of UMI (10X 3' v3). The UMI length of a run is chosen with its chemistry, see chemistry.h.
 #define UMI_LEN 12
 
-// set the first position of UMI in read1 sequences
+// set the maximum length of UMI. UMIs are packed 2 bits per base into the low UMI_KEY_TAG_SHIFT bits of a UMI key.
+#define UMI_MAX_LEN 14
+
+// set the default first position of UMI in read1 sequences
 #define UMI_FIRST 16
 
-// define list_node struct for linked list of cell barcodes with UMI for per tag
-typedef struct list_node {
-    char barcode[BC_LEN + 1];
-    struct list_node* next;
-} list_node;
+// bit layout of a UMI key: bits 0-27 hold the packed UMI, bits 28-36 the tag index and bits 37-62 the barcode ID.
+// Bit 63 is always set so that 0 marks an empty slot in the UMI set.
+#define UMI_KEY_TAG_SHIFT 28
+#define UMI_KEY_BC_SHIFT 37
+#define UMI_KEY_TAG_MASK 0x1ff
+#define UMI_KEY_BC_MASK 0x3ffffff
+#define UMI_KEY_UMI_MASK ((1ULL << UMI_KEY_TAG_SHIFT) - 1)
+#define UMI_KEY_USED (1ULL << 63)
+
+// set the initial number of slots in a UMI set
+#define UMI_SET_SLOTS (1 << 16)
+
+// define umi_set struct, an open addressing hash set of UMI keys with linear probing. The set doubles in size when it is half full.
+// If "reads" is not NULL it holds the number of reads of the key in each slot, which UMI collapsing uses to weight UMIs.
+typedef struct umi_set {
+    uint64_t *keys;
+    uint32_t *reads;
+    uint64_t mask;
+    int shift;
+    uint64_t n_keys;
+} umi_set;
+
+// Returns the UMI key of barcode ID "bc_id", tag index "t_index" and packed UMI "umi".
+static inline uint64_t umi_key(uint32_t bc_id, int t_index, uint32_t umi)
+{
+    return UMI_KEY_USED | ((uint64_t) bc_id << UMI_KEY_BC_SHIFT) | ((uint64_t) t_index << UMI_KEY_TAG_SHIFT) | umi;
+}
+
+// Returns the barcode ID of UMI key "key".
+static inline uint32_t umi_key_bc(uint64_t key)
+{
+    return (uint32_t) (key >> UMI_KEY_BC_SHIFT) & UMI_KEY_BC_MASK;
+}
+
+// Returns the tag index of UMI key "key".
+static inline int umi_key_tag(uint64_t key)
+{
+    return (int) (key >> UMI_KEY_TAG_SHIFT) & UMI_KEY_TAG_MASK;
+}
+
+// Returns the packed UMI of UMI key "key".
+static inline uint32_t umi_key_umi(uint64_t key)
+{
+    return (uint32_t) (key & UMI_KEY_UMI_MASK);
+}
+
+// Returns true if UMI keys "a" and "b" have the same barcode and tag.
+static inline bool umi_key_same_group(uint64_t a, uint64_t b)
+{
+    return (a >> UMI_KEY_TAG_SHIFT) == (b >> UMI_KEY_TAG_SHIFT);
+}
+
+// Pack UMI "umi" of length "len" (at most UMI_MAX_LEN) into "code" at 2 bits per base. Returns false if the UMI contains an 'N', which are not counted.
+// Exits the program if "umi" contains any other non DNA base.
+bool pack_umi(const char *umi, int len, uint32_t *code);
+
+// Initialize an empty UMI set. If "count_reads" is true the set also counts the reads of every key. Returns true if successful, else returns false.
+bool init_umi_set(umi_set* set, bool count_reads);
+
+// Add UMI key "key" to the set. Every combination of barcode/UMI/tag is only added once; if the set counts reads, the read count of the key is incremented.
+// If the key is added: returns true. Else if the key was already in the set, returns false.
+bool add_umi(umi_set* set, uint64_t key);
+
+// Add "reads" reads of UMI key "key" to the set. Every combination of barcode/UMI/tag is only added once; if the set counts reads, "reads" is added to its read count.
+// If the key is added: returns true. Else if the key was already in the set, returns false.
+bool add_umi_reads(umi_set* set, uint64_t key, uint32_t reads);
 
-// define umi_node struct
-typedef struct umi_node {
-    bool exists;
-    struct list_node** tag_lists;
-    struct umi_node* children[4];
-} umi_node;
+// Add the "n" UMI keys "keys" to the set as add_umi does, "lookup_batch" keys at a time: the home slots of a group of keys are prefetched
+// before any key of the group is added, so the cache misses of the group overlap.
+void add_umis(umi_set* set, const uint64_t *keys, int n, int lookup_batch);
 
+// Returns the number of reads of UMI key "key" in a set that counts reads, 0 if the key is not in the set.
+uint32_t get_umi_reads(const umi_set* set, uint64_t key);
 
-// add a UMI sequene to a trie. Does not allow for 'N' bases.
-// Each UMI leaf will track an array of pointers to linked lists of cell barcodes. This ensures that every combo of barcode/UMI/Tag is unique.
-// If UMI is added: returns true. Else if UMI is NOT added, returns false.
-bool add_umi(char *umi, umi_node* umi_root, int t_count, int t_index, char *cell);
+// Add one tag count in "counts" to the whitelist barcode of every barcode/UMI/tag combination in UMI set "set".
+void count_umi_set(const umi_set* set, count_matrix* counts);
 
-// Unloads umi trie from memory. Returns true if successful, else returns false.
-bool unload_umi_trie(umi_node* root, int t_count);
+// Add every barcode/UMI/tag combination of UMI set "src" to UMI set "dest", summing read counts if both sets count reads.
+// Unless "counts" is NULL, combinations not already in "dest" add one tag count in "counts" to their whitelist barcode.
+void merge_umi_set(umi_set* dest, const umi_set* src, count_matrix* counts);
 
-// helper function for unload_bc_trie
-void unload_umi_helper(umi_node* unload_trav, int t_count);
+// Unloads UMI set from memory. Returns true if successful, else returns false.
+bool unload_umi_set(umi_set* set);
 
 
 
-#endif // UMIS_H
\ No newline at end of file
+#endif // UMIS_H